@@ -3,12 +3,18 @@
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 
 struct range
 {   
     int start, stop;
 };
 
+// Count of heap allocations made by the array types
+// on the current thread. Can be used to check that
+// code runs without allocating.
+static thread_local int array_allocations = 0;
+
 //--------------------------------------
 
 // Basic type representing a pointer to some
@@ -46,13 +52,14 @@ template<typename T>
 struct array1d
 {
     int size;
+    int capacity;
     T* data;
     
-    array1d() : size(0), data(NULL) {}
+    array1d() : size(0), capacity(0), data(NULL) {}
     array1d(int _size) : array1d() { resize(_size);  }
     array1d(const slice1d<T>& rhs) : array1d() { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); }
     array1d(const array1d<T>& rhs) : array1d() { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); }
-    ~array1d() { resize(0); }
+    ~array1d() { if (capacity > 0) { free(data); } }
     
     array1d& operator=(const slice1d<T>& rhs) { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); return *this; };
     array1d& operator=(const array1d<T>& rhs) { resize(rhs.size); memcpy(data, rhs.data, rhs.size * sizeof(T)); return *this; };
@@ -66,26 +73,51 @@ struct array1d
     void zero() { memset(data, 0, sizeof(T) * size); }
     void set(const T& x) { for (int i = 0; i < size; i++) { data[i] = x; } }
     
+    // Exchanges data with another array without copying
+    void swap(array1d<T>& rhs)
+    {
+        int s = size; size = rhs.size; rhs.size = s;
+        int c = capacity; capacity = rhs.capacity; rhs.capacity = c;
+        T* d = data; data = rhs.data; rhs.data = d;
+    }
+    
+    // Makes the array refer to memory it does not own, 
+    // such as a memory mapped file. This memory is never
+    // written to or freed, and the array makes its own 
+    // copy as soon as it is resized to anything non-zero.
+    void borrow(const slice1d<T> rhs)
+    {
+        if (capacity > 0) { free(data); }
+        size = rhs.size;
+        capacity = 0;
+        data = rhs.data;
+    }
+    
+    // Memory is only reallocated when growing beyond the 
+    // current capacity, so arrays reused as scratch space
+    // can shrink and grow again without allocating.
     void resize(int _size)
     {
-        if (_size == 0 && size != 0)
+        if (_size > capacity)
         {
-            free(data);
-            data = NULL;
-            size = 0;
-        }
-        else if (_size > 0 && size == 0)
-        {
-            data = (T*)malloc(_size * sizeof(T));
-            assert(data != NULL);
-            size = _size;
-        }
-        else if (_size > 0 && size > 0 && _size != size)
-        {
-            data = (T*)realloc(data, _size * sizeof(T));
-            assert(data != NULL);           
-            size = _size;
+            if (capacity == 0 && data != NULL)
+            {
+                T* borrowed = data;
+                data = (T*)malloc(_size * sizeof(T));
+                assert(data != NULL);
+                memcpy(data, borrowed, (size < _size ? size : _size) * sizeof(T));
+            }
+            else
+            {
+                data = (T*)realloc(data, _size * sizeof(T));
+                assert(data != NULL);
+            }
+            
+            capacity = _size;
+            array_allocations++;
         }
+        
+        size = _size;
     }
 };
 
@@ -135,6 +167,7 @@ struct inplace_array1d
             {
                 data = (T*)malloc(_size * sizeof(T));
                 assert(data != NULL);
+                array_allocations++;
             }
             else
             {
@@ -149,12 +182,14 @@ struct inplace_array1d
             {
                 data = (T*)realloc(data, _size * sizeof(T));
                 assert(data != NULL);   
+                array_allocations++;
             }
             else if (_size > N && size <= N)
             {
                 data = (T*)malloc(_size * sizeof(T));
                 assert(data != NULL);
                 memcpy(data, buff, size * sizeof(T));
+                array_allocations++;
             }
             else if (size > N && _size <= N)
             {
@@ -171,9 +206,11 @@ struct inplace_array1d
 
 //--------------------------------------
 
+// Number of bytes allocated to store `size` bits, 
+// rounded up to a whole number of 64-bit words
 static inline int bit_alloc_size(int size)
 {
-    return ((size + 8 - 1) / 8) * 8;
+    return ((size + 64 - 1) / 64) * 8;
 }
 
 static inline bool bit_get(const unsigned char* __restrict__ data, int i)
@@ -186,6 +223,145 @@ static inline void bit_set(unsigned char* __restrict__ data, int i, bool v)
     data[i / 8] ^= (-v ^ data[i / 8]) & (1 << (i % 8));    
 }
 
+// Loads `n` bits (at most 8) starting at bit `i` into the 
+// low bits of a byte. Only touches the bytes containing 
+// those bits. High bits beyond `n` are unspecified.
+static inline unsigned char bit_load8(const unsigned char* __restrict__ data, int i, int n = 8)
+{
+    const unsigned char* p = data + i / 8;
+    int s = i % 8;
+    return s + n > 8 ? (unsigned char)((p[0] >> s) | (p[1] << (8 - s))) : (unsigned char)(p[0] >> s);
+}
+
+// Loads 64 bits starting at bit `i`. Bits are stored 
+// least significant first, so on little-endian targets 
+// a plain unaligned word load gives the bits in order 
+// and any sub-byte offset can be funnel shifted in.
+static inline uint64_t bit_load64(const unsigned char* __restrict__ data, int i)
+{
+    const unsigned char* p = data + i / 8;
+    int s = i % 8;
+    uint64_t w;
+    memcpy(&w, p, sizeof(uint64_t));
+    return s == 0 ? w : (w >> s) | ((uint64_t)p[8] << (64 - s));
+}
+
+// Loads `n` bits (less than 64) starting at bit `i` into 
+// the low bits of a word, with the high bits cleared. Only
+// touches the bytes containing those bits.
+static inline uint64_t bit_load64(const unsigned char* __restrict__ data, int i, int n)
+{
+    const unsigned char* p = data + i / 8;
+    int s = i % 8;
+    int nbytes = (s + n + 7) / 8;
+    uint64_t w = 0;
+    memcpy(&w, p, nbytes < 8 ? nbytes : 8);
+    w = nbytes > 8 ? (w >> s) | ((uint64_t)p[8] << (64 - s)) : w >> s;
+    return w & ((1ull << n) - 1);
+}
+
+// Number of set bits in a 64-bit word
+static inline int bit_popcount64(uint64_t w)
+{
+    return __builtin_popcountll(w);
+}
+
+// Index of the lowest set bit in a non-zero 64-bit word
+static inline int bit_ctz64(uint64_t w)
+{
+    return __builtin_ctzll(w);
+}
+
+// Writes the bits of `v` selected by `m` into `*p`
+static inline void bit_store8_masked(unsigned char* __restrict__ p, unsigned char v, unsigned char m)
+{
+    *p = (unsigned char)((*p & ~m) | (v & m));
+}
+
+// Sets `n` bits starting at bit `i` to `v`. Whole bytes 
+// are filled with memset and only the partial bytes at
+// either end need masking.
+static inline void bit_fill(unsigned char* __restrict__ data, int i, int n, bool v)
+{
+    if (n <= 0) { return; }
+    
+    unsigned char* p = data + i / 8;
+    unsigned char b = v ? 0xFF : 0x00;
+    int s = i % 8;
+    
+    if (s + n <= 8)
+    {
+        bit_store8_masked(p, b, ((1 << n) - 1) << s);
+        return;
+    }
+    
+    if (s != 0)
+    {
+        bit_store8_masked(p, b, 0xFF << s);
+        p++;
+        n -= 8 - s;
+    }
+    
+    memset(p, b, n / 8);
+    
+    if (n % 8 != 0)
+    {
+        bit_store8_masked(p + n / 8, b, (1 << (n % 8)) - 1);
+    }
+}
+
+// Copies `n` bits from bit `src_i` of `src` to bit `dst_i` 
+// of `dst`. Once the destination is byte aligned, a source
+// which is also aligned is copied with memcpy, otherwise 
+// it is funnel shifted into place 64 bits at a time.
+static inline void bit_copy(
+    unsigned char* __restrict__ dst, int dst_i, 
+    const unsigned char* __restrict__ src, int src_i, 
+    int n)
+{
+    if (n <= 0) { return; }
+    
+    unsigned char* p = dst + dst_i / 8;
+    int s = dst_i % 8;
+    
+    // Copy head bits until destination is byte aligned
+    if (s != 0)
+    {
+        int h = n < 8 - s ? n : 8 - s;
+        bit_store8_masked(p, bit_load8(src, src_i, h) << s, ((1 << h) - 1) << s);
+        p++;
+        src_i += h;
+        n -= h;
+    }
+    
+    // Copy middle bytes
+    if (src_i % 8 == 0)
+    {
+        memcpy(p, src + src_i / 8, n / 8);
+    }
+    else
+    {
+        int i = 0;
+        for (; i + 64 <= n; i += 64)
+        {
+            uint64_t w = bit_load64(src, src_i + i);
+            memcpy(p + i / 8, &w, sizeof(uint64_t));
+        }
+        
+        for (; i + 8 <= n; i += 8)
+        {
+            p[i / 8] = bit_load8(src, src_i + i);
+        }
+    }
+    
+    // Copy tail bits
+    int t = n % 8;
+    if (t != 0)
+    {
+        bit_store8_masked(p + n / 8, bit_load8(src, src_i + n - t, t), (1 << t) - 1);
+    }
+}
+
 struct slice1d_bit
 {
     int size;
@@ -194,7 +370,7 @@ struct slice1d_bit
     
     slice1d_bit(int _size, int _offset, unsigned char* _data) : size(_size), offset(_offset), data(_data) {}
 
-    slice1d_bit& operator=(const slice1d_bit& rhs) { assert(size == rhs.size); for (int i = 0; i < size; i++) { set(i, rhs.get(i)); } return *this; };
+    slice1d_bit& operator=(const slice1d_bit& rhs) { assert(size == rhs.size); bit_copy(data, offset, rhs.data, rhs.offset, size); return *this; };
     
     inline bool get(int i) const { assert(i >= 0 && i < size); return bit_get(data, i + offset); }
     inline void set(int i, bool v) { assert(i >= 0 && i < size); bit_set(data, i + offset, v); }
@@ -203,23 +379,24 @@ struct slice1d_bit
     slice1d_bit slice_from(int start) const { return slice1d_bit(size - start, offset + start % 8, data + start / 8); }
     slice1d_bit slice(range r) const { return slice1d_bit(r.stop - r.start, offset + r.start % 8, data + r.start / 8); }
     
-    void zero() { for (int i = 0; i < size; i++) { set(i, false); } }
-    void one() { for (int i = 0; i < size; i++) { set(i, true); } }
+    void zero() { bit_fill(data, offset, size, false); }
+    void one() { bit_fill(data, offset, size, true); }
 };
 
 struct array1d_bit
 {
     int size;
+    int capacity;
     unsigned char* data;
     
-    array1d_bit() : size(0), data(NULL) {}
+    array1d_bit() : size(0), capacity(0), data(NULL) {}
     array1d_bit(int _size) : array1d_bit() { resize(_size);  }
-    array1d_bit(const slice1d_bit& rhs) : array1d_bit() { resize(rhs.size); for (int i = 0; i < size; i++) { set(i, rhs.get(i)); } }
-    array1d_bit(const array1d_bit& rhs) : array1d_bit() { resize(rhs.size); for (int i = 0; i < size; i++) { set(i, rhs.get(i)); } }
-    ~array1d_bit() { resize(0); }
+    array1d_bit(const slice1d_bit& rhs) : array1d_bit() { resize(rhs.size); bit_copy(data, 0, rhs.data, rhs.offset, size); }
+    array1d_bit(const array1d_bit& rhs) : array1d_bit() { resize(rhs.size); memcpy(data, rhs.data, (size + 7) / 8); }
+    ~array1d_bit() { if (capacity > 0) { free(data); } }
     
-    array1d_bit& operator=(const slice1d_bit& rhs) { resize(rhs.size); for (int i = 0; i < size; i++) { set(i, rhs.get(i)); } return *this; };
-    array1d_bit& operator=(const array1d_bit& rhs) { resize(rhs.size); for (int i = 0; i < size; i++) { set(i, rhs.get(i)); } return *this; };
+    array1d_bit& operator=(const slice1d_bit& rhs) { resize(rhs.size); bit_copy(data, 0, rhs.data, rhs.offset, size); return *this; };
+    array1d_bit& operator=(const array1d_bit& rhs) { resize(rhs.size); memcpy(data, rhs.data, (size + 7) / 8); return *this; };
 
     inline bool get(int i) const { assert(i >= 0 && i < size); return bit_get(data, i); }
     inline void set(int i, bool v) { assert(i >= 0 && i < size); bit_set(data, i, v); }
@@ -228,29 +405,49 @@ struct array1d_bit
     slice1d_bit slice_from(int start) const { return slice1d_bit(size - start, start % 8, data + start / 8); }
     slice1d_bit slice(range r) const { return slice1d_bit(r.stop - r.start, r.start % 8, data + r.start / 8); }
     
-    void zero() { for (int i = 0; i < size; i++) { set(i, false); } }
-    void one() { for (int i = 0; i < size; i++) { set(i, true); } }
+    void zero() { bit_fill(data, 0, size, false); }
+    void one() { bit_fill(data, 0, size, true); }
     
+    void swap(array1d_bit& rhs)
+    {
+        int s = size; size = rhs.size; rhs.size = s;
+        int c = capacity; capacity = rhs.capacity; rhs.capacity = c;
+        unsigned char* d = data; data = rhs.data; rhs.data = d;
+    }
+    
+    // Refers to memory which is not owned, as for `array1d`
+    void borrow(int _size, unsigned char* _data)
+    {
+        if (capacity > 0) { free(data); }
+        size = _size;
+        capacity = 0;
+        data = _data;
+    }
+    
+    // Memory is only reallocated when growing beyond the 
+    // current capacity in bits, as for `array1d`.
     void resize(int _size)
     {
-        if (_size == 0 && size != 0)
-        {
-            free(data);
-            data = NULL;
-            size = 0;
-        }
-        else if (_size > 0 && size == 0)
-        {
-            data = (unsigned char*)malloc(bit_alloc_size(_size));
-            assert(data != NULL);
-            size = _size;
-        }
-        else if (_size > 0 && size > 0 && _size != size)
+        if (_size > capacity)
         {
-            data = (unsigned char*)realloc(data, bit_alloc_size(_size));
-            assert(data != NULL);           
-            size = _size;
+            if (capacity == 0 && data != NULL)
+            {
+                unsigned char* borrowed = data;
+                data = (unsigned char*)malloc(bit_alloc_size(_size));
+                assert(data != NULL);
+                memcpy(data, borrowed, bit_alloc_size(size < _size ? size : _size));
+            }
+            else
+            {
+                data = (unsigned char*)realloc(data, bit_alloc_size(_size));
+                assert(data != NULL);
+            }
+            
+            capacity = bit_alloc_size(_size) * 8;
+            array_allocations++;
         }
+        
+        size = _size;
     }
 };
 
@@ -11,160 +11,284 @@ extern "C"
 
 #include "array.h"
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+
+// Windows headers clash with raylib so the few functions 
+// needed for memory mapping files are declared directly
+#if defined(_WIN32)
+extern "C"
+{
+    __declspec(dllimport) void* __stdcall CreateFileA(const char*, unsigned long, unsigned long, void*, unsigned long, unsigned long, void*);
+    __declspec(dllimport) void* __stdcall CreateFileMappingA(void*, void*, unsigned long, unsigned long, unsigned long, const char*);
+    __declspec(dllimport) void* __stdcall MapViewOfFile(void*, unsigned long, unsigned long, unsigned long, size_t);
+    __declspec(dllimport) int __stdcall UnmapViewOfFile(const void*);
+    __declspec(dllimport) int __stdcall GetFileSizeEx(void*, long long*);
+    __declspec(dllimport) int __stdcall CloseHandle(void*);
+}
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <initializer_list>
 #include <functional>
 #include <vector>
 #include <string>
 #include <algorithm>
 #include <unordered_map>
+#include <map>
+#include <chrono>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+
+#if defined(RANGES_BENCHMARK)
+#include <random>
+#endif
 
 //--------------------------------------
 
-// Process union operation on arrays of ranges.
-// Assumes `out` is pre-allocated to be large enough 
-// to store result. Returns the number of ranges 
-// generated as output.
-int ranges_union(
+// Set operations shared by the range and mask kernels
+enum
+{
+    SET_OP_UNION,
+    SET_OP_INTERSECTION,
+    SET_OP_DIFFERENCE,
+};
+
+// Applies a set operation to a pair of values. On `bool` 
+// this is the truth table saying if the output is active 
+// given whether `lhs` and `rhs` are active, and on integer 
+// types it applies the operation to each bit.
+template<int op, typename T>
+static inline constexpr T set_op(T lhs, T rhs)
+{
+    return (T)(
+        op == SET_OP_UNION        ? lhs | rhs :
+        op == SET_OP_INTERSECTION ? lhs & rhs : (lhs | rhs) ^ rhs);
+}
+
+// Finds the first element in [begin, end) for which `less` 
+// is false, assuming `less` is true for some prefix. An 
+// exponential search brackets the answer before a binary
+// search, so the cost is logarithmic in the distance moved 
+// rather than in the size of the array.
+template<typename T, typename F>
+static inline T* gallop_search(T* begin, T* end, F less)
+{
+    if (begin == end || !less(*begin))
+    {
+        return begin;
+    }
+    
+    // Here `less(begin[lo])` is always true
+    ptrdiff_t lo = 0;
+    ptrdiff_t hi = 1;
+    while (hi < end - begin && less(begin[hi]))
+    {
+        lo = hi;
+        hi *= 2;
+    }
+    
+    return std::partition_point(begin + lo + 1, std::min(begin + hi, end), less);
+}
+
+// Finishes off a merge by copying the remaining ranges 
+// from one list into the output, closing the output range 
+// first if the current input range is still active.
+static inline range* ranges_merge_remaining(
+    range* __restrict__ out,
+    const range* __restrict__ curr,
+    const range* __restrict__ end,
+    bool active)
+{
+    if (active)
+    {
+        out->stop = curr->stop;
+        out++;
+        curr++;
+    }
+    
+    memcpy(out, curr, (end - curr) * sizeof(range));
+    
+    return out + (end - curr);
+}
+
+// Merges two arrays of ranges using the set operation `op`
+// by sweeping over the start and stop events of both in 
+// time order. Each list is walked with a pointer to its 
+// current range and a flag saying if it is active, so the 
+// time of the next event is a select between `start` and 
+// `stop` and the inputs and output all step without 
+// branching. Once one list runs out, the rest of the other 
+// is either copied or dropped depending on what `op` does 
+// with it alone.
+//
+// When `gallop` is set, any time neither list is active,
+// whole ranges of one list which end before the next start
+// of the other are skipped over using `gallop_search`, and
+// copied to the output if `op` keeps them. This makes very
+// uneven merges cost O(small * log(large)).
+//
+// When `count` is set nothing is written and `out` is 
+// ignored, only the number of output ranges is returned.
+template<int op, bool gallop, bool count = false>
+static int ranges_sweep(
     slice1d<range> out,
     const slice1d<range> lhs,
     const slice1d<range> rhs)
 {
+    static_assert(!set_op<op>(false, false), 
+        "Output must be inactive when both inputs are inactive");
+    
+    // Current range of each list of ranges
+    int out_i = 0;
+    const range* lhs_r = lhs.data;
+    const range* rhs_r = rhs.data;
+    const range* lhs_end = lhs.data + lhs.size;
+    const range* rhs_end = rhs.data + rhs.size;
+    
     // Activation state of each list of ranges
     bool out_active = false;
     bool lhs_active = false;
     bool rhs_active = false;
     
-    // Event index for each list of ranges
-    int out_i = 0;
-    int lhs_i = 0;
-    int rhs_i = 0;
-  
+    // Target for writes when output does not change
+    int dummy_t;
+    
     // While both ranges have events to process
-    while (lhs_i < lhs.size * 2 && rhs_i < rhs.size * 2)
+    while (lhs_r != lhs_end && rhs_r != rhs_end)
     {
-        // Are the next lhs, and rhs events active or inactive
-        bool lhs_active_next = lhs_i % 2 == 0;
-        bool rhs_active_next = rhs_i % 2 == 0;
-        
-        // Time of the next lhs, and rhs events
-        int lhs_t = lhs_active_next ? lhs(lhs_i / 2).start : lhs(lhs_i / 2).stop;
-        int rhs_t = rhs_active_next ? rhs(rhs_i / 2).start : rhs(rhs_i / 2).stop;
-      
-        // Event from lhs is coming first
-        if (lhs_t < rhs_t)
-        {
-            // Activate output
-            if (!out_active && lhs_active_next)
-            {
-                out_active = true;
-                out(out_i).start = lhs_t;
-            }
-            // Deactivate output
-            else if (out_active && !lhs_active_next && !rhs_active)
-            {
-                out_active = false;
-                out(out_i).stop = lhs_t;
-                out_i++;
-            }
-          
-            lhs_active = lhs_active_next;
-            lhs_i++;
-        }
-        // Event from rhs is coming first
-        else if (rhs_t < lhs_t)
+        if (gallop && !lhs_active && !rhs_active)
         {
-            // Activate output
-            if (!out_active && rhs_active_next)
+            // Skip run of lhs ranges ending before next rhs range
+            if (lhs_r->start < rhs_r->start)
             {
-                out_active = true;
-                out(out_i).start = rhs_t;
+                int t = rhs_r->start;
+                const range* lhs_run = gallop_search(lhs_r, lhs_end, 
+                    [t](const range& r) { return r.stop < t; });
+                
+                if (set_op<op>(true, false))
+                {
+                    if (!count) { memcpy(out.data + out_i, lhs_r, (lhs_run - lhs_r) * sizeof(range)); }
+                    out_i += lhs_run - lhs_r;
+                }
+                
+                lhs_r = lhs_run;
+                if (lhs_r == lhs_end) { break; }
             }
-            // Deactivate output
-            else if (out_active && !lhs_active && !rhs_active_next)
+            // Skip run of rhs ranges ending before next lhs range
+            else if (rhs_r->start < lhs_r->start)
             {
-                out_active = false;
-                out(out_i).stop = rhs_t;
-                out_i++;
+                int t = lhs_r->start;
+                const range* rhs_run = gallop_search(rhs_r, rhs_end, 
+                    [t](const range& r) { return r.stop < t; });
+                
+                if (set_op<op>(false, true))
+                {
+                    if (!count) { memcpy(out.data + out_i, rhs_r, (rhs_run - rhs_r) * sizeof(range)); }
+                    out_i += rhs_run - rhs_r;
+                }
+                
+                rhs_r = rhs_run;
+                if (rhs_r == rhs_end) { break; }
             }
-          
-            rhs_active = rhs_active_next;
-            rhs_i++;
         }
-        // Event from lhs and rhs coming at same time
-        else
-        {
-            // Activate output
-            if (!out_active && (lhs_active_next || rhs_active_next))
-            {
-                out_active = true;
-                out(out_i).start = lhs_t;
-            }
-            // Deactivate output
-            else if (out_active && !(lhs_active_next || rhs_active_next))
-            {
-                out_active = false;
-                out(out_i).stop = lhs_t;
-                out_i++;
-            }
-            
-            lhs_active = lhs_active_next;
-            rhs_active = rhs_active_next;
-            lhs_i++; rhs_i++;
-        }   
-    }
-   
-    // Process any remaining lhs events
-    while (lhs_i < lhs.size * 2)
-    {
-        bool lhs_active_next = lhs_i % 2 == 0;    
-        int lhs_t = lhs_active_next ? lhs(lhs_i / 2).start : lhs(lhs_i / 2).stop;
         
-        // Activate output
-        if (!out_active && lhs_active_next)
-        {
-            out_active = true;
-            out(out_i).start = lhs_t;
-        }
-        // Deactivate output
-        else if (out_active && !lhs_active_next)
-        {
-            out_active = false;
-            out(out_i).stop = lhs_t;
-            out_i++;
-        }
+        // Time of the next lhs, and rhs events
+        int lhs_t = lhs_active ? lhs_r->stop : lhs_r->start;
+        int rhs_t = rhs_active ? rhs_r->stop : rhs_r->start;
+        int t = std::min(lhs_t, rhs_t);
         
-        lhs_active = lhs_active_next;
-        lhs_i++;
+        // Step whichever lists have an event at this time,
+        // moving on to the next range after a stop event
+        bool lhs_step = lhs_t == t;
+        bool rhs_step = rhs_t == t;
+        lhs_active = lhs_active != lhs_step;
+        rhs_active = rhs_active != rhs_step;
+        lhs_r += lhs_step && !lhs_active;
+        rhs_r += rhs_step && !rhs_active;
+        
+        bool out_active_next = set_op<op>(lhs_active, rhs_active);
+        bool out_step = out_active != out_active_next;
+        
+        // Write the start or stop of the output range if it
+        // changed, otherwise write to a dummy location. The
+        // address is found without member access since `out`
+        // may be empty or exactly sized when nothing is written.
+        int* out_t[2] = { &dummy_t, count ? &dummy_t : 
+            (int*)(out.data + out_i) + out_active };
+        *out_t[out_step] = t;
+        out_i += out_step && out_active;
+        out_active = out_active_next;
+    }
+    
+    // Process any remaining lhs events. Whether or not
+    // the current range is active, this adds one output 
+    // range for each remaining input range.
+    if (set_op<op>(true, false) && lhs_r != lhs_end)
+    {
+        if (!count) { ranges_merge_remaining(out.data + out_i, lhs_r, lhs_end, lhs_active); }
+        out_i += lhs_end - lhs_r;
     }
     
     // Process any remaining rhs events
-    while (rhs_i < rhs.size * 2)
+    if (set_op<op>(false, true) && rhs_r != rhs_end)
     {
-        bool rhs_active_next = rhs_i % 2 == 0;    
-        int rhs_t = rhs_active_next ? rhs(rhs_i / 2).start : rhs(rhs_i / 2).stop;
-        
-        // Activate output
-        if (!out_active && rhs_active_next)
-        {
-            out_active = true;
-            out(out_i).start = rhs_t;
-        }
-        // Deactivate output
-        else if (out_active && !rhs_active_next)
-        {
-            out_active = false;
-            out(out_i).stop = rhs_t;
-            out_i++;
-        }
-        
-        rhs_active = rhs_active_next;
-        rhs_i++;
+        if (!count) { ranges_merge_remaining(out.data + out_i, rhs_r, rhs_end, rhs_active); }
+        out_i += rhs_end - rhs_r;
     }
     
+    assert(count || out_i <= out.size);
+    
     // Return number of ranges added to output
     return out_i;
 }
 
+// Inputs more than this many times larger than the other
+// are merged using galloping
+enum { RANGES_GALLOP_RATIO = 8 };
+
+template<int op, bool count = false>
+static int ranges_merge(
+    slice1d<range> out,
+    const slice1d<range> lhs,
+    const slice1d<range> rhs)
+{
+    if (lhs.size > RANGES_GALLOP_RATIO * rhs.size || 
+        rhs.size > RANGES_GALLOP_RATIO * lhs.size)
+    {
+        return ranges_sweep<op, true, count>(out, lhs, rhs);
+    }
+    else
+    {
+        return ranges_sweep<op, false, count>(out, lhs, rhs);
+    }
+}
+
+// Process union operation on arrays of ranges.
+// Assumes `out` is pre-allocated to be large enough 
+// to store result. Returns the number of ranges 
+// generated as output.
+int ranges_union(
+    slice1d<range> out,
+    const slice1d<range> lhs,
+    const slice1d<range> rhs)
+{
+    return ranges_merge<SET_OP_UNION>(out, lhs, rhs);
+}
+
 // Process intersection operation on arrays of ranges.
 // Assumes `out` is pre-allocated to be large enough 
 // to store result. Returns the number of ranges 
@@ -174,92 +298,7 @@ int ranges_intersection(
     const slice1d<range> lhs,
     const slice1d<range> rhs)
 {
-    // Activation state of each list of ranges
-    bool out_active = false;
-    bool lhs_active = false;
-    bool rhs_active = false;
-    
-    // Event index for each list of ranges
-    int out_i = 0;
-    int lhs_i = 0;
-    int rhs_i = 0;
-  
-    // While both ranges have events to process
-    while (lhs_i < lhs.size * 2 && rhs_i < rhs.size * 2)
-    {
-        // Are the next lhs, and rhs events active or inactive
-        bool lhs_active_next = lhs_i % 2 == 0;
-        bool rhs_active_next = rhs_i % 2 == 0;
-        
-        // Time of the next lhs, and rhs events
-        int lhs_t = lhs_active_next ? lhs(lhs_i / 2).start : lhs(lhs_i / 2).stop;
-        int rhs_t = rhs_active_next ? rhs(rhs_i / 2).start : rhs(rhs_i / 2).stop;
-    
-        // Event from lhs coming first
-        if (lhs_t < rhs_t)
-        {
-            // Activate output
-            if (!out_active && rhs_active && lhs_active_next)
-            {
-                out_active = true;
-                out(out_i).start = lhs_t;
-            }
-            // Deactivate output
-            else if (out_active && !lhs_active_next)
-            {
-                out_active = false;
-                out(out_i).stop = lhs_t;
-                out_i++;
-            }
-      
-            lhs_active = lhs_active_next;
-            lhs_i++;
-        }
-        // Event from rhs coming first
-        else if (rhs_t < lhs_t)
-        {
-            // Activate output
-            if (!out_active && lhs_active && rhs_active_next)
-            {
-                out_active = true;
-                out(out_i).start = rhs_t;
-            }
-            // Deactivate output
-            else if (out_active && !rhs_active_next)
-            {
-                out_active = false;
-                out(out_i).stop = rhs_t;
-                out_i++;
-            }
-      
-            rhs_active = rhs_active_next;
-            rhs_i++;
-        }
-        // Event from lhs and rhs coming at same time
-        else
-        {
-            // Activate output
-            if (!out_active && (lhs_active_next && rhs_active_next))
-            {
-                out_active = true;
-                out(out_i).start = lhs_t;
-            }
-            // Deactivate output
-            else if (out_active && (!lhs_active_next || !rhs_active_next))
-            {
-                out_active = false;
-                out(out_i).stop = lhs_t;
-                out_i++;
-            }
-      
-            lhs_active = lhs_active_next;
-            rhs_active = rhs_active_next;
-            lhs_i++; rhs_i++;
-        }   
-    }
-    
-    // Return number of ranges added to output
-    return out_i;
+    return ranges_merge<SET_OP_INTERSECTION>(out, lhs, rhs);
 }
 
 // Process difference operation on arrays of ranges.
@@ -271,126 +310,652 @@ int ranges_difference(
     const slice1d<range> lhs,
     const slice1d<range> rhs)
 {
-    // Activation state of each list of ranges
+    return ranges_merge<SET_OP_DIFFERENCE>(out, lhs, rhs);
+}
+
+// Size of the result of a set operation, found without
+// writing the result anywhere
+struct set_count
+{
+    int anims = 0;      // Number of anims with any frames
+    int ranges = 0;     // Number of ranges
+    int64_t frames = 0; // Number of frames
+};
+
+static inline set_count& operator+=(set_count& lhs, const set_count& rhs)
+{
+    lhs.anims += rhs.anims;
+    lhs.ranges += rhs.ranges;
+    lhs.frames += rhs.frames;
+    return lhs;
+}
+
+// Size of an array of ranges
+static inline set_count ranges_count(const range* begin, const range* end)
+{
+    set_count out;
+    out.anims = begin != end;
+    out.ranges = end - begin;
+    
+    for (const range* r = begin; r != end; r++)
+    {
+        out.frames += r->stop - r->start;
+    }
+    
+    return out;
+}
+
+static inline set_count ranges_count(const slice1d<range> ranges)
+{
+    return ranges_count(ranges.data, ranges.data + ranges.size);
+}
+
+// Same sweep as `ranges_sweep` but only counts the 
+// ranges and frames which would be output. When `exists` 
+// is set this returns as soon as any output is found, 
+// so only `anims` of the result should be used.
+template<int op, bool gallop, bool exists>
+static set_count ranges_sweep_count(
+    const slice1d<range> lhs,
+    const slice1d<range> rhs)
+{
+    set_count out;
+    
+    const range* lhs_r = lhs.data;
+    const range* rhs_r = rhs.data;
+    const range* lhs_end = lhs.data + lhs.size;
+    const range* rhs_end = rhs.data + rhs.size;
+    
     bool out_active = false;
     bool lhs_active = false;
     bool rhs_active = false;
     
-    // Event index for each list of ranges
-    int out_i = 0;
-    int lhs_i = 0;
-    int rhs_i = 0;
-    
-    // While both ranges have events to process
-    while (lhs_i < lhs.size * 2 && rhs_i < rhs.size * 2)
+    while (lhs_r != lhs_end && rhs_r != rhs_end)
     {
-        // Are the next lhs, and rhs events active or inactive
-        bool lhs_active_next = lhs_i % 2 == 0;
-        bool rhs_active_next = rhs_i % 2 == 0;
-        
-        // Time of the next lhs, and rhs events
-        int lhs_t = lhs_active_next ? lhs(lhs_i / 2).start : lhs(lhs_i / 2).stop;
-        int rhs_t = rhs_active_next ? rhs(rhs_i / 2).start : rhs(rhs_i / 2).stop;
-    
-        // Event coming from lhs first
-        if (lhs_t < rhs_t)
-        {
-            // Activate output
-            if (!out_active && !rhs_active && lhs_active_next)
-            {
-                out_active = true;
-                out(out_i).start = lhs_t;
-            }
-            // Deactivate output
-            else if (out_active && !lhs_active_next)
-            {
-                out_active = false;
-                out(out_i).stop = lhs_t;
-                out_i++;
-            }
-      
-            lhs_active = lhs_active_next;
-            lhs_i++;
-        }
-        // Event coming from rhs first
-        else if (rhs_t < lhs_t)
+        if (gallop && !lhs_active && !rhs_active)
         {
-            // Activate output
-            if (!out_active && lhs_active && !rhs_active_next)
+            if (lhs_r->start < rhs_r->start)
             {
-                out_active = true;
-                out(out_i).start = rhs_t;
+                int t = rhs_r->start;
+                const range* lhs_run = gallop_search(lhs_r, lhs_end, 
+                    [t](const range& r) { return r.stop < t; });
+                
+                if (set_op<op>(true, false))
+                {
+                    out += ranges_count(lhs_r, lhs_run);
+                    if (exists && out.ranges > 0) { out.anims = 1; return out; }
+                }
+                
+                lhs_r = lhs_run;
+                if (lhs_r == lhs_end) { break; }
             }
-            // Deactivate output
-            else if (out_active && rhs_active_next)
+            else if (rhs_r->start < lhs_r->start)
             {
-                out_active = false;
-                out(out_i).stop = rhs_t;
-                out_i++;
+                int t = lhs_r->start;
+                const range* rhs_run = gallop_search(rhs_r, rhs_end, 
+                    [t](const range& r) { return r.stop < t; });
+                
+                if (set_op<op>(false, true))
+                {
+                    out += ranges_count(rhs_r, rhs_run);
+                    if (exists && out.ranges > 0) { out.anims = 1; return out; }
+                }
+                
+                rhs_r = rhs_run;
+                if (rhs_r == rhs_end) { break; }
             }
-            
-            rhs_active = rhs_active_next;
-            rhs_i++;
         }
-        // Event from lhs and rhs coming at same time
-        else
-        {
-            // Activate output
-            if (!out_active && lhs_active_next && !rhs_active_next)
-            {
-                out_active = true;
-                out(out_i).start = lhs_t;
-            }
-            // Deactivate output
-            else if (out_active && rhs_active_next)
-            {
-                out_active = false;
-                out(out_i).stop = lhs_t;
-                out_i++;
-            }
-      
-            lhs_active = lhs_active_next;
-            rhs_active = rhs_active_next;
-            lhs_i++; rhs_i++;
-        }   
+        
+        int lhs_t = lhs_active ? lhs_r->stop : lhs_r->start;
+        int rhs_t = rhs_active ? rhs_r->stop : rhs_r->start;
+        int t = std::min(lhs_t, rhs_t);
+        
+        bool lhs_step = lhs_t == t;
+        bool rhs_step = rhs_t == t;
+        lhs_active = lhs_active != lhs_step;
+        rhs_active = rhs_active != rhs_step;
+        lhs_r += lhs_step && !lhs_active;
+        rhs_r += rhs_step && !rhs_active;
+        
+        bool out_active_next = set_op<op>(lhs_active, rhs_active);
+        
+        if (exists && out_active_next) { out.anims = 1; out.ranges = 1; return out; }
+        
+        // Frames are counted by subtracting the time each 
+        // output range starts and adding the time it stops
+        out.ranges += out_active && !out_active_next;
+        out.frames -= (int64_t)(out_active_next - out_active) * t;
+        out_active = out_active_next;
     }
     
-    // Process any remaining lhs events
-    while (lhs_i < lhs.size * 2)
+    // Count any remaining ranges, closing the current
+    // output range first if it is still active
+    if (set_op<op>(true, false) && lhs_r != lhs_end)
     {
-        bool lhs_active_next = lhs_i % 2 == 0;    
-        int lhs_t = lhs_active_next ? lhs(lhs_i / 2).start : lhs(lhs_i / 2).stop;
-        
-        // Activate output
-        if (!out_active && lhs_active_next)
-        {
-            out_active = true;
-            out(out_i).start = lhs_t;
-        }
-        // Deactivate output
-        else if (out_active && !lhs_active_next)
-        {
-            out_active = false;
-            out(out_i).stop = lhs_t;
-            out_i++;
-        }
-        
-        lhs_active = lhs_active_next;
-        lhs_i++;
+        if (lhs_active) { out.frames += lhs_r->stop; out.ranges++; lhs_r++; }
+        out += ranges_count(lhs_r, lhs_end);
     }
     
-    // Return number of ranges added to output
-    return out_i;
+    if (set_op<op>(false, true) && rhs_r != rhs_end)
+    {
+        if (rhs_active) { out.frames += rhs_r->stop; out.ranges++; rhs_r++; }
+        out += ranges_count(rhs_r, rhs_end);
+    }
+    
+    out.anims = out.ranges > 0;
+    
+    return out;
 }
 
-//--------------------------------------
-
-struct range_set
+template<int op, bool exists = false>
+static set_count ranges_merge_count(
+    const slice1d<range> lhs,
+    const slice1d<range> rhs)
 {
-    array1d<int>   anims;           // Sorted ids of all anims with ranges in set
-    array1d<range> anims_subranges; // Slices of `ranges` array for each anim 
-    array1d<range> ranges;          // Full list of all ranges for all animations 
-};
+    if (lhs.size > RANGES_GALLOP_RATIO * rhs.size || 
+        rhs.size > RANGES_GALLOP_RATIO * lhs.size)
+    {
+        return ranges_sweep_count<op, true, exists>(lhs, rhs);
+    }
+    else
+    {
+        return ranges_sweep_count<op, false, exists>(lhs, rhs);
+    }
+}
+
+// Number of ranges and frames in the union of two 
+// arrays of ranges
+set_count ranges_union_count(const slice1d<range> lhs, const slice1d<range> rhs)
+{
+    return ranges_merge_count<SET_OP_UNION>(lhs, rhs);
+}
+
+set_count ranges_intersection_count(const slice1d<range> lhs, const slice1d<range> rhs)
+{
+    return ranges_merge_count<SET_OP_INTERSECTION>(lhs, rhs);
+}
+
+set_count ranges_difference_count(const slice1d<range> lhs, const slice1d<range> rhs)
+{
+    return ranges_merge_count<SET_OP_DIFFERENCE>(lhs, rhs);
+}
+
+// If the union of two arrays of ranges has any frames
+bool ranges_union_exists(const slice1d<range> lhs, const slice1d<range> rhs)
+{
+    return ranges_merge_count<SET_OP_UNION, true>(lhs, rhs).anims > 0;
+}
+
+bool ranges_intersection_exists(const slice1d<range> lhs, const slice1d<range> rhs)
+{
+    return ranges_merge_count<SET_OP_INTERSECTION, true>(lhs, rhs).anims > 0;
+}
+
+bool ranges_difference_exists(const slice1d<range> lhs, const slice1d<range> rhs)
+{
+    return ranges_merge_count<SET_OP_DIFFERENCE, true>(lhs, rhs).anims > 0;
+}
+
+// Position of one input in a merge of many arrays of 
+// ranges
+struct ranges_cursor
+{
+    const range* curr;
+    const range* end;
+};
+
+// Moves a cursor past all ranges ending at or before `t`
+static inline void ranges_cursor_skip(ranges_cursor& c, int t)
+{
+    c.curr = gallop_search(c.curr, c.end, [t](const range& r) { return r.stop <= t; });
+}
+
+// Merges any number of arrays of ranges in one pass. 
+// Rather than stepping through every event of every input,
+// each output range is found by repeatedly moving all of 
+// the inputs up to the current time with `gallop_search`,
+// so ranges covered by the output of a union, or which 
+// cannot overlap the output of an intersection or 
+// difference, are skipped over in logarithmic time. The 
+// number of inputs is expected to be small, so the next 
+// input to move is found with a linear scan over them.
+//
+// For a union each output range starts at the earliest 
+// start of any input and grows while some input has a 
+// range starting before it ends.
+static int ranges_union_n(
+    slice1d<range> out,
+    slice1d<ranges_cursor> inputs)
+{
+    int out_i = 0;
+    
+    while (true)
+    {
+        int start = INT_MAX;
+        for (int j = 0; j < inputs.size; j++)
+        {
+            if (inputs(j).curr != inputs(j).end)
+            {
+                start = std::min(start, inputs(j).curr->start);
+            }
+        }
+        
+        if (start == INT_MAX) { break; }
+        
+        int stop = start;
+        bool grown = true;
+        
+        while (grown)
+        {
+            grown = false;
+            
+            for (int j = 0; j < inputs.size; j++)
+            {
+                ranges_cursor& c = inputs(j);
+                ranges_cursor_skip(c, stop);
+                
+                if (c.curr != c.end && c.curr->start <= stop)
+                {
+                    stop = c.curr->stop;
+                    c.curr++;
+                    grown = true;
+                }
+            }
+        }
+        
+        out(out_i++) = { start, stop };
+    }
+    
+    return out_i;
+}
+
+// For an intersection the time is moved to the latest 
+// start of any input until all inputs contain it, and 
+// then the output runs to the earliest of their stops.
+static int ranges_intersection_n(
+    slice1d<range> out,
+    slice1d<ranges_cursor> inputs)
+{
+    int out_i = 0;
+    int t = INT_MIN;
+    
+    while (true)
+    {
+        // Find a time contained by all inputs
+        bool agree = false;
+        
+        while (!agree)
+        {
+            agree = true;
+            
+            for (int j = 0; j < inputs.size; j++)
+            {
+                ranges_cursor& c = inputs(j);
+                ranges_cursor_skip(c, t);
+                
+                if (c.curr == c.end) { return out_i; }
+                
+                if (c.curr->start > t)
+                {
+                    t = c.curr->start;
+                    agree = false;
+                }
+            }
+        }
+        
+        int stop = INT_MAX;
+        for (int j = 0; j < inputs.size; j++)
+        {
+            stop = std::min(stop, inputs(j).curr->stop);
+        }
+        
+        out(out_i++) = { t, stop };
+        t = stop;
+    }
+}
+
+// For a difference each range of the first input is 
+// walked over, skipping any time covered by the other
+// inputs, and output up to the next start of another 
+// input.
+static int ranges_difference_n(
+    slice1d<range> out,
+    slice1d<ranges_cursor> inputs)
+{
+    int out_i = 0;
+    
+    for (const range* r = inputs(0).curr; r != inputs(0).end; r++)
+    {
+        int t = r->start;
+        
+        while (t < r->stop)
+        {
+            // Skip time covered by other inputs, stopping at 
+            // the end of this range so that nothing needed by 
+            // the next range is skipped
+            bool covered = true;
+            
+            while (covered && t < r->stop)
+            {
+                covered = false;
+                
+                for (int j = 1; j < inputs.size && t < r->stop; j++)
+                {
+                    ranges_cursor& c = inputs(j);
+                    ranges_cursor_skip(c, t);
+                    
+                    if (c.curr != c.end && c.curr->start <= t)
+                    {
+                        t = c.curr->stop;
+                        covered = true;
+                    }
+                }
+            }
+            
+            if (t >= r->stop) { break; }
+            
+            int stop = r->stop;
+            for (int j = 1; j < inputs.size; j++)
+            {
+                if (inputs(j).curr != inputs(j).end)
+                {
+                    stop = std::min(stop, inputs(j).curr->start);
+                }
+            }
+            
+            out(out_i++) = { t, stop };
+            t = stop;
+        }
+    }
+    
+    return out_i;
+}
+
+// Process union operation on any number of arrays of 
+// ranges. Assumes `out` is pre-allocated to be large 
+// enough to store result. Returns the number of ranges 
+// generated as output.
+int ranges_union(
+    slice1d<range> out,
+    slice1d<ranges_cursor> inputs)
+{
+    return ranges_union_n(out, inputs);
+}
+
+// Process intersection operation on any number of 
+// arrays of ranges. Assumes `out` is pre-allocated to 
+// be large enough to store result. Returns the number 
+// of ranges generated as output.
+int ranges_intersection(
+    slice1d<range> out,
+    slice1d<ranges_cursor> inputs)
+{
+    return ranges_intersection_n(out, inputs);
+}
+
+// Process difference operation, subtracting all other
+// arrays of ranges from the first. Assumes `out` is 
+// pre-allocated to be large enough to store result. 
+// Returns the number of ranges generated as output.
+int ranges_difference(
+    slice1d<range> out,
+    slice1d<ranges_cursor> inputs)
+{
+    return ranges_difference_n(out, inputs);
+}
+
+//--------------------------------------
+
+// Pool of worker threads used to run operations in 
+// parallel. Each worker has its own queue of tasks which 
+// it takes from the back of, and when empty it steals 
+// from the front of the queues of other threads, so 
+// uneven tasks get balanced out. Any thread waiting on 
+// tasks it added runs queued tasks itself until they are
+// done, so tasks can safely add and wait on more tasks.
+struct thread_pool_task
+{
+    void (*func)(void*, int, int);  // Function to call
+    void* data;                     // Data given to function
+    int start, stop;                // Range of items to process
+    std::atomic<int>* remaining;    // Tasks left in the group
+};
+
+struct thread_pool_queue
+{
+    std::mutex mutex;
+    std::deque<thread_pool_task> tasks;
+};
+
+// Index of the queue of the current thread. Worker threads 
+// use their own, while other threads share the first.
+static thread_local int thread_pool_index = 0;
+
+struct thread_pool
+{
+    // Construct pool of `nthreads` workers. By default one
+    // is created for each core other than the one used by 
+    // the calling thread, which also runs tasks while it 
+    // waits. Web builds have no threads so run everything
+    // on the calling thread.
+#if defined(PLATFORM_WEB)
+    thread_pool(int nthreads = 0)
+#else
+    thread_pool(int nthreads = std::max((int)std::thread::hardware_concurrency() - 1, 0))
+#endif
+        : queues(nthreads + 1), queued(0), stop(false)
+    {
+        for (int i = 0; i < nthreads; i++)
+        {
+            threads.emplace_back([this, i]() { worker(i + 1); });
+        }
+    }
+    
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        
+        wake.notify_all();
+        
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+    }
+    
+    // Takes a task from the queue of `index` or else steals 
+    // one from another queue. Returns false if none found.
+    bool pop(int index, thread_pool_task& task)
+    {
+        if (queued.load() == 0) { return false; }
+        
+        for (int i = 0; i < (int)queues.size(); i++)
+        {
+            thread_pool_queue& queue = queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            
+            if (!queue.tasks.empty())
+            {
+                if (i == 0)
+                {
+                    task = queue.tasks.back();
+                    queue.tasks.pop_back();
+                }
+                else
+                {
+                    task = queue.tasks.front();
+                    queue.tasks.pop_front();
+                }
+                
+                queued--;
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    void run(const thread_pool_task& task)
+    {
+        task.func(task.data, task.start, task.stop);
+        task.remaining->fetch_sub(1);
+    }
+    
+    void worker(int index)
+    {
+        thread_pool_index = index;
+        
+        while (true)
+        {
+            thread_pool_task task;
+            if (pop(index, task))
+            {
+                run(task);
+                continue;
+            }
+            
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]() { return stop || queued.load() > 0; });
+            if (stop) { return; }
+        }
+    }
+    
+    std::vector<std::thread> threads;
+    std::deque<thread_pool_queue> queues;
+    std::atomic<int> queued;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stop;
+};
+
+// Calls `func(start, stop)` on `pool` for ranges covering 
+// all items from 0 to `num` in chunks of `grain` items, 
+// returning once all of them are done.
+template<typename F>
+void parallel_for(thread_pool& pool, int num, int grain, const F& func)
+{
+    if (pool.threads.empty() || num <= grain)
+    {
+        if (num > 0) { func(0, num); }
+        return;
+    }
+    
+    int ntasks = (num + grain - 1) / grain;
+    std::atomic<int> remaining(ntasks);
+    
+    // Spread tasks over all the queues so that each 
+    // worker has some to start on without stealing
+    for (int i = 0; i < ntasks; i++)
+    {
+        thread_pool_task task = {
+            [](void* data, int start, int stop) { (*(const F*)data)(start, stop); },
+            (void*)&func, 
+            i * grain, 
+            std::min((i + 1) * grain, num),
+            &remaining };
+        
+        thread_pool_queue& queue = pool.queues[(thread_pool_index + i) % pool.queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+        pool.queued++;
+    }
+    
+    {
+        // Lock so wake up cannot be missed by a worker 
+        // between checking the queues and waiting
+        std::lock_guard<std::mutex> lock(pool.mutex);
+    }
+    
+    pool.wake.notify_all();
+    
+    // Run tasks while waiting for these to finish
+    while (remaining.load() > 0)
+    {
+        thread_pool_task task;
+        if (pool.pop(thread_pool_index, task))
+        {
+            pool.run(task);
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+//--------------------------------------
+
+struct range_set
+{
+    array1d<int>   anims;           // Sorted ids of all anims with ranges in set
+    array1d<range> anims_subranges; // Slices of `ranges` array for each anim 
+    array1d<range> ranges;          // Full list of all ranges for all animations 
+};
+
+// Memory used by the data of a range set in bytes
+size_t memory_usage(const range_set& set)
+{
+    return 
+        set.anims.size * sizeof(int) +
+        set.anims_subranges.size * sizeof(range) +
+        set.ranges.size * sizeof(range);
+}
+
+// Empties a range set but keeps its memory for reuse
+void range_set_clear(range_set& set)
+{
+    set.anims.resize(0);
+    set.anims_subranges.resize(0);
+    set.ranges.resize(0);
+}
+
+// Index in `set.anims` of `anim`, or -1 if it has no 
+// ranges in the set. Anims are sorted so this is a binary
+// search.
+int range_set_find_anim(const range_set& set, int anim)
+{
+    const int* it = std::lower_bound(set.anims.data, set.anims.data + set.anims.size, anim);
+    return it != set.anims.data + set.anims.size && *it == anim ? (int)(it - set.anims.data) : -1;
+}
+
+// Ranges of `anim` which overlap `frames`. The ranges of 
+// an anim are sorted and don't overlap, so both their 
+// starts and stops are increasing and the first and last
+// overlapping range can each be found by a binary search.
+// The first and last ranges returned may extend outside
+// of `frames`.
+slice1d<range> range_set_overlapping(const range_set& set, int anim, range frames)
+{
+    int i = range_set_find_anim(set, anim);
+    if (i == -1) { return slice1d<range>(0, set.ranges.data); }
+    
+    const range* begin = set.ranges.data + set.anims_subranges(i).start;
+    const range* end = set.ranges.data + set.anims_subranges(i).stop;
+    
+    begin = std::upper_bound(begin, end, frames.start, [](int f, const range& r) { return f < r.stop; });
+    end = std::lower_bound(begin, end, frames.stop, [](const range& r, int f) { return r.start < f; });
+    
+    return slice1d<range>((int)(end - begin), (range*)begin);
+}
+
+// If `frame` of `anim` is in the set
+bool range_set_contains(const range_set& set, int anim, int frame)
+{
+    return range_set_overlapping(set, anim, { frame, frame + 1 }).size > 0;
+}
+
+// Finds the first index from `i` onward of `anims` with
+// an id not less than `anim` using `gallop_search`, so that 
+// skipping many animations missing from the other set of 
+// a merge is logarithmic rather than linear.
+static inline int anims_gallop(const slice1d<int> anims, int i, int anim)
+{
+    return gallop_search(anims.data + i, anims.data + anims.size, 
+        [anim](int a) { return a < anim; }) - anims.data;
+}
 
 void range_set_union(
     range_set& out, 
@@ -444,17 +1009,22 @@ void range_set_union(
         // If both contain the same animation
         else 
         {
-            // Append union of subranges to output
+            // Append union of subranges to output,
+            // dropping the anim if it has no ranges
             int nranges = ranges_union(
                 out.ranges.slice_from(ranges_i),
                 lhs.ranges.slice(lhs.anims_subranges(lhs_i)),
                 rhs.ranges.slice(rhs.anims_subranges(rhs_i)));      
             
-            out.anims(out_i) = lhs.anims(lhs_i);
-            out.anims_subranges(out_i) = { ranges_i, ranges_i + nranges };
+            if (nranges > 0)
+            {
+                out.anims(out_i) = lhs.anims(lhs_i);
+                out.anims_subranges(out_i) = { ranges_i, ranges_i + nranges };
+                
+                ranges_i+=nranges;
+                out_i++;
+            }
             
-            ranges_i+=nranges;
-            out_i++;
             lhs_i++; rhs_i++;
         }
     }
@@ -516,30 +1086,37 @@ void range_set_intersection(
     // While both sets have animations
     while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
     {
-        // If animation is in lhs but not rhs skip
+        // If animation is in lhs but not rhs skip to
+        // the next lhs animation which could be in rhs
         if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
         {
-            lhs_i++;
+            lhs_i = anims_gallop(lhs.anims, lhs_i, rhs.anims(rhs_i));
         }
-        // If animation is in rhs but not lhs skip
+        // If animation is in rhs but not lhs skip to
+        // the next rhs animation which could be in lhs
         else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
         {
-            rhs_i++;
+            rhs_i = anims_gallop(rhs.anims, rhs_i, lhs.anims(lhs_i));
         }
         // If animation is in both lhs and rhs
         else 
         {   
-            // Append intersection of subranges to output
+            // Append intersection of subranges to output,
+            // dropping the anim if it has no ranges left
             int nranges = ranges_intersection(
                 out.ranges.slice_from(ranges_i),
                 lhs.ranges.slice(lhs.anims_subranges(lhs_i)),
                 rhs.ranges.slice(rhs.anims_subranges(rhs_i)));      
             
-            out.anims(out_i) = lhs.anims(lhs_i);
-            out.anims_subranges(out_i) = { ranges_i, ranges_i + nranges };
+            if (nranges > 0)
+            {
+                out.anims(out_i) = lhs.anims(lhs_i);
+                out.anims_subranges(out_i) = { ranges_i, ranges_i + nranges };
+                
+                ranges_i+=nranges;
+                out_i++;
+            }
             
-            ranges_i+=nranges;
-            out_i++;
             lhs_i++; rhs_i++;
         }
     }
@@ -584,25 +1161,31 @@ void range_set_difference(
             out_i++;
             lhs_i++;
         }
-        // If animation is in rhs but not lhs skip
+        // If animation is in rhs but not lhs skip to
+        // the next rhs animation which could be in lhs
         else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
         {
-            rhs_i++;
+            rhs_i = anims_gallop(rhs.anims, rhs_i, lhs.anims(lhs_i));
         }
         // If animation is in both lhs and rhs
         else
         {
-            // Append difference of subranges to output
+            // Append difference of subranges to output,
+            // dropping the anim if it has no ranges left
             int nranges = ranges_difference(
                 out.ranges.slice_from(ranges_i),
                 lhs.ranges.slice(lhs.anims_subranges(lhs_i)),
                 rhs.ranges.slice(rhs.anims_subranges(rhs_i)));      
             
-            out.anims(out_i) = lhs.anims(lhs_i);
-            out.anims_subranges(out_i) = { ranges_i, ranges_i + nranges };
+            if (nranges > 0)
+            {
+                out.anims(out_i) = lhs.anims(lhs_i);
+                out.anims_subranges(out_i) = { ranges_i, ranges_i + nranges };
+                
+                ranges_i+=nranges;
+                out_i++;
+            }
             
-            ranges_i+=nranges;
-            out_i++;
             lhs_i++; rhs_i++;
         }
     }
@@ -627,1096 +1210,8312 @@ void range_set_difference(
     out.ranges.resize(ranges_i);
 }
 
-//--------------------------------------
-
-void mask_union(
-    slice1d_bit out,
-    const slice1d_bit lhs,
-    const slice1d_bit rhs)
+// Finds the next anim in the output of a merge of any 
+// number of range sets and sets up a cursor over its 
+// ranges for each set containing it. `sets_i` holds the
+// anim index in each set and is advanced past the anim.
+// Returns false once there are no more anims to output.
+template<int op>
+static bool range_set_merge_n_next(
+    int& anim,
+    int& inputs_num,
+    slice1d<ranges_cursor> inputs,
+    slice1d<int> sets_i,
+    const slice1d<const range_set*> sets)
 {
-    assert((out.size == lhs.size) && (out.size == rhs.size));
+    // Find next anim to output
+    anim = INT_MAX;
     
-    for (int i = 0; i < out.size; i++)
+    if (op == SET_OP_UNION)
     {
-        out.set(i, lhs.get(i) || rhs.get(i));
+        // Smallest anim of any set
+        for (int j = 0; j < sets.size; j++)
+        {
+            if (sets_i(j) < sets(j)->anims.size)
+            {
+                anim = std::min(anim, sets(j)->anims(sets_i(j)));
+            }
+        }
+        
+        if (anim == INT_MAX) { return false; }
+    }
+    else if (op == SET_OP_INTERSECTION)
+    {
+        // Gallop every set up to the largest current anim
+        // until they all agree or one runs out
+        bool agree = false;
+        anim = INT_MIN;
+        
+        while (!agree)
+        {
+            agree = true;
+            
+            for (int j = 0; j < sets.size; j++)
+            {
+                sets_i(j) = anims_gallop(sets(j)->anims, sets_i(j), anim);
+                
+                if (sets_i(j) == sets(j)->anims.size) { anim = INT_MAX; break; }
+                
+                agree = agree && sets(j)->anims(sets_i(j)) == anim;
+                anim = std::max(anim, sets(j)->anims(sets_i(j)));
+            }
+            
+            if (anim == INT_MAX) { break; }
+        }
+        
+        if (anim == INT_MAX) { return false; }
+    }
+    else
+    {
+        // Next anim of the first set, galloping the
+        // others up to it
+        if (sets_i(0) == sets(0)->anims.size) { return false; }
+        
+        anim = sets(0)->anims(sets_i(0));
+        
+        for (int j = 1; j < sets.size; j++)
+        {
+            sets_i(j) = anims_gallop(sets(j)->anims, sets_i(j), anim);
+        }
     }
-}
-
-void mask_intersection(
-    slice1d_bit out,
-    const slice1d_bit lhs,
-    const slice1d_bit rhs)
-{
-    assert((out.size == lhs.size) && (out.size == rhs.size));
     
-    for (int i = 0; i < out.size; i++)
+    // Gather the ranges of all sets with this anim
+    inputs_num = 0;
+    
+    for (int j = 0; j < sets.size; j++)
     {
-        out.set(i, lhs.get(i) && rhs.get(i));
+        const range_set& set = *sets(j);
+        
+        if (sets_i(j) < set.anims.size && set.anims(sets_i(j)) == anim)
+        {
+            slice1d<range> sranges = set.ranges.slice(set.anims_subranges(sets_i(j)));
+            inputs(inputs_num++) = { sranges.data, sranges.data + sranges.size };
+            sets_i(j)++;
+        }
     }
+    
+    return true;
 }
 
-void mask_difference(
-    slice1d_bit out,
-    const slice1d_bit lhs,
-    const slice1d_bit rhs)
+// Merges any number of range sets in one pass. Each anim
+// found in the sets is merged over just the sets 
+// containing it, using `ranges_merge` when only two do. 
+// As with the pairwise operations, anims which are 
+// merged and left with no ranges are not output, while 
+// anims only in one set are copied as they are.
+template<int op>
+static void range_set_merge_n(
+    range_set& out,
+    const slice1d<const range_set*> sets)
 {
-    assert((out.size == lhs.size) && (out.size == rhs.size));
+    assert(sets.size > 0);
     
-    for (int i = 0; i < out.size; i++)
+    // Allocate potential maximum number of anims and ranges we might to output
+    int anims_num = 0;
+    int ranges_num = 0;
+    for (int j = 0; j < sets.size; j++)
     {
-        out.set(i, lhs.get(i) && !rhs.get(i));
+        anims_num += sets(j)->anims.size;
+        ranges_num += sets(j)->ranges.size;
     }
-}
-
-void mask_custom_logic(
-    slice1d_bit query,
-    const slice1d_bit running,
-    const slice1d_bit male,
-    const slice1d_bit tired,
-    const slice1d_bit limping)
-{   
-    for (int i = 0; i < query.size; i++)
+    
+    out.anims.resize(anims_num);
+    out.anims_subranges.resize(anims_num);
+    out.ranges.resize(ranges_num);
+    
+    // Anim index for each set, and cursors for 
+    // the sets containing the current anim
+    inplace_array1d<int, 16> sets_i(sets.size);
+    inplace_array1d<ranges_cursor, 16> inputs(sets.size);
+    sets_i.zero();
+    
+    int out_i = 0;
+    int ranges_i = 0;
+    
+    while (true)
     {
-        query.set(i,
-            running.get(i) && male.get(i) && (tired.get(i) || limping.get(i)));
+        int anim, inputs_num;
+        
+        if (!range_set_merge_n_next<op>(anim, inputs_num, inputs, sets_i, sets))
+        {
+            break;
+        }
+        
+        int nranges;
+        slice1d<range> out_ranges = out.ranges.slice_from(ranges_i);
+        
+        if (inputs_num == 1)
+        {
+            nranges = inputs(0).end - inputs(0).curr;
+            memcpy(out_ranges.data, inputs(0).curr, nranges * sizeof(range));
+        }
+        else if (inputs_num == 2)
+        {
+            nranges = ranges_merge<op>(out_ranges,
+                slice1d<range>(inputs(0).end - inputs(0).curr, (range*)inputs(0).curr),
+                slice1d<range>(inputs(1).end - inputs(1).curr, (range*)inputs(1).curr));
+        }
+        else if (op == SET_OP_UNION)
+        {
+            nranges = ranges_union_n(out_ranges, inputs.slice(0, inputs_num));
+        }
+        else if (op == SET_OP_INTERSECTION)
+        {
+            nranges = ranges_intersection_n(out_ranges, inputs.slice(0, inputs_num));
+        }
+        else
+        {
+            nranges = ranges_difference_n(out_ranges, inputs.slice(0, inputs_num));
+        }
+        
+        if (nranges > 0 || inputs_num == 1)
+        {
+            out.anims(out_i) = anim;
+            out.anims_subranges(out_i) = { ranges_i, ranges_i + nranges };
+            
+            ranges_i+=nranges;
+            out_i++;
+        }
     }
+    
+    // Resize output to match what was added
+    out.anims.resize(out_i);
+    out.anims_subranges.resize(out_i);
+    out.ranges.resize(ranges_i);
 }
 
-//--------------------------------------
+// Union of any number of range sets
+void range_set_union(
+    range_set& out,
+    const slice1d<const range_set*> sets)
+{
+    range_set_merge_n<SET_OP_UNION>(out, sets);
+}
 
-struct mask_set
+// Intersection of any number of range sets
+void range_set_intersection(
+    range_set& out,
+    const slice1d<const range_set*> sets)
 {
-    array1d<int>   anims;           // Sorted ids of all anims with masks in set
-    array1d<range> anims_submasks;  // Slices of `masks` array for each anim
-    array1d_bit    masks;           // Full list of all masks for all animations 
-};
+    range_set_merge_n<SET_OP_INTERSECTION>(out, sets);
+}
 
-void mask_set_union(
-    mask_set& out, 
-    const mask_set& lhs, 
-    const mask_set& rhs)
-{ 
-    // Allocate potential maximum number of anims and ranges we might to output
-    out.anims.resize(lhs.anims.size + rhs.anims.size);
-    out.anims_submasks.resize(lhs.anims.size + rhs.anims.size);
-    out.masks.resize(lhs.masks.size + rhs.masks.size);
+// Difference of the first range set and all the others
+void range_set_difference(
+    range_set& out,
+    const slice1d<const range_set*> sets)
+{
+    range_set_merge_n<SET_OP_DIFFERENCE>(out, sets);
+}
+
+// Number of anims, ranges and frames in a range set
+set_count range_set_count(const range_set& set)
+{
+    set_count out = ranges_count(set.ranges);
+    out.anims = 0;
+    
+    for (int i = 0; i < set.anims_subranges.size; i++)
+    {
+        out.anims += set.anims_subranges(i).stop > set.anims_subranges(i).start;
+    }
+    
+    return out;
+}
+
+// Counts the result of a set operation on two range sets
+// without building it. When `exists` is set this returns 
+// as soon as any anim is found with output.
+template<int op, bool exists>
+static set_count range_set_merge_count(
+    const range_set& lhs, 
+    const range_set& rhs)
+{
+    set_count out;
     
-    // Anim index for each list of masks
-    int out_i = 0;
     int lhs_i = 0;
     int rhs_i = 0;
     
-    // Output masks index
-    int masks_i = 0;
-    
-    // While both sets have animations
     while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
     {
-        // If animation from lhs is first
         if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
         {
-            // Append submask to output
-            slice1d_bit submask = lhs.masks.slice(lhs.anims_submasks(lhs_i));
-            
-            out.anims(out_i) = lhs.anims(lhs_i);
-            out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
-            out.masks.slice(masks_i, masks_i + submask.size) = submask;            
-            
-            masks_i+=submask.size;
-            out_i++;
-            lhs_i++;
+            if (set_op<op>(true, false))
+            {
+                out += ranges_count(lhs.ranges.slice(lhs.anims_subranges(lhs_i)));
+                lhs_i++;
+            }
+            else
+            {
+                lhs_i = anims_gallop(lhs.anims, lhs_i, rhs.anims(rhs_i));
+            }
         }
-        // If animation from rhs is first
         else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
         {
-            // Append submask to output
-            slice1d_bit submask = rhs.masks.slice(rhs.anims_submasks(rhs_i));
-            
-            out.anims(out_i) = rhs.anims(rhs_i);
-            out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
-            out.masks.slice(masks_i, masks_i + submask.size) = submask;
-            
-            masks_i+=submask.size;
-            out_i++;
-            rhs_i++;
+            if (set_op<op>(false, true))
+            {
+                out += ranges_count(rhs.ranges.slice(rhs.anims_subranges(rhs_i)));
+                rhs_i++;
+            }
+            else
+            {
+                rhs_i = anims_gallop(rhs.anims, rhs_i, lhs.anims(lhs_i));
+            }
         }
-        // If both contain the same animation
-        else 
+        else
         {
-            // Append union of submask to output
-            int nmasks = lhs.masks.slice(lhs.anims_submasks(lhs_i)).size;
-            
-            mask_union(
-                out.masks.slice(masks_i, masks_i + nmasks),
-                lhs.masks.slice(lhs.anims_submasks(lhs_i)),
-                rhs.masks.slice(rhs.anims_submasks(rhs_i)));      
-            
-            out.anims(out_i) = lhs.anims(lhs_i);
-            out.anims_submasks(out_i) = { masks_i, masks_i + nmasks };
+            out += ranges_merge_count<op, exists>(
+                lhs.ranges.slice(lhs.anims_subranges(lhs_i)),
+                rhs.ranges.slice(rhs.anims_subranges(rhs_i)));
             
-            masks_i+=nmasks;
-            out_i++;
             lhs_i++; rhs_i++;
         }
+        
+        if (exists && out.anims > 0) { return out; }
     }
     
-    // Process any remaining lhs animations
-    while (lhs_i < lhs.anims.size)
+    for (; set_op<op>(true, false) && lhs_i < lhs.anims.size; lhs_i++)
     {
-        // Append submask to output
-        slice1d_bit submask = lhs.masks.slice(lhs.anims_submasks(lhs_i));
-        
-        out.anims(out_i) = lhs.anims(lhs_i);
-        out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
-        out.masks.slice(masks_i, masks_i + submask.size) = submask;
-        
-        masks_i+=submask.size;
-        out_i++;
-        lhs_i++;
+        out += ranges_count(lhs.ranges.slice(lhs.anims_subranges(lhs_i)));
+        if (exists && out.anims > 0) { return out; }
     }
-   
-    // Process any remaining rhs animations
-    while (rhs_i < rhs.anims.size)
+    
+    for (; set_op<op>(false, true) && rhs_i < rhs.anims.size; rhs_i++)
     {
-        // Append submask to output
-        slice1d_bit submask = rhs.masks.slice(rhs.anims_submasks(rhs_i));
-        
-        out.anims(out_i) = rhs.anims(rhs_i);
-        out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
-        out.masks.slice(masks_i, masks_i + submask.size) = submask;
-        
-        masks_i+=submask.size;
-        out_i++;
-        rhs_i++;
+        out += ranges_count(rhs.ranges.slice(rhs.anims_subranges(rhs_i)));
+        if (exists && out.anims > 0) { return out; }
     }
     
-    // Resize output to match what was added
-    out.anims.resize(out_i);
-    out.anims_submasks.resize(out_i);
-    out.masks.resize(masks_i);
+    return out;
 }
 
-void mask_set_intersection(
-    mask_set& out, 
-    const mask_set& lhs, 
-    const mask_set& rhs)
-{ 
-    // Allocate potential maximum number of anims and masks we might to output
-    out.anims.resize(lhs.anims.size + rhs.anims.size);
-    out.anims_submasks.resize(lhs.anims.size + rhs.anims.size);
-    out.masks.resize(lhs.masks.size + rhs.masks.size);
+set_count range_set_union_count(const range_set& lhs, const range_set& rhs)
+{
+    return range_set_merge_count<SET_OP_UNION, false>(lhs, rhs);
+}
+
+set_count range_set_intersection_count(const range_set& lhs, const range_set& rhs)
+{
+    return range_set_merge_count<SET_OP_INTERSECTION, false>(lhs, rhs);
+}
+
+set_count range_set_difference_count(const range_set& lhs, const range_set& rhs)
+{
+    return range_set_merge_count<SET_OP_DIFFERENCE, false>(lhs, rhs);
+}
+
+bool range_set_union_exists(const range_set& lhs, const range_set& rhs)
+{
+    return range_set_merge_count<SET_OP_UNION, true>(lhs, rhs).anims > 0;
+}
+
+bool range_set_intersection_exists(const range_set& lhs, const range_set& rhs)
+{
+    return range_set_merge_count<SET_OP_INTERSECTION, true>(lhs, rhs).anims > 0;
+}
+
+bool range_set_difference_exists(const range_set& lhs, const range_set& rhs)
+{
+    return range_set_merge_count<SET_OP_DIFFERENCE, true>(lhs, rhs).anims > 0;
+}
+
+// Counts the result of a merge of any number of range 
+// sets without building it. Anims in two sets are 
+// counted directly, while anims in more are merged into 
+// `buffer` one at a time, so it only ever holds the 
+// ranges of a single anim. When `exists` is set this 
+// returns as soon as any anim is found with output.
+template<int op, bool exists>
+static set_count range_set_merge_n_count(
+    const slice1d<const range_set*> sets,
+    array1d<range>& buffer)
+{
+    assert(sets.size > 0);
     
-    // Anim index for each list of masks
-    int out_i = 0;
-    int lhs_i = 0;
-    int rhs_i = 0;
+    set_count out;
     
-    // Output masks index
-    int masks_i = 0;
+    inplace_array1d<int, 16> sets_i(sets.size);
+    inplace_array1d<ranges_cursor, 16> inputs(sets.size);
+    sets_i.zero();
     
-    // While both sets have animations
-    while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
+    int anim, inputs_num;
+    
+    while (range_set_merge_n_next<op>(anim, inputs_num, inputs, sets_i, sets))
     {
-        // If animation is in lhs but not rhs skip
-        if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
+        if (inputs_num == 1)
         {
-            lhs_i++;
+            out += ranges_count(inputs(0).curr, inputs(0).end);
         }
-        // If animation is in rhs but not lhs skip
-        else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
+        else if (inputs_num == 2)
         {
-            rhs_i++;
+            out += ranges_merge_count<op, exists>(
+                slice1d<range>(inputs(0).end - inputs(0).curr, (range*)inputs(0).curr),
+                slice1d<range>(inputs(1).end - inputs(1).curr, (range*)inputs(1).curr));
         }
-        // If animation is in both lhs and rhs
-        else 
-        {   
-            // Append intersection of submask to output
-            int nmasks = lhs.masks.slice(lhs.anims_submasks(lhs_i)).size;
+        else
+        {
+            int ranges_num = 0;
+            for (int j = 0; j < inputs_num; j++)
+            {
+                ranges_num += inputs(j).end - inputs(j).curr;
+            }
             
-            mask_intersection(
-                out.masks.slice(masks_i, masks_i + nmasks),
-                lhs.masks.slice(lhs.anims_submasks(lhs_i)),
-                rhs.masks.slice(rhs.anims_submasks(rhs_i)));      
+            if (buffer.size < ranges_num)
+            {
+                buffer.resize(ranges_num);
+            }
             
-            out.anims(out_i) = lhs.anims(lhs_i);
-            out.anims_submasks(out_i) = { masks_i, masks_i + nmasks };
+            int nranges;
             
-            masks_i+=nmasks;
-            out_i++;
-            lhs_i++; rhs_i++;
+            if (op == SET_OP_UNION)
+            {
+                nranges = ranges_union_n(buffer, inputs.slice(0, inputs_num));
+            }
+            else if (op == SET_OP_INTERSECTION)
+            {
+                nranges = ranges_intersection_n(buffer, inputs.slice(0, inputs_num));
+            }
+            else
+            {
+                nranges = ranges_difference_n(buffer, inputs.slice(0, inputs_num));
+            }
+            
+            out += ranges_count(buffer.data, buffer.data + nranges);
         }
+        
+        if (exists && out.anims > 0) { return out; }
     }
     
-    // Resize output to match what was added
-    out.anims.resize(out_i);
-    out.anims_submasks.resize(out_i);
-    out.masks.resize(masks_i);
+    return out;
 }
 
-void mask_set_difference(
-    mask_set& out, 
-    const mask_set& lhs, 
-    const mask_set& rhs)
-{ 
-    // Allocate potential maximum number of anims and ranges we might to output
-    out.anims.resize(lhs.anims.size + rhs.anims.size);
-    out.anims_submasks.resize(lhs.anims.size + rhs.anims.size);
-    out.masks.resize(lhs.masks.size + rhs.masks.size);
+// Copies into `out` the anims of `set` which are in 
+// the sorted list `anims`
+void range_set_select(
+    range_set& out,
+    const range_set& set,
+    const slice1d<int> anims)
+{
+    int nanims = 0;
+    int nranges = 0;
     
-    // Anim index for each list of masks
-    int out_i = 0;
-    int lhs_i = 0;
-    int rhs_i = 0;
+    for (int i = 0, j = 0; j < anims.size; j++)
+    {
+        i = anims_gallop(set.anims, i, anims(j));
+        if (i == set.anims.size) { break; }
+        
+        if (set.anims(i) == anims(j))
+        {
+            nanims++;
+            nranges += set.anims_subranges(i).stop - set.anims_subranges(i).start;
+        }
+    }
     
-    // Output masks index
-    int masks_i = 0;
+    out.anims.resize(nanims);
+    out.anims_subranges.resize(nanims);
+    out.ranges.resize(nranges);
     
-    // While both sets have animations
-    while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
+    int out_i = 0;
+    int ranges_i = 0;
+    
+    for (int i = 0, j = 0; out_i < nanims; j++)
     {
-        // If animation from lhs is first
-        if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
+        i = anims_gallop(set.anims, i, anims(j));
+        
+        if (set.anims(i) == anims(j))
         {
-            slice1d_bit submask = lhs.masks.slice(lhs.anims_submasks(lhs_i));
+            slice1d<range> sranges = set.ranges.slice(set.anims_subranges(i));
             
-            out.anims(out_i) = lhs.anims(lhs_i);
-            out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
-            out.masks.slice(masks_i, masks_i + submask.size) = submask;
+            out.anims(out_i) = set.anims(i);
+            out.anims_subranges(out_i) = { ranges_i, ranges_i + sranges.size };
+            out.ranges.slice(ranges_i, ranges_i + sranges.size) = sranges;
             
-            masks_i+=submask.size;
+            ranges_i += sranges.size;
             out_i++;
-            lhs_i++;
         }
-        // If animation is in rhs but not lhs skip
-        else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
+    }
+}
+
+// Writes to `out` the anims of `set` with those in the
+// sorted list `anims` replaced by the anims of `patch`,
+// which should only contain anims from that list. The 
+// anims between each edited anim are copied in one go, 
+// relying on the ranges of each anim following on from 
+// those of the previous anim.
+void range_set_splice(
+    range_set& out,
+    const range_set& set,
+    const slice1d<int> anims,
+    const range_set& patch)
+{
+    assert(&out != &set && &out != &patch);
+    
+    out.anims.resize(set.anims.size + patch.anims.size);
+    out.anims_subranges.resize(set.anims.size + patch.anims.size);
+    out.ranges.resize(set.ranges.size + patch.ranges.size);
+    
+    int out_i = 0;
+    int set_i = 0;
+    int patch_i = 0;
+    int ranges_i = 0;
+    
+    for (int anims_i = 0; anims_i <= anims.size; anims_i++)
+    {
+        int anim = anims_i < anims.size ? anims(anims_i) : INT_MAX;
+        
+        // Copy run of anims before the edited anim
+        int run = anims_gallop(set.anims, set_i, anim) - set_i;
+        
+        if (run > 0)
         {
-            rhs_i++;
+            int start = set.anims_subranges(set_i).start;
+            int stop = set.anims_subranges(set_i + run - 1).stop;
+            
+            out.anims.slice(out_i, out_i + run) = set.anims.slice(set_i, set_i + run);
+            out.ranges.slice(ranges_i, ranges_i + stop - start) = set.ranges.slice(start, stop);
+            
+            for (int i = 0; i < run; i++)
+            {
+                out.anims_subranges(out_i + i) = { 
+                    set.anims_subranges(set_i + i).start - start + ranges_i, 
+                    set.anims_subranges(set_i + i).stop - start + ranges_i };
+            }
+            
+            set_i += run;
+            out_i += run;
+            ranges_i += stop - start;
         }
-        // If animation is in both lhs and rhs
-        else
+        
+        if (anims_i == anims.size) { break; }
+        
+        // Skip the old edited anim and add the new one
+        set_i += set_i < set.anims.size && set.anims(set_i) == anim;
+        
+        if (patch_i < patch.anims.size && patch.anims(patch_i) == anim)
         {
-            // Append difference of submask to output
-            int nmasks = lhs.masks.slice(lhs.anims_submasks(lhs_i)).size;
-            
-            mask_difference(
-                out.masks.slice(masks_i, masks_i + nmasks),
-                lhs.masks.slice(lhs.anims_submasks(lhs_i)),
-                rhs.masks.slice(rhs.anims_submasks(rhs_i)));      
+            slice1d<range> sranges = patch.ranges.slice(patch.anims_subranges(patch_i));
             
-            out.anims(out_i) = lhs.anims(lhs_i);
-            out.anims_submasks(out_i) = { masks_i, masks_i + nmasks };
+            out.anims(out_i) = anim;
+            out.anims_subranges(out_i) = { ranges_i, ranges_i + sranges.size };
+            out.ranges.slice(ranges_i, ranges_i + sranges.size) = sranges;
             
-            masks_i+=nmasks;
+            ranges_i += sranges.size;
             out_i++;
-            lhs_i++; rhs_i++;
+            patch_i++;
         }
     }
     
-    // Process any remaining lhs animations
-    while (lhs_i < lhs.anims.size)
-    {
-        slice1d_bit submask = lhs.masks.slice(lhs.anims_submasks(lhs_i));
-        
-        out.anims(out_i) = lhs.anims(lhs_i);
-        out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
-        out.masks.slice(masks_i, masks_i + submask.size) = submask;
-        
-        masks_i+=submask.size;
-        out_i++;
-        lhs_i++;
-    }
+    assert(patch_i == patch.anims.size);
     
-    // Resize output to match what was added
     out.anims.resize(out_i);
-    out.anims_submasks.resize(out_i);
-    out.masks.resize(masks_i);
+    out.anims_subranges.resize(out_i);
+    out.ranges.resize(ranges_i);
 }
 
-
-//--------------------------------------
-
-// Query operations encoded by negative numbers
-enum
+// Anim in the output of a set operation on two sets, 
+// with its index in each set or -1 if not in that set
+struct set_op_anim
 {
-    QUERY_OP_UNION        = -1,
-    QUERY_OP_INTERSECTION = -2,
-    QUERY_OP_DIFFERENCE   = -3
+    int anim;
+    int lhs_i;
+    int rhs_i;
 };
 
-// Query expr object consists of a stack of set 
-// indices and logical operations
-struct query_expr
+// Finds which anims are output by a set operation and 
+// where they are in the inputs. Returns the number found.
+template<int op>
+static int set_op_anims(
+    slice1d<set_op_anim> out,
+    const slice1d<int> lhs,
+    const slice1d<int> rhs)
 {
-    // Construct empty expression
-    query_expr() {}
-    
-    // Construct from a single set index
-    query_expr(int set) : stack(1) { stack(0) = set; }
+    int out_i = 0;
+    int lhs_i = 0;
+    int rhs_i = 0;
     
-    // Construct from two other range set queries and an op
-    query_expr(
-        const query_expr& lhs,
-        const query_expr& rhs,
-        int op)
-        : stack(lhs.stack.size + rhs.stack.size + 1)
+    while (lhs_i < lhs.size || rhs_i < rhs.size)
     {
-        // Assert op is negative
-        assert(op < 0);
+        int lhs_anim = lhs_i < lhs.size ? lhs(lhs_i) : INT_MAX;
+        int rhs_anim = rhs_i < rhs.size ? rhs(rhs_i) : INT_MAX;
         
-        // Copy rhs and lhs into stack
-        stack.slice(0, rhs.stack.size) = rhs.stack;
-        stack.slice(rhs.stack.size, rhs.stack.size + lhs.stack.size) = lhs.stack;
+        if (lhs_anim < rhs_anim)
+        {
+            if (set_op<op>(true, false)) { out(out_i++) = { lhs_anim, lhs_i, -1 }; }
+            lhs_i++;
+        }
+        else if (rhs_anim < lhs_anim)
+        {
+            if (set_op<op>(false, true)) { out(out_i++) = { rhs_anim, -1, rhs_i }; }
+            rhs_i++;
+        }
+        else
+        {
+            out(out_i++) = { lhs_anim, lhs_i, rhs_i };
+            lhs_i++; rhs_i++;
+        }
+    }
+    
+    return out_i;
+}
+
+// Number of anims processed by each task of parallel operations
+enum { SET_OP_PARALLEL_GRAIN = 64 };
+
+// Performs a set operation over anims in parallel using 
+// two passes. The first counts the ranges output for each 
+// anim, then after a prefix sum gives where each anim's
+// ranges go, the second fills them in. The output is the
+// same as the single threaded version, which is used when
+// the pool has no worker threads.
+template<int op>
+static void range_set_merge_parallel(
+    range_set& out, 
+    const range_set& lhs, 
+    const range_set& rhs,
+    thread_pool& pool)
+{
+    array1d<set_op_anim> anims(lhs.anims.size + rhs.anims.size);
+    int nanims = set_op_anims<op>(anims, lhs.anims, rhs.anims);
+    
+    // Offset of the ranges of each anim in the output
+    array1d<int> offsets(nanims + 1);
+    
+    auto anim_ranges = [](const range_set& set, int i)
+    {
+        return i >= 0 ? set.ranges.slice(set.anims_subranges(i)) : slice1d<range>(0, NULL);
+    };
+    
+    parallel_for(pool, nanims, SET_OP_PARALLEL_GRAIN, [&](int start, int stop)
+    {
+        for (int i = start; i < stop; i++)
+        {
+            slice1d<range> lhs_ranges = anim_ranges(lhs, anims(i).lhs_i);
+            slice1d<range> rhs_ranges = anim_ranges(rhs, anims(i).rhs_i);
+            
+            offsets(i + 1) = 
+                anims(i).lhs_i < 0 ? rhs_ranges.size :
+                anims(i).rhs_i < 0 ? lhs_ranges.size :
+                ranges_merge<op, true>(slice1d<range>(0, NULL), lhs_ranges, rhs_ranges);
+        }
+    });
+    
+    // Drop merged anims left with no ranges, as the single
+    // threaded version does, while summing the counts into 
+    // offsets
+    int out_n = 0;
+    offsets(0) = 0;
+    for (int i = 0; i < nanims; i++)
+    {
+        int count = offsets(i + 1);
         
-        // Put op on top
-        stack(stack.size - 1) = op;
+        if (count > 0 || anims(i).lhs_i < 0 || anims(i).rhs_i < 0)
+        {
+            anims(out_n) = anims(i);
+            offsets(out_n + 1) = offsets(out_n) + count;
+            out_n++;
+        }
     }
+    nanims = out_n;
     
-    // Inplace array used to store stack - can store
-    // up to 16 elements without using heap allocation
-    inplace_array1d<int, 16> stack;
-};
+    out.anims.resize(nanims);
+    out.anims_subranges.resize(nanims);
+    out.ranges.resize(offsets(nanims));
+    
+    parallel_for(pool, nanims, SET_OP_PARALLEL_GRAIN, [&](int start, int stop)
+    {
+        for (int i = start; i < stop; i++)
+        {
+            slice1d<range> lhs_ranges = anim_ranges(lhs, anims(i).lhs_i);
+            slice1d<range> rhs_ranges = anim_ranges(rhs, anims(i).rhs_i);
+            slice1d<range> out_ranges = out.ranges.slice(offsets(i), offsets(i + 1));
+            
+            if (anims(i).lhs_i < 0) 
+            { 
+                out_ranges = rhs_ranges; 
+            }
+            else if (anims(i).rhs_i < 0) 
+            { 
+                out_ranges = lhs_ranges; 
+            }
+            else 
+            { 
+                ranges_merge<op>(out_ranges, lhs_ranges, rhs_ranges); 
+            }
+            
+            out.anims(i) = anims(i).anim;
+            out.anims_subranges(i) = { offsets(i), offsets(i + 1) };
+        }
+    });
+}
 
-query_expr operator|(const query_expr& lhs, const query_expr& rhs)
+void range_set_union(
+    range_set& out, 
+    const range_set& lhs, 
+    const range_set& rhs,
+    thread_pool& pool)
 {
-    return query_expr(lhs, rhs, QUERY_OP_UNION);
+    if (pool.threads.empty())
+    {
+        range_set_union(out, lhs, rhs);
+    }
+    else
+    {
+        range_set_merge_parallel<SET_OP_UNION>(out, lhs, rhs, pool);
+    }
 }
 
-query_expr operator&(const query_expr& lhs, const query_expr& rhs)
+void range_set_intersection(
+    range_set& out, 
+    const range_set& lhs, 
+    const range_set& rhs,
+    thread_pool& pool)
 {
-    return query_expr(lhs, rhs, QUERY_OP_INTERSECTION);
+    if (pool.threads.empty())
+    {
+        range_set_intersection(out, lhs, rhs);
+    }
+    else
+    {
+        range_set_merge_parallel<SET_OP_INTERSECTION>(out, lhs, rhs, pool);
+    }
 }
 
-query_expr operator-(const query_expr& lhs, const query_expr& rhs)
+void range_set_difference(
+    range_set& out, 
+    const range_set& lhs, 
+    const range_set& rhs,
+    thread_pool& pool)
 {
-    return query_expr(lhs, rhs, QUERY_OP_DIFFERENCE);
+    if (pool.threads.empty())
+    {
+        range_set_difference(out, lhs, rhs);
+    }
+    else
+    {
+        range_set_merge_parallel<SET_OP_DIFFERENCE>(out, lhs, rhs, pool);
+    }
 }
 
 //--------------------------------------
 
-// Quick and dirty hash function
-size_t memhash(const void* ptr, size_t num)
+// Applies `op` to `n` whole bytes. The widest vector
+// instruction set available at compile time is used
+// for the bulk, with 64-bit words and then single 
+// bytes used for whatever is left over.
+template<int op>
+static void mask_op_bytes(
+    unsigned char* __restrict__ out,
+    const unsigned char* __restrict__ lhs,
+    const unsigned char* __restrict__ rhs,
+    int n)
 {
-    size_t h = 0x7A99ED;
-    for (int i = 0; i < num; i++)
+    int i = 0;
+    
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32)
     {
-        h = (h * 54059) ^ (((const char*)ptr)[i] * 76963);
+        __m256i l = _mm256_loadu_si256((const __m256i*)(lhs + i));
+        __m256i r = _mm256_loadu_si256((const __m256i*)(rhs + i));
+        _mm256_storeu_si256((__m256i*)(out + i),
+            op == SET_OP_UNION        ? _mm256_or_si256(l, r) :
+            op == SET_OP_INTERSECTION ? _mm256_and_si256(l, r) : _mm256_andnot_si256(r, l));
     }
-    return h;
-}
+#elif defined(__SSE2__)
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i l = _mm_loadu_si128((const __m128i*)(lhs + i));
+        __m128i r = _mm_loadu_si128((const __m128i*)(rhs + i));
+        _mm_storeu_si128((__m128i*)(out + i),
+            op == SET_OP_UNION        ? _mm_or_si128(l, r) :
+            op == SET_OP_INTERSECTION ? _mm_and_si128(l, r) : _mm_andnot_si128(r, l));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t l = vld1q_u8(lhs + i);
+        uint8x16_t r = vld1q_u8(rhs + i);
+        vst1q_u8(out + i,
+            op == SET_OP_UNION        ? vorrq_u8(l, r) :
+            op == SET_OP_INTERSECTION ? vandq_u8(l, r) : vbicq_u8(l, r));
+    }
+#elif defined(__wasm_simd128__)
+    for (; i + 16 <= n; i += 16)
+    {
+        v128_t l = wasm_v128_load(lhs + i);
+        v128_t r = wasm_v128_load(rhs + i);
+        wasm_v128_store(out + i,
+            op == SET_OP_UNION        ? wasm_v128_or(l, r) :
+            op == SET_OP_INTERSECTION ? wasm_v128_and(l, r) : wasm_v128_andnot(l, r));
+    }
+#endif
 
-// Hash function for queries
-struct query_expr_hash
-{
-    size_t operator()(const query_expr& x) const
+    for (; i + 8 <= n; i += 8)
     {
-        return memhash(x.stack.data, sizeof(int) * x.stack.size);
+        uint64_t l, r, o;
+        memcpy(&l, lhs + i, sizeof(uint64_t));
+        memcpy(&r, rhs + i, sizeof(uint64_t));
+        o = set_op<op>(l, r);
+        memcpy(out + i, &o, sizeof(uint64_t));
     }
-};
+    
+    for (; i < n; i++)
+    {
+        out[i] = set_op<op>(lhs[i], rhs[i]);
+    }
+}
 
-// Comparison function for queries
-struct query_expr_cmp
+// Applies `op` to whole masks. Bits are processed one
+// output byte at a time for the unaligned head and tail 
+// and in bulk for the middle. When all three masks share 
+// the same bit offset the middle is done with plain byte 
+// operations, otherwise inputs are funnel shifted into 
+// place 64 bits at a time.
+template<int op>
+static void mask_op_slices(
+    slice1d_bit out,
+    const slice1d_bit lhs,
+    const slice1d_bit rhs)
 {
-    bool operator()(const query_expr& lhs, const query_expr& rhs) const
-    {   
-        if (lhs.stack.size == rhs.stack.size)
-        {
-            return memcmp(
-                lhs.stack.data, 
-                rhs.stack.data, 
-                sizeof(int) * lhs.stack.size) == 0;
-        }
-        else
+    assert((out.size == lhs.size) && (out.size == rhs.size));
+    
+    unsigned char* o = out.data + out.offset / 8;
+    int o_offset = out.offset % 8;
+    int i = 0;
+    
+    // Process head bits until output is byte aligned
+    if (o_offset != 0 && out.size > 0)
+    {
+        int n = std::min(8 - o_offset, out.size);
+        unsigned char v = set_op<op>(
+            bit_load8(lhs.data, lhs.offset, n), 
+            bit_load8(rhs.data, rhs.offset, n));
+            
+        bit_store8_masked(o, v << o_offset, ((1 << n) - 1) << o_offset);
+        
+        o++;
+        i += n;
+    }
+    
+    // Process middle bytes
+    int l_i = lhs.offset + i;
+    int r_i = rhs.offset + i;
+    
+    if (l_i % 8 == 0 && r_i % 8 == 0)
+    {
+        int nbytes = (out.size - i) / 8;
+        mask_op_bytes<op>(o, lhs.data + l_i / 8, rhs.data + r_i / 8, nbytes);
+        o += nbytes;
+        i += nbytes * 8;
+    }
+    else
+    {
+        for (; i + 64 <= out.size; i += 64, o += 8)
+        {
+            uint64_t v = set_op<op>(
+                bit_load64(lhs.data, lhs.offset + i), 
+                bit_load64(rhs.data, rhs.offset + i));
+                
+            memcpy(o, &v, sizeof(uint64_t));
+        }
+        
+        for (; i + 8 <= out.size; i += 8, o++)
+        {
+            *o = set_op<op>(
+                bit_load8(lhs.data, lhs.offset + i), 
+                bit_load8(rhs.data, rhs.offset + i));
+        }
+    }
+    
+    // Process tail bits
+    if (i < out.size)
+    {
+        int n = out.size - i;
+        unsigned char v = set_op<op>(
+            bit_load8(lhs.data, lhs.offset + i, n), 
+            bit_load8(rhs.data, rhs.offset + i, n));
+        
+        bit_store8_masked(o, v, (1 << n) - 1);
+    }
+}
+
+// Counts the ranges and frames in the result of `op` on 
+// two masks without writing it anywhere. Frames are the
+// set bits, and ranges are the set bits whose previous 
+// bit is not set, both counted a word at a time.
+template<int op, bool exists>
+static set_count mask_op_count(
+    const slice1d_bit lhs,
+    const slice1d_bit rhs)
+{
+    assert(lhs.size == rhs.size);
+    
+    set_count out;
+    
+    // Last bit of the previous word
+    uint64_t prev = 0;
+    int i = 0;
+    
+    for (; i + 64 <= lhs.size; i += 64)
+    {
+        uint64_t w = set_op<op>(
+            bit_load64(lhs.data, lhs.offset + i), 
+            bit_load64(rhs.data, rhs.offset + i));
+        
+        if (exists && w) { out.anims = 1; return out; }
+        
+        out.ranges += bit_popcount64(w & ~((w << 1) | prev));
+        out.frames += bit_popcount64(w);
+        prev = w >> 63;
+    }
+    
+    for (; i < lhs.size; i += 8)
+    {
+        int n = std::min(8, lhs.size - i);
+        uint64_t w = (unsigned char)set_op<op>(
+            bit_load8(lhs.data, lhs.offset + i, n), 
+            bit_load8(rhs.data, rhs.offset + i, n)) & ((1 << n) - 1);
+        
+        if (exists && w) { out.anims = 1; return out; }
+        
+        out.ranges += bit_popcount64(w & ~((w << 1) | prev));
+        out.frames += bit_popcount64(w);
+        prev = (w >> (n - 1)) & 1;
+    }
+    
+    out.anims = out.frames > 0;
+    
+    return out;
+}
+
+// Counts a single mask, as the intersection with itself
+template<bool exists>
+static inline set_count mask_count(const slice1d_bit mask)
+{
+    return mask_op_count<SET_OP_INTERSECTION, exists>(mask, mask);
+}
+
+void mask_union(
+    slice1d_bit out,
+    const slice1d_bit lhs,
+    const slice1d_bit rhs)
+{
+    mask_op_slices<SET_OP_UNION>(out, lhs, rhs);
+}
+
+void mask_intersection(
+    slice1d_bit out,
+    const slice1d_bit lhs,
+    const slice1d_bit rhs)
+{
+    mask_op_slices<SET_OP_INTERSECTION>(out, lhs, rhs);
+}
+
+void mask_difference(
+    slice1d_bit out,
+    const slice1d_bit lhs,
+    const slice1d_bit rhs)
+{
+    mask_op_slices<SET_OP_DIFFERENCE>(out, lhs, rhs);
+}
+
+void mask_custom_logic(
+    slice1d_bit query,
+    const slice1d_bit running,
+    const slice1d_bit male,
+    const slice1d_bit tired,
+    const slice1d_bit limping)
+{   
+    for (int i = 0; i < query.size; i++)
+    {
+        query.set(i,
+            running.get(i) && male.get(i) && (tired.get(i) || limping.get(i)));
+    }
+}
+
+//--------------------------------------
+
+struct mask_set
+{
+    array1d<int>   anims;           // Sorted ids of all anims with masks in set
+    array1d<range> anims_submasks;  // Slices of `masks` array for each anim
+    array1d_bit    masks;           // Full list of all masks for all animations 
+};
+
+// Each submask starts on a 64-bit boundary of `masks` so
+// that submasks from different sets line up with each 
+// other and the mask kernels can take their aligned path
+static inline int mask_set_align(int masks_i)
+{
+    return ((masks_i + 63) / 64) * 64;
+}
+
+// Memory used by the data of a mask set in bytes
+size_t memory_usage(const mask_set& set)
+{
+    return 
+        set.anims.size * sizeof(int) +
+        set.anims_submasks.size * sizeof(range) +
+        bit_alloc_size(set.masks.size);
+}
+
+// Empties a mask set but keeps its memory for reuse
+void mask_set_clear(mask_set& set)
+{
+    set.anims.resize(0);
+    set.anims_submasks.resize(0);
+    set.masks.resize(0);
+}
+
+void mask_set_union(
+    mask_set& out, 
+    const mask_set& lhs, 
+    const mask_set& rhs)
+{ 
+    // Allocate potential maximum number of anims and ranges we might to output
+    out.anims.resize(lhs.anims.size + rhs.anims.size);
+    out.anims_submasks.resize(lhs.anims.size + rhs.anims.size);
+    out.masks.resize(lhs.masks.size + rhs.masks.size);
+    
+    // Anim index for each list of masks
+    int out_i = 0;
+    int lhs_i = 0;
+    int rhs_i = 0;
+    
+    // Output masks index
+    int masks_i = 0;
+    
+    // While both sets have animations
+    while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
+    {
+        // If animation from lhs is first
+        if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
+        {
+            // Append submask to output
+            slice1d_bit submask = lhs.masks.slice(lhs.anims_submasks(lhs_i));
+            
+            out.anims(out_i) = lhs.anims(lhs_i);
+            out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
+            out.masks.slice(masks_i, masks_i + submask.size) = submask;            
+            
+            masks_i = mask_set_align(masks_i + submask.size);
+            out_i++;
+            lhs_i++;
+        }
+        // If animation from rhs is first
+        else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
+        {
+            // Append submask to output
+            slice1d_bit submask = rhs.masks.slice(rhs.anims_submasks(rhs_i));
+            
+            out.anims(out_i) = rhs.anims(rhs_i);
+            out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
+            out.masks.slice(masks_i, masks_i + submask.size) = submask;
+            
+            masks_i = mask_set_align(masks_i + submask.size);
+            out_i++;
+            rhs_i++;
+        }
+        // If both contain the same animation
+        else 
+        {
+            // Append union of submask to output
+            int nmasks = lhs.masks.slice(lhs.anims_submasks(lhs_i)).size;
+            
+            mask_union(
+                out.masks.slice(masks_i, masks_i + nmasks),
+                lhs.masks.slice(lhs.anims_submasks(lhs_i)),
+                rhs.masks.slice(rhs.anims_submasks(rhs_i)));      
+            
+            out.anims(out_i) = lhs.anims(lhs_i);
+            out.anims_submasks(out_i) = { masks_i, masks_i + nmasks };
+            
+            masks_i = mask_set_align(masks_i + nmasks);
+            out_i++;
+            lhs_i++; rhs_i++;
+        }
+    }
+    
+    // Process any remaining lhs animations
+    while (lhs_i < lhs.anims.size)
+    {
+        // Append submask to output
+        slice1d_bit submask = lhs.masks.slice(lhs.anims_submasks(lhs_i));
+        
+        out.anims(out_i) = lhs.anims(lhs_i);
+        out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
+        out.masks.slice(masks_i, masks_i + submask.size) = submask;
+        
+        masks_i = mask_set_align(masks_i + submask.size);
+        out_i++;
+        lhs_i++;
+    }
+   
+    // Process any remaining rhs animations
+    while (rhs_i < rhs.anims.size)
+    {
+        // Append submask to output
+        slice1d_bit submask = rhs.masks.slice(rhs.anims_submasks(rhs_i));
+        
+        out.anims(out_i) = rhs.anims(rhs_i);
+        out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
+        out.masks.slice(masks_i, masks_i + submask.size) = submask;
+        
+        masks_i = mask_set_align(masks_i + submask.size);
+        out_i++;
+        rhs_i++;
+    }
+    
+    // Resize output to match what was added
+    out.anims.resize(out_i);
+    out.anims_submasks.resize(out_i);
+    out.masks.resize(masks_i);
+}
+
+void mask_set_intersection(
+    mask_set& out, 
+    const mask_set& lhs, 
+    const mask_set& rhs)
+{ 
+    // Allocate potential maximum number of anims and masks we might to output
+    out.anims.resize(lhs.anims.size + rhs.anims.size);
+    out.anims_submasks.resize(lhs.anims.size + rhs.anims.size);
+    out.masks.resize(lhs.masks.size + rhs.masks.size);
+    
+    // Anim index for each list of masks
+    int out_i = 0;
+    int lhs_i = 0;
+    int rhs_i = 0;
+    
+    // Output masks index
+    int masks_i = 0;
+    
+    // While both sets have animations
+    while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
+    {
+        // If animation is in lhs but not rhs skip to
+        // the next lhs animation which could be in rhs
+        if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
+        {
+            lhs_i = anims_gallop(lhs.anims, lhs_i, rhs.anims(rhs_i));
+        }
+        // If animation is in rhs but not lhs skip to
+        // the next rhs animation which could be in lhs
+        else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
+        {
+            rhs_i = anims_gallop(rhs.anims, rhs_i, lhs.anims(lhs_i));
+        }
+        // If animation is in both lhs and rhs
+        else 
+        {   
+            // Append intersection of submask to output
+            int nmasks = lhs.masks.slice(lhs.anims_submasks(lhs_i)).size;
+            
+            mask_intersection(
+                out.masks.slice(masks_i, masks_i + nmasks),
+                lhs.masks.slice(lhs.anims_submasks(lhs_i)),
+                rhs.masks.slice(rhs.anims_submasks(rhs_i)));      
+            
+            out.anims(out_i) = lhs.anims(lhs_i);
+            out.anims_submasks(out_i) = { masks_i, masks_i + nmasks };
+            
+            masks_i = mask_set_align(masks_i + nmasks);
+            out_i++;
+            lhs_i++; rhs_i++;
+        }
+    }
+    
+    // Resize output to match what was added
+    out.anims.resize(out_i);
+    out.anims_submasks.resize(out_i);
+    out.masks.resize(masks_i);
+}
+
+void mask_set_difference(
+    mask_set& out, 
+    const mask_set& lhs, 
+    const mask_set& rhs)
+{ 
+    // Allocate potential maximum number of anims and ranges we might to output
+    out.anims.resize(lhs.anims.size + rhs.anims.size);
+    out.anims_submasks.resize(lhs.anims.size + rhs.anims.size);
+    out.masks.resize(lhs.masks.size + rhs.masks.size);
+    
+    // Anim index for each list of masks
+    int out_i = 0;
+    int lhs_i = 0;
+    int rhs_i = 0;
+    
+    // Output masks index
+    int masks_i = 0;
+    
+    // While both sets have animations
+    while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
+    {
+        // If animation from lhs is first
+        if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
+        {
+            slice1d_bit submask = lhs.masks.slice(lhs.anims_submasks(lhs_i));
+            
+            out.anims(out_i) = lhs.anims(lhs_i);
+            out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
+            out.masks.slice(masks_i, masks_i + submask.size) = submask;
+            
+            masks_i = mask_set_align(masks_i + submask.size);
+            out_i++;
+            lhs_i++;
+        }
+        // If animation is in rhs but not lhs skip to
+        // the next rhs animation which could be in lhs
+        else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
+        {
+            rhs_i = anims_gallop(rhs.anims, rhs_i, lhs.anims(lhs_i));
+        }
+        // If animation is in both lhs and rhs
+        else
+        {
+            // Append difference of submask to output
+            int nmasks = lhs.masks.slice(lhs.anims_submasks(lhs_i)).size;
+            
+            mask_difference(
+                out.masks.slice(masks_i, masks_i + nmasks),
+                lhs.masks.slice(lhs.anims_submasks(lhs_i)),
+                rhs.masks.slice(rhs.anims_submasks(rhs_i)));      
+            
+            out.anims(out_i) = lhs.anims(lhs_i);
+            out.anims_submasks(out_i) = { masks_i, masks_i + nmasks };
+            
+            masks_i = mask_set_align(masks_i + nmasks);
+            out_i++;
+            lhs_i++; rhs_i++;
+        }
+    }
+    
+    // Process any remaining lhs animations
+    while (lhs_i < lhs.anims.size)
+    {
+        slice1d_bit submask = lhs.masks.slice(lhs.anims_submasks(lhs_i));
+        
+        out.anims(out_i) = lhs.anims(lhs_i);
+        out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
+        out.masks.slice(masks_i, masks_i + submask.size) = submask;
+        
+        masks_i = mask_set_align(masks_i + submask.size);
+        out_i++;
+        lhs_i++;
+    }
+    
+    // Resize output to match what was added
+    out.anims.resize(out_i);
+    out.anims_submasks.resize(out_i);
+    out.masks.resize(masks_i);
+}
+
+// Copies into `out` the anims of `set` which are in 
+// the sorted list `anims`
+void mask_set_select(
+    mask_set& out,
+    const mask_set& set,
+    const slice1d<int> anims)
+{
+    int nanims = 0;
+    int nmasks = 0;
+    
+    for (int i = 0, j = 0; j < anims.size; j++)
+    {
+        i = anims_gallop(set.anims, i, anims(j));
+        if (i == set.anims.size) { break; }
+        
+        if (set.anims(i) == anims(j))
+        {
+            nanims++;
+            nmasks = mask_set_align(nmasks + set.anims_submasks(i).stop - set.anims_submasks(i).start);
+        }
+    }
+    
+    out.anims.resize(nanims);
+    out.anims_submasks.resize(nanims);
+    out.masks.resize(nmasks);
+    
+    int out_i = 0;
+    int masks_i = 0;
+    
+    for (int i = 0, j = 0; out_i < nanims; j++)
+    {
+        i = anims_gallop(set.anims, i, anims(j));
+        
+        if (set.anims(i) == anims(j))
+        {
+            slice1d_bit submask = set.masks.slice(set.anims_submasks(i));
+            
+            out.anims(out_i) = set.anims(i);
+            out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
+            out.masks.slice(masks_i, masks_i + submask.size) = submask;
+            
+            masks_i = mask_set_align(masks_i + submask.size);
+            out_i++;
+        }
+    }
+}
+
+// Writes to `out` the anims of `set` with those in the
+// sorted list `anims` replaced by the anims of `patch`,
+// which should only contain anims from that list. The 
+// anims between each edited anim are copied in one go,
+// relying on the mask of each anim following on from 
+// the mask of the previous anim.
+void mask_set_splice(
+    mask_set& out,
+    const mask_set& set,
+    const slice1d<int> anims,
+    const mask_set& patch)
+{
+    assert(&out != &set && &out != &patch);
+    
+    out.anims.resize(set.anims.size + patch.anims.size);
+    out.anims_submasks.resize(set.anims.size + patch.anims.size);
+    out.masks.resize(set.masks.size + patch.masks.size);
+    
+    int out_i = 0;
+    int set_i = 0;
+    int patch_i = 0;
+    int masks_i = 0;
+    
+    for (int anims_i = 0; anims_i <= anims.size; anims_i++)
+    {
+        int anim = anims_i < anims.size ? anims(anims_i) : INT_MAX;
+        
+        // Copy run of anims before the edited anim
+        int run = anims_gallop(set.anims, set_i, anim) - set_i;
+        
+        if (run > 0)
+        {
+            int start = set.anims_submasks(set_i).start;
+            int stop = set.anims_submasks(set_i + run - 1).stop;
+            
+            out.anims.slice(out_i, out_i + run) = set.anims.slice(set_i, set_i + run);
+            out.masks.slice(masks_i, masks_i + stop - start) = set.masks.slice(start, stop);
+            
+            for (int i = 0; i < run; i++)
+            {
+                out.anims_submasks(out_i + i) = { 
+                    set.anims_submasks(set_i + i).start - start + masks_i, 
+                    set.anims_submasks(set_i + i).stop - start + masks_i };
+            }
+            
+            set_i += run;
+            out_i += run;
+            masks_i = mask_set_align(masks_i + stop - start);
+        }
+        
+        if (anims_i == anims.size) { break; }
+        
+        // Skip the old edited anim and add the new one
+        set_i += set_i < set.anims.size && set.anims(set_i) == anim;
+        
+        if (patch_i < patch.anims.size && patch.anims(patch_i) == anim)
+        {
+            slice1d_bit submask = patch.masks.slice(patch.anims_submasks(patch_i));
+            
+            out.anims(out_i) = anim;
+            out.anims_submasks(out_i) = { masks_i, masks_i + submask.size };
+            out.masks.slice(masks_i, masks_i + submask.size) = submask;
+            
+            masks_i = mask_set_align(masks_i + submask.size);
+            out_i++;
+            patch_i++;
+        }
+    }
+    
+    assert(patch_i == patch.anims.size);
+    
+    out.anims.resize(out_i);
+    out.anims_submasks.resize(out_i);
+    out.masks.resize(masks_i);
+}
+
+// Number of anims, ranges and frames in a mask set
+set_count mask_set_count(const mask_set& set)
+{
+    set_count out;
+    
+    for (int i = 0; i < set.anims.size; i++)
+    {
+        out += mask_count<false>(set.masks.slice(set.anims_submasks(i)));
+    }
+    
+    return out;
+}
+
+// Counts the result of a set operation on two mask sets
+// without building it, using popcounts of the combined 
+// masks. When `exists` is set this returns as soon as 
+// any set bit is found.
+template<int op, bool exists>
+static set_count mask_set_op_count(
+    const mask_set& lhs, 
+    const mask_set& rhs)
+{
+    set_count out;
+    
+    int lhs_i = 0;
+    int rhs_i = 0;
+    
+    while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
+    {
+        if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
+        {
+            if (set_op<op>(true, false))
+            {
+                out += mask_count<exists>(lhs.masks.slice(lhs.anims_submasks(lhs_i)));
+                lhs_i++;
+            }
+            else
+            {
+                lhs_i = anims_gallop(lhs.anims, lhs_i, rhs.anims(rhs_i));
+            }
+        }
+        else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
+        {
+            if (set_op<op>(false, true))
+            {
+                out += mask_count<exists>(rhs.masks.slice(rhs.anims_submasks(rhs_i)));
+                rhs_i++;
+            }
+            else
+            {
+                rhs_i = anims_gallop(rhs.anims, rhs_i, lhs.anims(lhs_i));
+            }
+        }
+        else
+        {
+            out += mask_op_count<op, exists>(
+                lhs.masks.slice(lhs.anims_submasks(lhs_i)),
+                rhs.masks.slice(rhs.anims_submasks(rhs_i)));
+            
+            lhs_i++; rhs_i++;
+        }
+        
+        if (exists && out.anims > 0) { return out; }
+    }
+    
+    for (; set_op<op>(true, false) && lhs_i < lhs.anims.size; lhs_i++)
+    {
+        out += mask_count<exists>(lhs.masks.slice(lhs.anims_submasks(lhs_i)));
+        if (exists && out.anims > 0) { return out; }
+    }
+    
+    for (; set_op<op>(false, true) && rhs_i < rhs.anims.size; rhs_i++)
+    {
+        out += mask_count<exists>(rhs.masks.slice(rhs.anims_submasks(rhs_i)));
+        if (exists && out.anims > 0) { return out; }
+    }
+    
+    return out;
+}
+
+set_count mask_set_union_count(const mask_set& lhs, const mask_set& rhs)
+{
+    return mask_set_op_count<SET_OP_UNION, false>(lhs, rhs);
+}
+
+set_count mask_set_intersection_count(const mask_set& lhs, const mask_set& rhs)
+{
+    return mask_set_op_count<SET_OP_INTERSECTION, false>(lhs, rhs);
+}
+
+set_count mask_set_difference_count(const mask_set& lhs, const mask_set& rhs)
+{
+    return mask_set_op_count<SET_OP_DIFFERENCE, false>(lhs, rhs);
+}
+
+bool mask_set_union_exists(const mask_set& lhs, const mask_set& rhs)
+{
+    return mask_set_op_count<SET_OP_UNION, true>(lhs, rhs).anims > 0;
+}
+
+bool mask_set_intersection_exists(const mask_set& lhs, const mask_set& rhs)
+{
+    return mask_set_op_count<SET_OP_INTERSECTION, true>(lhs, rhs).anims > 0;
+}
+
+bool mask_set_difference_exists(const mask_set& lhs, const mask_set& rhs)
+{
+    return mask_set_op_count<SET_OP_DIFFERENCE, true>(lhs, rhs).anims > 0;
+}
+
+// Performs a set operation over anims in parallel. The 
+// size of each output mask is known from the inputs so 
+// the offsets of each mask are found up front and then 
+// the masks are filled in. Masks start on 64-bit 
+// boundaries, so no two threads write to the same byte.
+template<int op>
+static void mask_set_op_parallel(
+    mask_set& out, 
+    const mask_set& lhs, 
+    const mask_set& rhs,
+    thread_pool& pool)
+{
+    array1d<set_op_anim> anims(lhs.anims.size + rhs.anims.size);
+    int nanims = set_op_anims<op>(anims, lhs.anims, rhs.anims);
+    
+    out.anims.resize(nanims);
+    out.anims_submasks.resize(nanims);
+    
+    int masks_i = 0;
+    for (int i = 0; i < nanims; i++)
+    {
+        int nmasks = anims(i).lhs_i >= 0 ? 
+            lhs.anims_submasks(anims(i).lhs_i).stop - lhs.anims_submasks(anims(i).lhs_i).start :
+            rhs.anims_submasks(anims(i).rhs_i).stop - rhs.anims_submasks(anims(i).rhs_i).start;
+        
+        out.anims(i) = anims(i).anim;
+        out.anims_submasks(i) = { masks_i, masks_i + nmasks };
+        masks_i = mask_set_align(masks_i + nmasks);
+    }
+    
+    out.masks.resize(masks_i);
+    
+    parallel_for(pool, nanims, SET_OP_PARALLEL_GRAIN, [&](int start, int stop)
+    {
+        for (int i = start; i < stop; i++)
+        {
+            slice1d_bit out_masks = out.masks.slice(out.anims_submasks(i));
+            
+            if (anims(i).lhs_i < 0)
+            {
+                out_masks = rhs.masks.slice(rhs.anims_submasks(anims(i).rhs_i));
+            }
+            else if (anims(i).rhs_i < 0)
+            {
+                out_masks = lhs.masks.slice(lhs.anims_submasks(anims(i).lhs_i));
+            }
+            else
+            {
+                mask_op_slices<op>(
+                    out_masks,
+                    lhs.masks.slice(lhs.anims_submasks(anims(i).lhs_i)),
+                    rhs.masks.slice(rhs.anims_submasks(anims(i).rhs_i)));
+            }
+        }
+    });
+}
+
+void mask_set_union(
+    mask_set& out, 
+    const mask_set& lhs, 
+    const mask_set& rhs,
+    thread_pool& pool)
+{
+    if (pool.threads.empty())
+    {
+        mask_set_union(out, lhs, rhs);
+    }
+    else
+    {
+        mask_set_op_parallel<SET_OP_UNION>(out, lhs, rhs, pool);
+    }
+}
+
+void mask_set_intersection(
+    mask_set& out, 
+    const mask_set& lhs, 
+    const mask_set& rhs,
+    thread_pool& pool)
+{
+    if (pool.threads.empty())
+    {
+        mask_set_intersection(out, lhs, rhs);
+    }
+    else
+    {
+        mask_set_op_parallel<SET_OP_INTERSECTION>(out, lhs, rhs, pool);
+    }
+}
+
+void mask_set_difference(
+    mask_set& out, 
+    const mask_set& lhs, 
+    const mask_set& rhs,
+    thread_pool& pool)
+{
+    if (pool.threads.empty())
+    {
+        mask_set_difference(out, lhs, rhs);
+    }
+    else
+    {
+        mask_set_op_parallel<SET_OP_DIFFERENCE>(out, lhs, rhs, pool);
+    }
+}
+
+
+//--------------------------------------
+
+// Query operations encoded by negative numbers
+enum
+{
+    QUERY_OP_UNION        = -1,
+    QUERY_OP_INTERSECTION = -2,
+    QUERY_OP_DIFFERENCE   = -3
+};
+
+static inline uint64_t query_stack_hash_mix(uint64_t h, uint64_t w)
+{
+    h ^= w * 0x9E3779B97F4A7C15ull;
+    h = (h << 31) | (h >> 33);
+    return h * 0xBF58476D1CE4E5B9ull;
+}
+
+// Hash function for query stacks, or any part of one.
+// Two ints at a time are mixed in as a 64-bit word using 
+// a multiply and rotate, and the result is finished with 
+// the murmur3 finalizer so every input bit affects every 
+// output bit.
+static inline size_t query_stack_hash(const slice1d<int> stack)
+{
+    uint64_t h = 0x7A99ED ^ (uint64_t)stack.size;
+    
+    int i = 0;
+    for (; i + 2 <= stack.size; i += 2)
+    {
+        uint64_t w;
+        memcpy(&w, stack.data + i, sizeof(uint64_t));
+        h = query_stack_hash_mix(h, w);
+    }
+    
+    if (i < stack.size)
+    {
+        h = query_stack_hash_mix(h, (uint32_t)stack.data[i]);
+    }
+    
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    
+    return (size_t)h;
+}
+
+// Query expr object consists of a stack of set 
+// indices and logical operations
+struct query_expr
+{
+    // Construct empty expression
+    query_expr() { hash = query_stack_hash(stack); }
+    
+    // Construct from a single set index
+    query_expr(int set) : stack(1) { stack(0) = set; hash = query_stack_hash(stack); }
+    
+    // Construct from an existing stack
+    query_expr(const slice1d<int> _stack) : stack(_stack) { hash = query_stack_hash(stack); }
+    
+    // Construct from two other range set queries and an op
+    query_expr(
+        const query_expr& lhs,
+        const query_expr& rhs,
+        int op)
+        : stack(lhs.stack.size + rhs.stack.size + 1)
+    {
+        // Assert op is negative
+        assert(op < 0);
+        
+        // Copy rhs and lhs into stack
+        stack.slice(0, rhs.stack.size) = rhs.stack;
+        stack.slice(rhs.stack.size, rhs.stack.size + lhs.stack.size) = lhs.stack;
+        
+        // Put op on top
+        stack(stack.size - 1) = op;
+        
+        hash = query_stack_hash(stack);
+    }
+    
+    // Inplace array used to store stack - can store
+    // up to 16 elements without using heap allocation
+    inplace_array1d<int, 16> stack;
+    
+    // Hash of the stack computed on construction so
+    // that cache lookups don't need to compute it
+    size_t hash;
+};
+
+query_expr operator|(const query_expr& lhs, const query_expr& rhs)
+{
+    return query_expr(lhs, rhs, QUERY_OP_UNION);
+}
+
+query_expr operator&(const query_expr& lhs, const query_expr& rhs)
+{
+    return query_expr(lhs, rhs, QUERY_OP_INTERSECTION);
+}
+
+query_expr operator-(const query_expr& lhs, const query_expr& rhs)
+{
+    return query_expr(lhs, rhs, QUERY_OP_DIFFERENCE);
+}
+
+//--------------------------------------
+
+// Hash function for queries, or for any part
+// of the stack of a query
+struct query_expr_hash
+{
+    size_t operator()(const slice1d<int> stack) const
+    {
+        return query_stack_hash(stack);
+    }
+    
+    size_t operator()(const query_expr& x) const
+    {
+        return x.hash;
+    }
+};
+
+// Comparison function for queries, or for any 
+// part of the stack of a query
+struct query_expr_cmp
+{
+    bool operator()(const slice1d<int> lhs, const slice1d<int> rhs) const
+    {   
+        if (lhs.size == rhs.size)
+        {
+            return memcmp(
+                lhs.data, 
+                rhs.data, 
+                sizeof(int) * lhs.size) == 0;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    
+    bool operator()(const query_expr& lhs, const query_expr& rhs) const
+    {
+        return operator()(lhs.stack, rhs.stack);
+    }
+};
+
+// Hashtable to cache set evaluations. Entries are 
+// stored by the hash of their query so that the result 
+// of a sub-expression can be looked up directly from 
+// a slice of a larger query's stack.
+//
+// The total memory used by cached results is kept under
+// `budget` bytes by evicting entries using the GreedyDual
+// -Size scheme: each entry has a priority of the time its 
+// top op took per byte plus an `inflation` value which 
+// rises to the priority of each entry evicted. The time 
+// of its sub-expressions is not included as they are 
+// cached as entries of their own. The lowest priority 
+// entry is evicted first, so entries which are cheap to 
+// recompute for their size go first, and entries which 
+// have not been used for a while age out like in an LRU.
+template<typename T>
+struct query_expr_cache
+{
+    struct entry
+    {
+        query_expr query;
+        T result;
+        size_t hash;
+        size_t bytes;
+        double cost;
+        typename std::multimap<double, entry*>::iterator priority;
+    };
+    
+    query_expr_cache(size_t _budget = 64 * 1024 * 1024) : budget(_budget) {}
+    
+    std::unordered_multimap<size_t, entry> entries;
+    std::multimap<double, entry*> priorities;
+    double inflation = 0.0;
+    
+    // Entries whose query uses each set
+    std::unordered_map<int, std::vector<entry*>> dependents;
+    
+    // Scratch sets used when updating entries, and the
+    // indices of the sets used by the entries updated
+    std::vector<T> selected;
+    std::vector<int> selected_sets;
+    T patch;
+    T spliced;
+    
+    size_t budget;
+    size_t bytes = 0;
+    
+    int hits = 0;
+    int misses = 0;
+    int evictions = 0;
+    int updates = 0;
+    
+    // Memory used by an entry, including its stack
+    // if too large to be stored inline
+    static size_t entry_bytes(const slice1d<int> stack, const T& result)
+    {
+        return sizeof(entry) + memory_usage(result) + 
+            (stack.size > 16 ? sizeof(int) * stack.size : 0);
+    }
+    
+    // Calls `func` once for each distinct set used by an entry
+    template<typename F>
+    static void entry_sets(const entry& e, const F& func)
+    {
+        const slice1d<int> stack = e.query.stack;
+        
+        for (int i = 0; i < stack.size; i++)
+        {
+            if (stack(i) >= 0 && std::find(stack.data, stack.data + i, stack(i)) == stack.data + i)
+            {
+                func(stack(i));
+            }
+        }
+    }
+    
+    // Returns cached result or NULL if not found
+    const T* find(const slice1d<int> stack)
+    {
+        return find(stack, query_stack_hash(stack));
+    }
+    
+    const T* find(const slice1d<int> stack, size_t hash)
+    {
+        auto matches = entries.equal_range(hash);
+        
+        for (auto it = matches.first; it != matches.second; ++it)
+        {
+            if (query_expr_cmp()(it->second.query.stack, stack))
+            {
+                // Refresh priority since entry was used
+                entry& e = it->second;
+                priorities.erase(e.priority);
+                e.priority = priorities.emplace(inflation + e.cost / e.bytes, &e);
+                
+                hits++;
+                return &e.result;
+            }
+        }
+        
+        misses++;
+        return NULL;
+    }
+    
+    // Adds a result which took `cost` seconds to evaluate
+    void insert(const slice1d<int> stack, const T& result, double cost)
+    {
+        insert(stack, query_stack_hash(stack), result, cost);
+    }
+    
+    void insert(const slice1d<int> stack, size_t hash, const T& result, double cost)
+    {
+        size_t new_bytes = entry_bytes(stack, result);
+        
+        // Don't cache results which can never fit
+        if (new_bytes > budget) { return; }
+        
+        while (bytes + new_bytes > budget)
+        {
+            evict();
+        }
+        
+        auto it = entries.emplace(hash, entry{ query_expr(stack), result, hash, new_bytes, cost, priorities.end() });
+        
+        entry& e = it->second;
+        e.priority = priorities.emplace(inflation + e.cost / e.bytes, &e);
+        entry_sets(e, [&](int set) { dependents[set].push_back(&e); });
+        
+        bytes += new_bytes;
+    }
+    
+    // Removes entry with lowest priority
+    void evict()
+    {
+        auto lowest = priorities.begin();
+        inflation = lowest->first;
+        remove(lowest->second);
+        evictions++;
+    }
+    
+    // Removes all entries for queries which use the
+    // set with the given index, for use when that set
+    // has been modified
+    void invalidate(int set)
+    {
+        auto it = dependents.find(set);
+        if (it == dependents.end()) { return; }
+        
+        std::vector<entry*> removed = it->second;
+        for (entry* e : removed)
+        {
+            remove(e);
+        }
+    }
+    
+    void clear()
+    {
+        entries.clear();
+        priorities.clear();
+        dependents.clear();
+        bytes = 0;
+        inflation = 0.0;
+    }
+    
+    // Removes an entry, finding it using the hash 
+    // stored with it rather than rehashing its query
+    void remove(entry* e)
+    {
+        auto matches = entries.equal_range(e->hash);
+        
+        for (auto it = matches.first; it != matches.second; ++it)
+        {
+            if (&it->second == e)
+            {
+                entry_sets(*e, [&](int set) 
+                {
+                    std::vector<entry*>& users = dependents[set];
+                    *std::find(users.begin(), users.end(), e) = users.back();
+                    users.pop_back();
+                });
+                
+                priorities.erase(e->priority);
+                bytes -= e->bytes;
+                entries.erase(it);
+                return;
+            }
+        }
+        
+        assert(false);
+    }
+};
+
+// Hashtable to cache range set evaluations
+using query_expr_range_set_cache = query_expr_cache<range_set>;
+
+// Hashtable to cache mask set evaluations
+using query_expr_mask_set_cache = query_expr_cache<mask_set>;
+
+// Finds the start of the sub-expression on the stack
+// which has its top at `index`
+int query_expr_start(const query_expr& query, int index)
+{
+    // Number of set indices still needed to complete the
+    // sub-expression. Each operation needs one more.
+    int needed = 1;
+    
+    while (needed > 0)
+    {
+        needed += query.stack(index) < 0 ? 1 : -1;
+        index--;
+    }
+    
+    return index + 1;
+}
+
+//--------------------------------------
+
+// Queries can be rewritten before evaluation into an
+// equivalent form which is cheaper to evaluate, and
+// which is the same for all queries that only differ
+// in the order or grouping of their operands so that
+// they share a single entry in the query caches. To do
+// this the stack is first turned into a tree.
+
+// Node of a query tree. Unions and intersections can
+// have any number of operands, while differences store
+// the set subtracted from first followed by all of the
+// sets subtracted from it.
+struct query_node
+{
+    int op;                             // Query op, or set index if leaf
+    std::vector<query_node> children;   // Operands in order of evaluation
+    std::vector<int> stack;             // Stack of node once emitted
+    int cost;                           // Estimated number of ranges in result
+};
+
+static void query_node_build(
+    query_node& node,
+    int& index,
+    const query_expr& query)
+{
+    node.op = query.stack(index);
+    node.children.clear();
+    index--;
+    
+    if (node.op < 0)
+    {
+        node.children.resize(2);
+        query_node_build(node.children[0], index, query);
+        query_node_build(node.children[1], index, query);
+    }
+}
+
+// Emits the stack of a node from the stacks of its
+// children. Operands are combined left-deep so that
+// they are evaluated in the order they are stored.
+static void query_node_emit(
+    query_node& node,
+    const std::vector<range_set>& range_sets)
+{
+    if (node.op >= 0)
+    {
+        node.stack.assign(1, node.op);
+        node.cost = node.op < (int)range_sets.size() ? range_sets[node.op].ranges.size : 0;
+        return;
+    }
+    
+    node.stack = node.children[0].stack;
+    node.cost = node.children[0].cost;
+    
+    for (int i = 1; i < (int)node.children.size(); i++)
+    {
+        const query_node& child = node.children[i];
+        
+        std::vector<int> stack = child.stack;
+        stack.insert(stack.end(), node.stack.begin(), node.stack.end());
+        stack.push_back(node.op);
+        node.stack.swap(stack);
+        
+        switch (node.op)
+        {
+            case QUERY_OP_UNION: node.cost += child.cost; break;
+            case QUERY_OP_INTERSECTION: node.cost = std::min(node.cost, child.cost); break;
+            case QUERY_OP_DIFFERENCE: break;
+            default: assert(false);
+        }
+    }
+}
+
+// Operands of `node` if it has the given op, otherwise
+// just the node itself
+static inline slice1d<const query_node> query_node_operands(
+    const query_node& node,
+    int op)
+{
+    return node.op == op ?
+        slice1d<const query_node>(node.children.size(), node.children.data()) :
+        slice1d<const query_node>(1, &node);
+}
+
+static inline bool query_node_contains(
+    const slice1d<const query_node> nodes,
+    const query_node& node)
+{
+    for (int i = 0; i < nodes.size; i++)
+    {
+        if (nodes(i).stack == node.stack) { return true; }
+    }
+    
+    return false;
+}
+
+static void query_node_optimize(
+    query_node& node,
+    const std::vector<range_set>& range_sets)
+{
+    if (node.op >= 0)
+    {
+        query_node_emit(node, range_sets);
+        return;
+    }
+    
+    for (query_node& child : node.children)
+    {
+        query_node_optimize(child, range_sets);
+    }
+    
+    // Flatten chains of the same op into a single node
+    
+    std::vector<query_node> children;
+    
+    for (int i = 0; i < (int)node.children.size(); i++)
+    {
+        query_node& child = node.children[i];
+        
+        // For differences (A - B) - C and A - (B | C)
+        // both become A - B - C
+        int flatten = node.op != QUERY_OP_DIFFERENCE ? node.op :
+            i == 0 ? QUERY_OP_DIFFERENCE : QUERY_OP_UNION;
+        
+        if (child.op == flatten)
+        {
+            for (query_node& grandchild : child.children)
+            {
+                children.push_back(std::move(grandchild));
+            }
+        }
+        else
+        {
+            children.push_back(std::move(child));
+        }
+    }
+    
+    node.children = std::move(children);
+    
+    // Remove children absorbed by another child, such as 
+    // A & B in A | (A & B) | C, or A | B in A & (A | B) & C.
+    // Then factor out the operand shared by the most children
+    // so that (A & B) | (A & C) | D becomes (A & (B | C)) | D,
+    // and likewise (A | B) & (A | C) becomes A | (B & C).
+    
+    if (node.op != QUERY_OP_DIFFERENCE)
+    {
+        int dual = node.op == QUERY_OP_UNION ?
+            QUERY_OP_INTERSECTION : QUERY_OP_UNION;
+        
+        for (int i = 0; i < (int)node.children.size(); i++)
+        {
+            for (int j = (int)node.children.size() - 1; j >= 0; j--)
+            {
+                if (i == j) { continue; }
+                
+                slice1d<const query_node> absorber = query_node_operands(node.children[i], dual);
+                slice1d<const query_node> operands = query_node_operands(node.children[j], dual);
+                
+                bool absorbed = true;
+                for (int k = 0; absorbed && k < absorber.size; k++)
+                {
+                    absorbed = query_node_contains(operands, absorber(k));
+                }
+                
+                if (absorbed)
+                {
+                    node.children.erase(node.children.begin() + j);
+                    if (j < i) { i--; }
+                }
+            }
+        }
+        
+        // Find operand in the most children, breaking ties
+        // by the stack so the choice does not depend on the 
+        // order of the children
+        
+        const query_node* factor = NULL;
+        int factor_count = 1;
+        
+        for (const query_node& child : node.children)
+        {
+            slice1d<const query_node> operands = query_node_operands(child, dual);
+            
+            for (int i = 0; i < operands.size; i++)
+            {
+                int count = 0;
+                for (const query_node& other : node.children)
+                {
+                    count += query_node_contains(query_node_operands(other, dual), operands(i));
+                }
+                
+                if (count > factor_count || (count == factor_count && 
+                    factor != NULL && operands(i).stack < factor->stack))
+                {
+                    factor = &operands(i);
+                    factor_count = count;
+                }
+            }
+        }
+        
+        if (factor != NULL)
+        {
+            // No child is absorbed by another, so every child
+            // containing the factor has other operands too
+            query_node factored;
+            factored.op = dual;
+            factored.children.push_back(*factor);
+            
+            query_node remainder;
+            remainder.op = node.op;
+            
+            std::vector<query_node> children;
+            
+            for (const query_node& child : node.children)
+            {
+                slice1d<const query_node> operands = query_node_operands(child, dual);
+                
+                if (!query_node_contains(operands, factored.children[0]))
+                {
+                    children.push_back(child);
+                    continue;
+                }
+                
+                query_node rest;
+                rest.op = dual;
+                
+                for (int i = 0; i < operands.size; i++)
+                {
+                    if (operands(i).stack != factored.children[0].stack)
+                    {
+                        rest.children.push_back(operands(i));
+                    }
+                }
+                
+                assert(rest.children.size() > 0);
+                
+                if (rest.children.size() == 1)
+                {
+                    remainder.children.push_back(std::move(rest.children[0]));
+                }
+                else
+                {
+                    remainder.children.push_back(std::move(rest));
+                }
+            }
+            
+            factored.children.push_back(std::move(remainder));
+            children.push_back(std::move(factored));
+            
+            // Factoring always removes operands so this
+            // will eventually stop
+            node.children = std::move(children);
+            query_node_optimize(node, range_sets);
+            return;
+        }
+    }
+    
+    // Sort operands into a canonical order and remove any
+    // duplicates. Intersections are ordered by cost so the
+    // smallest set is evaluated first, keeping intermediate
+    // results small and making it most likely evaluation
+    // stops early on an empty result. The sets subtracted
+    // in a difference go largest first for the same reason.
+    // Ties are broken by comparing stacks.
+    
+    auto begin = node.children.begin();
+    auto end = node.children.end();
+    
+    auto stack_less = [](const query_node& lhs, const query_node& rhs)
+    {
+        return lhs.stack < rhs.stack;
+    };
+    
+    auto cost_less = [](const query_node& lhs, const query_node& rhs)
+    {
+        return lhs.cost != rhs.cost ? lhs.cost < rhs.cost : lhs.stack < rhs.stack;
+    };
+    
+    auto cost_greater = [](const query_node& lhs, const query_node& rhs)
+    {
+        return lhs.cost != rhs.cost ? lhs.cost > rhs.cost : lhs.stack < rhs.stack;
+    };
+    
+    switch (node.op)
+    {
+        case QUERY_OP_UNION: std::sort(begin, end, stack_less); break;
+        case QUERY_OP_INTERSECTION: std::sort(begin, end, cost_less); break;
+        case QUERY_OP_DIFFERENCE: begin++; std::sort(begin, end, cost_greater); break;
+        default: assert(false);
+    }
+    
+    node.children.erase(std::unique(begin, end,
+        [](const query_node& lhs, const query_node& rhs) { return lhs.stack == rhs.stack; }),
+        end);
+    
+    if (node.children.size() == 1)
+    {
+        query_node child = std::move(node.children[0]);
+        node = std::move(child);
+        return;
+    }
+    
+    query_node_emit(node, range_sets);
+}
+
+// Rewrites a query into an equivalent optimized and
+// canonical query, using the number of ranges in each
+// of `range_sets` to estimate the cost of each operand.
+// The result can be evaluated with any of the query
+// evaluation functions on range sets or mask sets.
+void query_expr_optimize(
+    query_expr& out,
+    const query_expr& query,
+    const std::vector<range_set>& range_sets)
+{
+    if (query.stack.size == 0)
+    {
+        out = query_expr();
+        return;
+    }
+    
+    query_node root;
+    int index = query.stack.size - 1;
+    query_node_build(root, index, query);
+    assert(index == -1);
+    
+    query_node_optimize(root, range_sets);
+    
+    out = query_expr(slice1d<int>(root.stack.size(), root.stack.data()));
+}
+
+//--------------------------------------
+
+// Scratch space for evaluating queries. Holds temporary 
+// sets for the expression which are kept between 
+// evaluations, so once a query has been evaluated, 
+// evaluating it or any smaller query again needs no 
+// heap allocations.
+struct query_expr_scratch
+{
+    std::vector<range_set> range_sets;
+    std::vector<const range_set*> range_operands;
+    std::vector<mask_set> mask_sets;
+};
+
+const range_set& query_expr_evaluate_range_set_from(
+    range_set& out,
+    int& index,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch,
+    int top);
+
+// Evaluates the operands of a chain of the same op such
+// as A | B | C | D, however it is grouped, pushing them
+// onto `scratch.range_operands` after `base` in order of 
+// evaluation. For a difference only the lhs is part of 
+// the chain, so (A - B) - C gives A, B, C. The result of 
+// each operand goes into the scratch set at the index of 
+// its top in the stack, which no other operand can use. 
+// Returns false if the result of the chain is known to 
+// be empty without evaluating the rest of it.
+static bool query_expr_evaluate_range_set_operands(
+    const int base,
+    int& top,
+    int& index,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch)
+{
+    int op = query.stack(index);
+    index--;
+    
+    for (int side = 0; side < 2; side++)
+    {
+        if (query.stack(index) == op && (op != QUERY_OP_DIFFERENCE || side == 0))
+        {
+            if (!query_expr_evaluate_range_set_operands(
+                base, top, index, query, range_sets, scratch))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            int operand_top = index;
+            const range_set& operand = query_expr_evaluate_range_set_from(
+                scratch.range_sets[operand_top], index, query, range_sets, scratch, top);
+            
+            scratch.range_operands[top++] = &operand;
+            
+            // An empty operand of an intersection, or an empty first
+            // operand of a difference, empties the whole chain
+            if (operand.anims.size == 0 && (op == QUERY_OP_INTERSECTION || 
+                (op == QUERY_OP_DIFFERENCE && top == base + 1)))
+            {
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
+// Recursively evaluate range set query by
+// walking down the stack from top to bottom 
+// and performing the operations encoded by them.
+// Operations write their result into `out` while
+// set indices just refer to the set, so the 
+// returned reference should be used as the result.
+// Chains of the same op are evaluated in one go 
+// using the n-ary range set operations, with their 
+// operands stored in `scratch.range_operands` from 
+// `top` onward.
+const range_set& query_expr_evaluate_range_set_from(
+    range_set& out,
+    int& index,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch,
+    int top)
+{   
+    int op = query.stack(index);
+    
+    if (op >= 0)
+    {
+        index--;
+        return range_sets[op];
+    }
+    
+    int start = query_expr_start(query, index);
+    int operands_num = top;
+    
+    if (!query_expr_evaluate_range_set_operands(
+        top, operands_num, index, query, range_sets, scratch))
+    {
+        index = start - 1;
+        range_set_clear(out);
+        return out;
+    }
+    
+    slice1d<const range_set*> operands(
+        operands_num - top, scratch.range_operands.data() + top);
+    
+    switch (op)
+    {
+        case QUERY_OP_UNION: range_set_union(out, operands); break;
+        case QUERY_OP_INTERSECTION: range_set_intersection(out, operands); break;
+        case QUERY_OP_DIFFERENCE: range_set_difference(out, operands); break;
+        default: assert(false);
+    }
+    
+    return out;
+}
+
+void query_expr_evaluate_range_set(
+    range_set& out,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch)
+{ 
+    // If empty query, return empty range set
+    if (query.stack.size == 0)
+    {
+        out = range_set();
+    }
+    else
+    {
+        // Make sure there is a scratch set and operand 
+        // for every element of the stack
+        if ((int)scratch.range_sets.size() < query.stack.size)
+        {
+            scratch.range_sets.resize(query.stack.size);
+        }
+        
+        if ((int)scratch.range_operands.size() < query.stack.size)
+        {
+            scratch.range_operands.resize(query.stack.size);
+        }
+        
+        // Start at top of stack and evaluate
+        int index = query.stack.size - 1;
+        const range_set& result = query_expr_evaluate_range_set_from(
+            out, index, query, range_sets, scratch, 0);
+        
+        // Copy result if query was a single set
+        if (&result != &out)
+        {
+            out = result;
+        }
+        
+        // Assert we've consumed all of the stack
+        assert(index == -1);
+    }
+}
+
+void query_expr_evaluate_range_set(
+    range_set& out,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets)
+{
+    query_expr_scratch scratch;
+    query_expr_evaluate_range_set(out, query, range_sets, scratch);
+}
+
+// Counts the result of the query from `index` on range 
+// sets without building it. The operands of the top 
+// chain of ops are evaluated as usual and then counted 
+// in one n-ary merge rather than merged into a set. When 
+// `exists` is set, a union holds frames if either side 
+// does, so each side is checked on its own without being 
+// built and the other side is skipped once one has any 
+// frames. Otherwise the count stops at the first anim 
+// of the top chain with output. `buffer` is only used to
+// count anims found in more than two operands.
+template<bool exists>
+static set_count query_expr_count_range_set_from(
+    int& index,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch,
+    array1d<range>& buffer,
+    int top)
+{
+    int op = query.stack(index);
+    
+    if (op >= 0)
+    {
+        index--;
+        return range_set_count(range_sets[op]);
+    }
+    
+    int start = query_expr_start(query, index);
+    
+    if (exists && op == QUERY_OP_UNION)
+    {
+        index--;
+        
+        set_count lhs = query_expr_count_range_set_from<true>(
+            index, query, range_sets, scratch, buffer, top);
+        
+        if (lhs.anims > 0)
+        {
+            index = start - 1;
+            return lhs;
+        }
+        
+        return query_expr_count_range_set_from<true>(
+            index, query, range_sets, scratch, buffer, top);
+    }
+    
+    int operands_num = top;
+    
+    if (!query_expr_evaluate_range_set_operands(
+        top, operands_num, index, query, range_sets, scratch))
+    {
+        index = start - 1;
+        return set_count();
+    }
+    
+    slice1d<const range_set*> operands(
+        operands_num - top, scratch.range_operands.data() + top);
+    
+    switch (op)
+    {
+        case QUERY_OP_UNION: return range_set_merge_n_count<SET_OP_UNION, exists>(operands, buffer);
+        case QUERY_OP_INTERSECTION: return range_set_merge_n_count<SET_OP_INTERSECTION, exists>(operands, buffer);
+        case QUERY_OP_DIFFERENCE: return range_set_merge_n_count<SET_OP_DIFFERENCE, exists>(operands, buffer);
+        default: assert(false); return set_count();
+    }
+}
+
+template<bool exists>
+static set_count query_expr_count_range_set(
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch)
+{
+    if (query.stack.size == 0)
+    {
+        return set_count();
+    }
+    
+    if ((int)scratch.range_sets.size() < query.stack.size)
+    {
+        scratch.range_sets.resize(query.stack.size);
+    }
+    
+    if ((int)scratch.range_operands.size() < query.stack.size)
+    {
+        scratch.range_operands.resize(query.stack.size);
+    }
+    
+    // The scratch set of the top of the stack is never 
+    // used by an operand, so its ranges serve as the buffer
+    int index = query.stack.size - 1;
+    set_count out = query_expr_count_range_set_from<exists>(
+        index, query, range_sets, scratch, 
+        scratch.range_sets[query.stack.size - 1].ranges, 0);
+    
+    assert(index == -1);
+    
+    return out;
+}
+
+// Number of anims, ranges and frames matching a query
+set_count query_expr_count_range_set(
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch)
+{
+    return query_expr_count_range_set<false>(query, range_sets, scratch);
+}
+
+// If any frames match a query
+bool query_expr_exists_range_set(
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch)
+{
+    return query_expr_count_range_set<true>(query, range_sets, scratch).anims > 0;
+}
+
+// Finds the top in the stack of each operand of a chain 
+// of the same op, in the same order as they are evaluated 
+// by `query_expr_evaluate_range_set_operands`
+static void query_expr_chain_tops(
+    slice1d<int> tops,
+    int& tops_num,
+    int& index,
+    const query_expr& query)
+{
+    int op = query.stack(index);
+    index--;
+    
+    for (int side = 0; side < 2; side++)
+    {
+        if (query.stack(index) == op && (op != QUERY_OP_DIFFERENCE || side == 0))
+        {
+            query_expr_chain_tops(tops, tops_num, index, query);
+        }
+        else
+        {
+            tops(tops_num++) = index;
+            index = query_expr_start(query, index) - 1;
+        }
+    }
+}
+
+// Sub-expressions estimated to touch fewer ranges than 
+// this by default are evaluated inline rather than on 
+// the pool
+enum { QUERY_EXPR_PARALLEL_COST = 16384 };
+
+// Same as above but evaluates the operands of each chain 
+// concurrently on `pool`, for sub-expressions with a cost 
+// of at least `threshold`. Each operand writes its result 
+// to the scratch set at the index of its top in the stack. 
+// Operands below the cost threshold are evaluated with the 
+// serial evaluator, using operand slots starting from the 
+// bottom of their own part of the stack, so no two tasks 
+// share any scratch space. Chains are evaluated with the 
+// same n-ary operations as the serial evaluator, so the
+// result is identical.
+const range_set& query_expr_evaluate_range_set_from(
+    range_set& out,
+    const int index,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch,
+    thread_pool& pool,
+    int threshold)
+{
+    int op = query.stack(index);
+    
+    if (op >= 0)
+    {
+        return range_sets[op];
+    }
+    
+    int start = query_expr_start(query, index);
+    
+    // Estimate cost from the number of ranges in the sets used
+    int cost = 0;
+    for (int i = start; i <= index; i++)
+    {
+        cost += query.stack(i) >= 0 ? range_sets[query.stack(i)].ranges.size : 0;
+    }
+    
+    if (cost < threshold)
+    {
+        int serial_index = index;
+        return query_expr_evaluate_range_set_from(
+            out, serial_index, query, range_sets, scratch, start);
+    }
+    
+    inplace_array1d<int, 16> tops(index - start + 1);
+    int tops_num = 0;
+    int chain_index = index;
+    query_expr_chain_tops(tops, tops_num, chain_index, query);
+    
+    inplace_array1d<const range_set*, 16> operands(tops_num);
+    
+    parallel_for(pool, tops_num, 1, [&](int operands_start, int operands_stop)
+    {
+        for (int i = operands_start; i < operands_stop; i++)
+        {
+            operands(i) = &query_expr_evaluate_range_set_from(
+                scratch.range_sets[tops(i)], tops(i), query, range_sets, scratch, pool, threshold);
+        }
+    });
+    
+    switch (op)
+    {
+        case QUERY_OP_UNION: range_set_union(out, operands); break;
+        case QUERY_OP_INTERSECTION: range_set_intersection(out, operands); break;
+        case QUERY_OP_DIFFERENCE: range_set_difference(out, operands); break;
+        default: assert(false);
+    }
+    
+    return out;
+}
+
+void query_expr_evaluate_range_set(
+    range_set& out,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch,
+    thread_pool& pool,
+    int threshold = QUERY_EXPR_PARALLEL_COST)
+{ 
+    if (query.stack.size == 0)
+    {
+        out = range_set();
+    }
+    else
+    {
+        if ((int)scratch.range_sets.size() < query.stack.size)
+        {
+            scratch.range_sets.resize(query.stack.size);
+        }
+        
+        if ((int)scratch.range_operands.size() < query.stack.size)
+        {
+            scratch.range_operands.resize(query.stack.size);
+        }
+        
+        const range_set& result = query_expr_evaluate_range_set_from(
+            out, query.stack.size - 1, query, range_sets, scratch, pool, threshold);
+        
+        if (&result != &out)
+        {
+            out = result;
+        }
+    }
+}
+
+// Same as above but looks up the result of every 
+// operation in `cache` before evaluating it, and 
+// adds it to `cache` if it was not found.
+void query_expr_evaluate_range_set_from(
+    range_set& out,
+    int& index,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_range_set_cache& cache)
+{
+    int op = query.stack(index);
+    
+    if (op >= 0)
+    {
+        out = range_sets[op];
+        index--;
+        return;
+    }
+    
+    slice1d<int> sub = query.stack.slice(query_expr_start(query, index), index + 1);
+    
+    // Whole query has its hash precomputed
+    size_t hash = sub.size == query.stack.size ? query.hash : query_stack_hash(sub);
+    
+    const range_set* cached = cache.find(sub, hash);
+    if (cached)
+    {
+        out = *cached;
+        index -= sub.size;
+        return;
+    }
+    
+    range_set lhs, rhs;
+    
+    index--;
+    query_expr_evaluate_range_set_from(lhs, index, query, range_sets, cache);
+    
+    if (lhs.anims.size == 0 && op != QUERY_OP_UNION)
+    {
+        index = query_expr_start(query, index) - 1;
+        range_set_clear(out);
+        return;
+    }
+    
+    query_expr_evaluate_range_set_from(rhs, index, query, range_sets, cache);
+    
+    // Only the op itself is timed, as the lhs and rhs 
+    // are cached as entries with costs of their own
+    auto start = std::chrono::steady_clock::now();
+    
+    switch (op)
+    {
+        case QUERY_OP_UNION: range_set_union(out, lhs, rhs); break;
+        case QUERY_OP_INTERSECTION: range_set_intersection(out, lhs, rhs); break;
+        case QUERY_OP_DIFFERENCE: range_set_difference(out, lhs, rhs); break;
+        default: assert(false);
+    }
+    
+    cache.insert(sub, hash, out, std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+void query_expr_evaluate_range_set(
+    range_set& out,
+    const query_expr& query, 
+    const std::vector<range_set>& range_sets,
+    query_expr_range_set_cache& cache)
+{ 
+    if (query.stack.size == 0)
+    {
+        out = range_set();
+    }
+    else
+    {
+        int index = query.stack.size - 1;
+        query_expr_evaluate_range_set_from(out, index, query, range_sets, cache);
+        
+        assert(index == -1);
+    }
+}
+
+//--------------------------------------
+
+// Evaluates a query on any kind of set which has the 
+// three set ops as binary functions, recursing down 
+// the lhs and rhs of each op. Each depth of the query 
+// has two sets in the scratch for its lhs and rhs.
+template<typename T>
+const T& query_expr_evaluate_set_from(
+    T& out,
+    int& index,
+    const query_expr& query, 
+    const std::vector<T>& sets,
+    std::vector<T>& scratch,
+    int depth)
+{   
+    int op = query.stack(index);
+    index--;
+    
+    if (op >= 0)
+    {
+        return sets[op];
+    }
+    
+    const T& lhs = query_expr_evaluate_set_from(
+        scratch[2 * depth + 0], index, query, sets, scratch, depth + 1);
+    
+    // Intersection with or difference from an empty set is
+    // empty, so skip over the rhs without evaluating it
+    if (lhs.anims.size == 0 && op != QUERY_OP_UNION)
+    {
+        index = query_expr_start(query, index) - 1;
+        query_expr_set_clear(out);
+        return out;
+    }
+    
+    const T& rhs = query_expr_evaluate_set_from(
+        scratch[2 * depth + 1], index, query, sets, scratch, depth + 1);
+
+    query_expr_set_op(out, op, lhs, rhs);
+    
+    return out;
+}
+
+template<typename T>
+void query_expr_evaluate_set(
+    T& out,
+    const query_expr& query, 
+    const std::vector<T>& sets,
+    std::vector<T>& scratch)
+{ 
+    if (query.stack.size == 0)
+    {
+        out = T();
+    }
+    else
+    {
+        if ((int)scratch.size() < 2 * query.stack.size)
+        {
+            scratch.resize(2 * query.stack.size);
+        }
+        
+        int index = query.stack.size - 1;
+        const T& result = query_expr_evaluate_set_from(
+            out, index, query, sets, scratch, 0);
+        
+        if (&result != &out)
+        {
+            out = result;
+        }
+        
+        assert(index == -1);
+    }
+}
+
+static inline void query_expr_set_clear(mask_set& out)
+{
+    mask_set_clear(out);
+}
+
+static inline void query_expr_set_op(
+    mask_set& out, 
+    const int op, 
+    const mask_set& lhs, 
+    const mask_set& rhs)
+{
+    switch (op)
+    {
+        case QUERY_OP_UNION: mask_set_union(out, lhs, rhs); break;
+        case QUERY_OP_INTERSECTION: mask_set_intersection(out, lhs, rhs); break;
+        case QUERY_OP_DIFFERENCE: mask_set_difference(out, lhs, rhs); break;
+        default: assert(false);
+    }
+}
+
+void query_expr_evaluate_mask_set(
+    mask_set& out,
+    const query_expr& query, 
+    const std::vector<mask_set>& mask_sets,
+    query_expr_scratch& scratch)
+{ 
+    query_expr_evaluate_set(out, query, mask_sets, scratch.mask_sets);
+}
+
+void query_expr_evaluate_mask_set(
+    mask_set& out,
+    const query_expr& query, 
+    const std::vector<mask_set>& mask_sets)
+{
+    query_expr_scratch scratch;
+    query_expr_evaluate_mask_set(out, query, mask_sets, scratch);
+}
+
+// Counts the result of a query on mask sets without 
+// building the result of the top op
+template<bool exists>
+static set_count query_expr_count_mask_set(
+    const query_expr& query, 
+    const std::vector<mask_set>& mask_sets,
+    query_expr_scratch& scratch)
+{
+    if (query.stack.size == 0)
+    {
+        return set_count();
+    }
+    
+    int op = query.stack(query.stack.size - 1);
+    
+    if (op >= 0)
+    {
+        return mask_set_count(mask_sets[op]);
+    }
+    
+    if ((int)scratch.mask_sets.size() < 2 * query.stack.size)
+    {
+        scratch.mask_sets.resize(2 * query.stack.size);
+    }
+    
+    int index = query.stack.size - 2;
+    
+    const mask_set& lhs = query_expr_evaluate_set_from(
+        scratch.mask_sets[0], index, query, mask_sets, scratch.mask_sets, 1);
+    
+    if (lhs.anims.size == 0 && op != QUERY_OP_UNION)
+    {
+        return set_count();
+    }
+    
+    const mask_set& rhs = query_expr_evaluate_set_from(
+        scratch.mask_sets[1], index, query, mask_sets, scratch.mask_sets, 1);
+    
+    assert(index == -1);
+    
+    switch (op)
+    {
+        case QUERY_OP_UNION: return mask_set_op_count<SET_OP_UNION, exists>(lhs, rhs);
+        case QUERY_OP_INTERSECTION: return mask_set_op_count<SET_OP_INTERSECTION, exists>(lhs, rhs);
+        case QUERY_OP_DIFFERENCE: return mask_set_op_count<SET_OP_DIFFERENCE, exists>(lhs, rhs);
+        default: assert(false); return set_count();
+    }
+}
+
+set_count query_expr_count_mask_set(
+    const query_expr& query, 
+    const std::vector<mask_set>& mask_sets,
+    query_expr_scratch& scratch)
+{
+    return query_expr_count_mask_set<false>(query, mask_sets, scratch);
+}
+
+bool query_expr_exists_mask_set(
+    const query_expr& query, 
+    const std::vector<mask_set>& mask_sets,
+    query_expr_scratch& scratch)
+{
+    return query_expr_count_mask_set<true>(query, mask_sets, scratch).anims > 0;
+}
+
+void query_expr_evaluate_mask_set_from(
+    mask_set& out,
+    int& index,
+    const query_expr& query, 
+    const std::vector<mask_set>& mask_sets,
+    query_expr_mask_set_cache& cache)
+{
+    int op = query.stack(index);
+    
+    if (op >= 0)
+    {
+        out = mask_sets[op];
+        index--;
+        return;
+    }
+    
+    slice1d<int> sub = query.stack.slice(query_expr_start(query, index), index + 1);
+    
+    // Whole query has its hash precomputed
+    size_t hash = sub.size == query.stack.size ? query.hash : query_stack_hash(sub);
+    
+    const mask_set* cached = cache.find(sub, hash);
+    if (cached)
+    {
+        out = *cached;
+        index -= sub.size;
+        return;
+    }
+    
+    mask_set lhs, rhs;
+    
+    index--;
+    query_expr_evaluate_mask_set_from(lhs, index, query, mask_sets, cache);
+    
+    if (lhs.anims.size == 0 && op != QUERY_OP_UNION)
+    {
+        index = query_expr_start(query, index) - 1;
+        mask_set_clear(out);
+        return;
+    }
+    
+    query_expr_evaluate_mask_set_from(rhs, index, query, mask_sets, cache);
+    
+    // Only the op itself is timed, as the lhs and rhs 
+    // are cached as entries with costs of their own
+    auto start = std::chrono::steady_clock::now();
+    
+    switch (op)
+    {
+        case QUERY_OP_UNION: mask_set_union(out, lhs, rhs); break;
+        case QUERY_OP_INTERSECTION: mask_set_intersection(out, lhs, rhs); break;
+        case QUERY_OP_DIFFERENCE: mask_set_difference(out, lhs, rhs); break;
+        default: assert(false);
+    }
+    
+    cache.insert(sub, hash, out, std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count());
+}
+
+void query_expr_evaluate_mask_set(
+    mask_set& out,
+    const query_expr& query, 
+    const std::vector<mask_set>& mask_sets,
+    query_expr_mask_set_cache& cache)
+{ 
+    if (query.stack.size == 0)
+    {
+        out = mask_set();
+    }
+    else
+    {
+        int index = query.stack.size - 1;
+        query_expr_evaluate_mask_set_from(out, index, query, mask_sets, cache);
+        
+        assert(index == -1);
+    }
+}
+
+//--------------------------------------
+
+// When a set is edited, the cached results of queries 
+// which use it only change for the anims edited. Rather 
+// than throwing these results away they can be updated 
+// by evaluating the query on copies of the sets holding 
+// just those anims, and splicing the result into the 
+// cached result in place of the old anims.
+
+static inline void query_expr_cache_select(range_set& out, const range_set& set, const slice1d<int> anims)
+{
+    range_set_select(out, set, anims);
+}
+
+static inline void query_expr_cache_select(mask_set& out, const mask_set& set, const slice1d<int> anims)
+{
+    mask_set_select(out, set, anims);
+}
+
+// Splices `patch` into `set` using `spliced` as a 
+// temporary, swapping the result into `set` to save 
+// copying it back
+static inline void query_expr_cache_splice(range_set& set, range_set& spliced, const slice1d<int> anims, const range_set& patch)
+{
+    range_set_splice(spliced, set, anims, patch);
+    set.anims.swap(spliced.anims);
+    set.anims_subranges.swap(spliced.anims_subranges);
+    set.ranges.swap(spliced.ranges);
+}
+
+static inline void query_expr_cache_splice(mask_set& set, mask_set& spliced, const slice1d<int> anims, const mask_set& patch)
+{
+    mask_set_splice(spliced, set, anims, patch);
+    set.anims.swap(spliced.anims);
+    set.anims_submasks.swap(spliced.anims_submasks);
+    set.masks.swap(spliced.masks);
+}
+
+static inline void query_expr_cache_evaluate(range_set& out, const query_expr& query, const std::vector<range_set>& sets, query_expr_scratch& scratch)
+{
+    query_expr_evaluate_range_set(out, query, sets, scratch);
+}
+
+static inline void query_expr_cache_evaluate(mask_set& out, const query_expr& query, const std::vector<mask_set>& sets, query_expr_scratch& scratch)
+{
+    query_expr_evaluate_mask_set(out, query, sets, scratch);
+}
+
+// Updates the cached results of all queries using `set` 
+// after the given anims of it have been edited. `sets`
+// should already contain the edited set, and `anims` 
+// should be sorted and include any anims added to or 
+// removed from it. The cost depends on the number of 
+// anims edited and entries affected, rather than the 
+// size of the database.
+template<typename T>
+void query_expr_cache_update(
+    query_expr_cache<T>& cache,
+    int set,
+    const slice1d<int> anims,
+    const std::vector<T>& sets,
+    query_expr_scratch& scratch)
+{
+    auto it = cache.dependents.find(set);
+    if (it == cache.dependents.end() || it->second.empty()) { return; }
+    
+    // Copy just the edited anims of the sets used by the
+    // entries being updated. Other sets are not read by 
+    // these queries so are left as they are.
+    cache.selected_sets.clear();
+    for (auto* e : it->second)
+    {
+        query_expr_cache<T>::entry_sets(*e, [&](int i) { cache.selected_sets.push_back(i); });
+    }
+    
+    std::sort(cache.selected_sets.begin(), cache.selected_sets.end());
+    cache.selected_sets.erase(std::unique(cache.selected_sets.begin(), cache.selected_sets.end()), cache.selected_sets.end());
+    
+    if (cache.selected.size() < sets.size()) { cache.selected.resize(sets.size()); }
+    for (int i : cache.selected_sets)
+    {
+        query_expr_cache_select(cache.selected[i], sets[i], anims);
+    }
+    
+    for (auto* e : it->second)
+    {
+        query_expr_cache_evaluate(cache.patch, e->query, cache.selected, scratch);
+        query_expr_cache_splice(e->result, cache.spliced, anims, cache.patch);
+        
+        size_t new_bytes = cache.entry_bytes(e->query.stack, e->result);
+        cache.bytes = cache.bytes - e->bytes + new_bytes;
+        e->bytes = new_bytes;
+        
+        cache.priorities.erase(e->priority);
+        e->priority = cache.priorities.emplace(cache.inflation + e->cost / e->bytes, e);
+        
+        cache.updates++;
+    }
+    
+    // Results may have grown past the budget
+    while (cache.bytes > cache.budget)
+    {
+        cache.evict();
+    }
+}
+
+//--------------------------------------
+
+// Queries can also be compiled into a flat program 
+// of instructions which read their operands from 
+// either input sets or temporary registers, and write 
+// their result to a register. Evaluating a program is 
+// then a single loop without any recursion or checks 
+// of the stack, and the same program can be evaluated 
+// on both range sets and mask sets.
+
+// A single instruction of a query program
+struct query_instr
+{
+    int op;         // Query operation to perform
+    int out;        // Register to write the result to
+    int lhs;        // Register or set index of lhs operand
+    int rhs;        // Register or set index of rhs operand
+    bool lhs_set;   // If lhs operand is a set index
+    bool rhs_set;   // If rhs operand is a set index
+};
+
+struct query_program
+{
+    array1d<query_instr> instrs;    // Instructions in order of evaluation
+    int registers = 0;              // Number of temporary registers used
+    int result = -1;                // Set index if query is a single set
+};
+
+// Compiles a query into a program. Since the stack is
+// already in postfix order, instructions are produced by 
+// a single pass from the bottom of the stack, keeping a 
+// stack of operands still waiting to be used. Each 
+// temporary is read exactly once, so a register becomes 
+// free as soon as the instruction using it is emitted,
+// and the output of each instruction is given the lowest
+// free register other than its own operands. The number 
+// of registers used is therefore the maximum number of 
+// temporaries live at once, rather than the number of 
+// operations in the query.
+void query_program_compile(
+    query_program& program,
+    const query_expr& query)
+{
+    struct operand
+    {
+        int index;
+        bool set;
+    };
+    
+    inplace_array1d<operand, 16> operands(query.stack.size);
+    inplace_array1d<bool, 16> used(query.stack.size);
+    used.zero();
+    
+    int num_instrs = 0;
+    for (int i = 0; i < query.stack.size; i++)
+    {
+        num_instrs += query.stack(i) < 0;
+    }
+    
+    program.instrs.resize(num_instrs);
+    program.registers = 0;
+    program.result = -1;
+    
+    int operands_num = 0;
+    int instrs_num = 0;
+    
+    for (int i = 0; i < query.stack.size; i++)
+    {
+        int op = query.stack(i);
+        
+        if (op >= 0)
+        {
+            operands(operands_num++) = { op, true };
+            continue;
+        }
+        
+        // Top of operand stack is lhs as it was 
+        // pushed to the query stack last
+        assert(operands_num >= 2);
+        operand lhs = operands(--operands_num);
+        operand rhs = operands(--operands_num);
+        
+        // Find lowest register not in use
+        int out = 0;
+        while (out < used.size && used(out)) { out++; }
+        used(out) = true;
+        program.registers = std::max(program.registers, out + 1);
+        
+        // Operands are now free to reuse
+        if (!lhs.set) { used(lhs.index) = false; }
+        if (!rhs.set) { used(rhs.index) = false; }
+        
+        program.instrs(instrs_num++) = { 
+            op, out, lhs.index, rhs.index, lhs.set, rhs.set };
+        
+        operands(operands_num++) = { out, false };
+    }
+    
+    assert(operands_num <= 1);
+    
+    // Record set index if there were no operations
+    if (operands_num == 1 && operands(0).set)
+    {
+        program.result = operands(0).index;
+    }
+}
+
+static inline void query_program_op(
+    range_set& out, 
+    int op, 
+    const range_set& lhs, 
+    const range_set& rhs)
+{
+    switch (op)
+    {
+        case QUERY_OP_UNION: range_set_union(out, lhs, rhs); break;
+        case QUERY_OP_INTERSECTION: range_set_intersection(out, lhs, rhs); break;
+        case QUERY_OP_DIFFERENCE: range_set_difference(out, lhs, rhs); break;
+        default: assert(false);
+    }
+}
+
+static inline void query_program_op(
+    mask_set& out, 
+    int op, 
+    const mask_set& lhs, 
+    const mask_set& rhs)
+{
+    switch (op)
+    {
+        case QUERY_OP_UNION: mask_set_union(out, lhs, rhs); break;
+        case QUERY_OP_INTERSECTION: mask_set_intersection(out, lhs, rhs); break;
+        case QUERY_OP_DIFFERENCE: mask_set_difference(out, lhs, rhs); break;
+        default: assert(false);
+    }
+}
+
+// Evaluates a program on either range sets or mask 
+// sets using `registers` as temporaries. The last 
+// instruction writes directly into `out`.
+template<typename T>
+void query_program_evaluate(
+    T& out,
+    const query_program& program,
+    const std::vector<T>& sets,
+    std::vector<T>& registers)
+{
+    if (program.instrs.size == 0)
+    {
+        out = program.result >= 0 ? sets[program.result] : T();
+        return;
+    }
+    
+    if ((int)registers.size() < program.registers)
+    {
+        registers.resize(program.registers);
+    }
+    
+    for (int i = 0; i < program.instrs.size; i++)
+    {
+        const query_instr& instr = program.instrs(i);
+        
+        query_program_op(
+            i == program.instrs.size - 1 ? out : registers[instr.out],
+            instr.op,
+            instr.lhs_set ? sets[instr.lhs] : registers[instr.lhs],
+            instr.rhs_set ? sets[instr.rhs] : registers[instr.rhs]);
+    }
+}
+
+void query_program_evaluate_range_set(
+    range_set& out,
+    const query_program& program,
+    const std::vector<range_set>& range_sets,
+    query_expr_scratch& scratch)
+{
+    query_program_evaluate(out, program, range_sets, scratch.range_sets);
+}
+
+void query_program_evaluate_mask_set(
+    mask_set& out,
+    const query_program& program,
+    const std::vector<mask_set>& mask_sets,
+    query_expr_scratch& scratch)
+{
+    query_program_evaluate(out, program, mask_sets, scratch.mask_sets);
+}
+
+//--------------------------------------
+
+// Many queries can be evaluated together as a batch. All
+// of the queries are combined into a single graph in which
+// each distinct operation appears once, so anything shared 
+// between queries is only evaluated once. Operands of 
+// unions and intersections are ordered so that A | B and 
+// B | A are also treated as the same operation.
+
+// Operation in a batch, or set index if `lhs` is -1
+struct query_batch_node
+{
+    int op;     // Query op or set index
+    int lhs;    // Index of lhs node
+    int rhs;    // Index of rhs node
+    int level;  // Longest path from node down to a set
+};
+
+struct query_batch_node_hash
+{
+    size_t operator()(const query_batch_node& node) const
+    {
+        int key[3] = { node.op, node.lhs, node.rhs };
+        return query_stack_hash(slice1d<int>(3, key));
+    }
+};
+
+struct query_batch_node_cmp
+{
+    bool operator()(const query_batch_node& lhs, const query_batch_node& rhs) const
+    {
+        return lhs.op == rhs.op && lhs.lhs == rhs.lhs && lhs.rhs == rhs.rhs;
+    }
+};
+
+// Timings and counts from evaluating a batch
+struct query_batch_stats
+{
+    int queries = 0;            // Number of queries in batch
+    int operations = 0;         // Number of operations over all queries
+    int nodes = 0;              // Number of distinct operations and sets
+    int levels = 0;             // Number of levels evaluated
+    double build_ms = 0.0;      // Time taken building graph
+    double evaluate_ms = 0.0;   // Time taken evaluating graph
+};
+
+struct query_batch
+{
+    // Nodes in order of creation, which puts every
+    // node after the nodes it uses
+    std::vector<query_batch_node> nodes;
+    
+    // Node of each query in batch, -1 if empty
+    std::vector<int> roots;
+    
+    // Result of each operation node. The results of set
+    // nodes point to the input sets instead.
+    std::vector<range_set> storage;
+    std::vector<const range_set*> results;
+    
+    // Nodes sorted by level and the start of each level 
+    std::vector<int> order;
+    std::vector<int> levels;
+    
+    // Lookup of nodes already added to the graph
+    std::unordered_map<query_batch_node, int, 
+        query_batch_node_hash, query_batch_node_cmp> lookup;
+    
+    query_batch_stats stats;
+};
+
+static int query_batch_add(
+    query_batch& batch,
+    int& index,
+    const query_expr& query)
+{
+    query_batch_node node = { query.stack(index), -1, -1, 0 };
+    index--;
+    
+    if (node.op < 0)
+    {
+        node.lhs = query_batch_add(batch, index, query);
+        node.rhs = query_batch_add(batch, index, query);
+        
+        if (node.op != QUERY_OP_DIFFERENCE && node.lhs > node.rhs)
+        {
+            std::swap(node.lhs, node.rhs);
+        }
+        
+        node.level = 1 + std::max(
+            batch.nodes[node.lhs].level, 
+            batch.nodes[node.rhs].level);
+        
+        batch.stats.operations++;
+    }
+    
+    auto it = batch.lookup.find(node);
+    if (it != batch.lookup.end())
+    {
+        return it->second;
+    }
+    
+    batch.nodes.push_back(node);
+    batch.lookup[node] = batch.nodes.size() - 1;
+    return batch.nodes.size() - 1;
+}
+
+// Builds the graph for a batch of queries
+void query_batch_build(
+    query_batch& batch,
+    const std::vector<query_expr>& queries)
+{
+    auto start = std::chrono::steady_clock::now();
+    
+    batch.nodes.clear();
+    batch.roots.resize(queries.size());
+    batch.lookup.clear();
+    batch.stats = query_batch_stats();
+    batch.stats.queries = queries.size();
+    
+    for (int i = 0; i < (int)queries.size(); i++)
+    {
+        int index = queries[i].stack.size - 1;
+        batch.roots[i] = index >= 0 ? query_batch_add(batch, index, queries[i]) : -1;
+        assert(index == -1);
+    }
+    
+    // Group nodes by level. Nodes within a level do not 
+    // depend on each other so can be evaluated in any order.
+    int nlevels = 0;
+    for (const query_batch_node& node : batch.nodes)
+    {
+        nlevels = std::max(nlevels, node.level + 1);
+    }
+    
+    batch.levels.assign(nlevels + 1, 0);
+    for (const query_batch_node& node : batch.nodes)
+    {
+        batch.levels[node.level + 1]++;
+    }
+    
+    for (int l = 0; l < nlevels; l++)
+    {
+        batch.levels[l + 1] += batch.levels[l];
+    }
+    
+    batch.order.resize(batch.nodes.size());
+    std::vector<int> level_i(batch.levels.begin(), batch.levels.end() - 1);
+    for (int i = 0; i < (int)batch.nodes.size(); i++)
+    {
+        batch.order[level_i[batch.nodes[i].level]++] = i;
+    }
+    
+    if ((int)batch.storage.size() < (int)batch.nodes.size())
+    {
+        batch.storage.resize(batch.nodes.size());
+    }
+    
+    batch.results.resize(batch.nodes.size());
+    
+    batch.stats.nodes = batch.nodes.size();
+    batch.stats.levels = nlevels;
+    batch.stats.build_ms = 1000.0 * std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+static void query_batch_evaluate_node(
+    query_batch& batch,
+    const std::vector<range_set>& range_sets,
+    int i)
+{
+    const query_batch_node& node = batch.nodes[i];
+    
+    if (node.lhs < 0)
+    {
+        batch.results[i] = &range_sets[node.op];
+        return;
+    }
+    
+    query_program_op(
+        batch.storage[i], 
+        node.op, 
+        *batch.results[node.lhs], 
+        *batch.results[node.rhs]);
+    
+    batch.results[i] = &batch.storage[i];
+}
+
+// Evaluates every node of the batch in order of level
+void query_batch_evaluate(
+    query_batch& batch,
+    const std::vector<range_set>& range_sets)
+{
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int i : batch.order)
+    {
+        query_batch_evaluate_node(batch, range_sets, i);
+    }
+    
+    batch.stats.evaluate_ms = 1000.0 * std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Same as above but evaluates the nodes of each level
+// in parallel on `pool`
+void query_batch_evaluate(
+    query_batch& batch,
+    const std::vector<range_set>& range_sets,
+    thread_pool& pool)
+{
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int l = 0; l < (int)batch.levels.size() - 1; l++)
+    {
+        int level_start = batch.levels[l];
+        
+        parallel_for(pool, batch.levels[l + 1] - level_start, 1, [&](int nodes_start, int nodes_stop)
+        {
+            for (int i = nodes_start; i < nodes_stop; i++)
+            {
+                query_batch_evaluate_node(batch, range_sets, batch.order[level_start + i]);
+            }
+        });
+    }
+    
+    batch.stats.evaluate_ms = 1000.0 * std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Result of query `i` in the batch. This may be shared
+// with other queries or be one of the input sets, and 
+// is valid until the batch is next evaluated.
+const range_set& query_batch_result(const query_batch& batch, int i)
+{
+    static const range_set empty;
+    return batch.roots[i] >= 0 ? *batch.results[batch.roots[i]] : empty;
+}
+
+// Builds and evaluates a batch of queries
+void query_expr_evaluate_range_set_batch(
+    query_batch& batch,
+    const std::vector<query_expr>& queries,
+    const std::vector<range_set>& range_sets)
+{
+    query_batch_build(batch, queries);
+    query_batch_evaluate(batch, range_sets);
+}
+
+void query_expr_evaluate_range_set_batch(
+    query_batch& batch,
+    const std::vector<query_expr>& queries,
+    const std::vector<range_set>& range_sets,
+    thread_pool& pool)
+{
+    query_batch_build(batch, queries);
+    query_batch_evaluate(batch, range_sets, pool);
+}
+
+//--------------------------------------
+
+// Queries can also be evaluated lazily, producing the 
+// ranges of the result one at a time in order of anim 
+// and then time. Each node of the query keeps just its 
+// current range and pulls new ranges from its children 
+// as they are needed, so there are no intermediate sets 
+// and memory use depends only on the size of the query.
+// Evaluation can be stopped at any point, such as once 
+// enough frames have been found.
+
+// Node of a lazily evaluated query, holding the next
+// range it will output
+struct query_iter_node
+{
+    int op;         // Query op or set index
+    int lhs;        // Index of lhs node
+    int rhs;        // Index of rhs node
+    int anim;       // Anim of current range, INT_MAX when finished
+    range curr;     // Current range
+    int anim_i;     // Index of anim in set if a set
+    int range_i;    // Index of range in set if a set
+};
+
+struct query_iter
+{
+    std::vector<query_iter_node> nodes;
+    const std::vector<range_set>* range_sets = nullptr;
+    int root = -1;
+};
+
+static void query_iter_advance(query_iter& iter, int i);
+
+// Moves a set node forward to the next anim with ranges
+// if it is past the end of the current one
+static void query_iter_set_next(query_iter& iter, int i)
+{
+    query_iter_node& node = iter.nodes[i];
+    const range_set& set = (*iter.range_sets)[node.op];
+    
+    while (node.anim_i < set.anims.size && 
+        node.range_i >= set.anims_subranges(node.anim_i).stop)
+    {
+        node.anim_i++;
+        node.range_i = node.anim_i < set.anims.size ? 
+            set.anims_subranges(node.anim_i).start : 0;
+    }
+    
+    if (node.anim_i < set.anims.size)
+    {
+        node.anim = set.anims(node.anim_i);
+        node.curr = set.ranges(node.range_i);
+    }
+    else
+    {
+        node.anim = INT_MAX;
+    }
+}
+
+// Moves a node forward to its first range with an 
+// anim not less than `anim`. Sets skip ahead using 
+// `anims_gallop` while ops skip ahead their children.
+static void query_iter_seek(query_iter& iter, int i, int anim)
+{
+    query_iter_node& node = iter.nodes[i];
+    
+    if (node.anim >= anim) { return; }
+    
+    if (node.op >= 0)
+    {
+        const range_set& set = (*iter.range_sets)[node.op];
+        node.anim_i = anims_gallop(set.anims, node.anim_i, anim);
+        node.range_i = node.anim_i < set.anims.size ? 
+            set.anims_subranges(node.anim_i).start : 0;
+        query_iter_set_next(iter, i);
+    }
+    else
+    {
+        query_iter_seek(iter, node.lhs, anim);
+        query_iter_seek(iter, node.rhs, anim);
+        query_iter_advance(iter, i);
+    }
+}
+
+// Finds the next range output by a union from the
+// current ranges of its children, extending it for 
+// as long as either child has a range overlapping it
+static void query_iter_union(query_iter& iter, int i)
+{
+    query_iter_node& node = iter.nodes[i];
+    query_iter_node& lhs = iter.nodes[node.lhs];
+    query_iter_node& rhs = iter.nodes[node.rhs];
+    
+    if (lhs.anim == INT_MAX && rhs.anim == INT_MAX)
+    {
+        node.anim = INT_MAX;
+        return;
+    }
+    
+    bool lhs_first = lhs.anim < rhs.anim || 
+        (lhs.anim == rhs.anim && lhs.curr.start <= rhs.curr.start);
+    
+    node.anim = lhs_first ? lhs.anim : rhs.anim;
+    node.curr = lhs_first ? lhs.curr : rhs.curr;
+    query_iter_advance(iter, lhs_first ? node.lhs : node.rhs);
+    
+    while (true)
+    {
+        if (lhs.anim == node.anim && lhs.curr.start <= node.curr.stop)
+        {
+            node.curr.stop = std::max(node.curr.stop, lhs.curr.stop);
+            query_iter_advance(iter, node.lhs);
+        }
+        else if (rhs.anim == node.anim && rhs.curr.start <= node.curr.stop)
+        {
+            node.curr.stop = std::max(node.curr.stop, rhs.curr.stop);
+            query_iter_advance(iter, node.rhs);
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+// Finds the next overlap of the current ranges of the
+// children of an intersection, moving on whichever 
+// child has the range which ends first
+static void query_iter_intersection(query_iter& iter, int i)
+{
+    query_iter_node& node = iter.nodes[i];
+    query_iter_node& lhs = iter.nodes[node.lhs];
+    query_iter_node& rhs = iter.nodes[node.rhs];
+    
+    while (lhs.anim != INT_MAX && rhs.anim != INT_MAX)
+    {
+        if (lhs.anim < rhs.anim)
+        {
+            query_iter_seek(iter, node.lhs, rhs.anim);
+        }
+        else if (rhs.anim < lhs.anim)
+        {
+            query_iter_seek(iter, node.rhs, lhs.anim);
+        }
+        else
+        {
+            int start = std::max(lhs.curr.start, rhs.curr.start);
+            int stop = std::min(lhs.curr.stop, rhs.curr.stop);
+            int anim = lhs.anim;
+            
+            if (lhs.curr.stop == stop) { query_iter_advance(iter, node.lhs); }
+            if (rhs.curr.stop == stop) { query_iter_advance(iter, node.rhs); }
+            
+            if (start < stop)
+            {
+                node.anim = anim;
+                node.curr = { start, stop };
+                return;
+            }
+        }
+    }
+    
+    node.anim = INT_MAX;
+}
+
+// Finds the next part of the current lhs range of a
+// difference not covered by the rhs. The lhs range is
+// trimmed in place as parts of it are output.
+static void query_iter_difference(query_iter& iter, int i)
+{
+    query_iter_node& node = iter.nodes[i];
+    query_iter_node& lhs = iter.nodes[node.lhs];
+    query_iter_node& rhs = iter.nodes[node.rhs];
+    
+    while (lhs.anim != INT_MAX)
+    {
+        if (rhs.anim < lhs.anim)
+        {
+            query_iter_seek(iter, node.rhs, lhs.anim);
+        }
+        // Rhs range ends before lhs range so move on rhs
+        else if (rhs.anim == lhs.anim && rhs.curr.stop <= lhs.curr.start)
+        {
+            query_iter_advance(iter, node.rhs);
+        }
+        // Nothing subtracted from start of lhs range
+        else if (rhs.anim > lhs.anim || rhs.curr.start > lhs.curr.start)
+        {
+            node.anim = lhs.anim;
+            node.curr = lhs.curr;
+            
+            if (rhs.anim == lhs.anim && rhs.curr.start < lhs.curr.stop)
+            {
+                node.curr.stop = rhs.curr.start;
+                lhs.curr.start = rhs.curr.start;
+            }
+            else
+            {
+                query_iter_advance(iter, node.lhs);
+            }
+            
+            return;
+        }
+        // Start of lhs range is covered by rhs range
+        else if (rhs.curr.stop < lhs.curr.stop)
+        {
+            lhs.curr.start = rhs.curr.stop;
+            query_iter_advance(iter, node.rhs);
+        }
+        else
+        {
+            query_iter_advance(iter, node.lhs);
+        }
+    }
+    
+    node.anim = INT_MAX;
+}
+
+// Moves a node on to its next range
+static void query_iter_advance(query_iter& iter, int i)
+{
+    query_iter_node& node = iter.nodes[i];
+    
+    switch (node.op)
+    {
+        case QUERY_OP_UNION: query_iter_union(iter, i); break;
+        case QUERY_OP_INTERSECTION: query_iter_intersection(iter, i); break;
+        case QUERY_OP_DIFFERENCE: query_iter_difference(iter, i); break;
+        default: node.range_i++; query_iter_set_next(iter, i); break;
+    }
+}
+
+// Adds the nodes for the stack below `index` with 
+// children before their parents, moving each to its
+// first range
+static int query_iter_build(
+    query_iter& iter,
+    int& index,
+    const query_expr& query)
+{
+    query_iter_node node = { query.stack(index), -1, -1, INT_MAX, { 0, 0 }, 0, 0 };
+    index--;
+    
+    if (node.op < 0)
+    {
+        node.lhs = query_iter_build(iter, index, query);
+        node.rhs = query_iter_build(iter, index, query);
+    }
+    else
+    {
+        const range_set& set = (*iter.range_sets)[node.op];
+        node.range_i = set.anims.size > 0 ? set.anims_subranges(0).start : 0;
+    }
+    
+    iter.nodes.push_back(node);
+    
+    int i = iter.nodes.size() - 1;
+    if (node.op >= 0)
+    {
+        query_iter_set_next(iter, i);
+    }
+    else
+    {
+        query_iter_advance(iter, i);
+    }
+    
+    return i;
+}
+
+// Starts lazy evaluation of a query. The sets must not
+// change or be moved while the query is iterated.
+void query_iter_init(
+    query_iter& iter,
+    const query_expr& query,
+    const std::vector<range_set>& range_sets)
+{
+    iter.nodes.clear();
+    iter.nodes.reserve(query.stack.size);
+    iter.range_sets = &range_sets;
+    iter.root = -1;
+    
+    if (query.stack.size > 0)
+    {
+        int index = query.stack.size - 1;
+        iter.root = query_iter_build(iter, index, query);
+        assert(index == -1);
+    }
+}
+
+// Gets the next range of the result of a query and 
+// the anim it is in. Returns false once there are no 
+// more ranges.
+bool query_iter_next(
+    query_iter& iter,
+    int& anim,
+    range& out)
+{
+    if (iter.root < 0 || iter.nodes[iter.root].anim == INT_MAX)
+    {
+        return false;
+    }
+    
+    anim = iter.nodes[iter.root].anim;
+    out = iter.nodes[iter.root].curr;
+    query_iter_advance(iter, iter.root);
+    return true;
+}
+
+//--------------------------------------
+
+// Writes ranges into a mask, filling the gaps between 
+// them with zeros so that every bit is written once
+void ranges_rasterize(
+    slice1d_bit out,
+    const slice1d<range> ranges)
+{
+    int prev = 0;
+    
+    for (int i = 0; i < ranges.size; i++)
+    {
+        bit_fill(out.data, out.offset + prev, ranges(i).start - prev, false);
+        bit_fill(out.data, out.offset + ranges(i).start, ranges(i).stop - ranges(i).start, true);
+        prev = ranges(i).stop;
+    }
+    
+    bit_fill(out.data, out.offset + prev, out.size - prev, false);
+}
+
+// Same as above for a mask starting on a 64-bit boundary
+// of `data` and padded to a whole number of words, as the
+// submasks of a mask set are. Rather than filling each 
+// range, which branches on how many words every range 
+// spans, a bit is flipped at the start and stop of each
+// range and then a prefix xor of each word fills the bits
+// in between, carrying over from word to word. Each 
+// finished word `w` at bit `i` is passed through 
+// `func(i, w)` before being stored.
+template<typename F>
+static inline void ranges_rasterize_words(
+    unsigned char* __restrict__ data,
+    int size,
+    const slice1d<range> ranges,
+    const F& func)
+{
+    int nwords = (size + 63) / 64;
+    
+    memset(data, 0, nwords * sizeof(uint64_t));
+    
+    for (int i = 0; i < ranges.size; i++)
+    {
+        int start = ranges(i).start;
+        int stop = ranges(i).stop;
+        
+        data[start / 8] ^= 1 << (start % 8);
+        
+        if (stop < 64 * nwords)
+        {
+            data[stop / 8] ^= 1 << (stop % 8);
+        }
+    }
+    
+    // All ones if the last word ended inside a range
+    uint64_t carry = 0;
+    
+    for (int k = 0; k < nwords; k++)
+    {
+        uint64_t w;
+        memcpy(&w, data + 8 * k, sizeof(uint64_t));
+        
+        w ^= w << 1;
+        w ^= w << 2;
+        w ^= w << 4;
+        w ^= w << 8;
+        w ^= w << 16;
+        w ^= w << 32;
+        w ^= carry;
+        carry = 0 - (w >> 63);
+        
+        w = func(64 * k, w);
+        memcpy(data + 8 * k, &w, sizeof(uint64_t));
+    }
+}
+
+static void ranges_rasterize_words(
+    unsigned char* __restrict__ data,
+    int size,
+    const slice1d<range> ranges)
+{
+    ranges_rasterize_words(data, size, ranges, [](int, uint64_t w) { return w; });
+}
+
+// Works out where the mask of each anim goes in `out`
+// given the number of frames of each anim in `set_all`
+static void range_set_rasterize_layout(
+    mask_set& out,
+    const range_set& set,
+    const range_set& set_all)
+{
+    out.anims = set.anims;
+    out.anims_submasks.resize(set.anims.size);
+    
+    int masks_i = 0;
+    for (int i = 0; i < out.anims.size; i++)
+    {
+        int nmasks = set_all.ranges(out.anims(i)).stop - set_all.ranges(out.anims(i)).start;
+        
+        out.anims_submasks(i) = { masks_i, masks_i + nmasks };
+        
+        masks_i = mask_set_align(masks_i + nmasks);
+    }
+    
+    out.masks.resize(masks_i);
+}
+
+static inline void range_set_rasterize_anim(
+    mask_set& out,
+    const range_set& set,
+    int i)
+{
+    ranges_rasterize_words(
+        out.masks.data + out.anims_submasks(i).start / 8,
+        out.anims_submasks(i).stop - out.anims_submasks(i).start,
+        set.ranges.slice(set.anims_subranges(i)));
+}
+
+void range_set_rasterize(
+    mask_set& out,
+    const range_set& set,
+    const range_set& set_all)
+{
+    range_set_rasterize_layout(out, set, set_all);
+    
+    for (int i = 0; i < set.anims.size; i++)
+    {
+        range_set_rasterize_anim(out, set, i);
+    }
+}
+
+// Same as above but rasterizes anims in parallel on `pool`
+void range_set_rasterize(
+    mask_set& out,
+    const range_set& set,
+    const range_set& set_all,
+    thread_pool& pool)
+{
+    range_set_rasterize_layout(out, set, set_all);
+    
+    parallel_for(pool, set.anims.size, SET_OP_PARALLEL_GRAIN, [&](int start, int stop)
+    {
+        for (int i = start; i < stop; i++)
+        {
+            range_set_rasterize_anim(out, set, i);
+        }
+    });
+}
+
+// Rasterizes every set in `sets` at once, splitting the
+// anims of all of them between the workers of `pool` so
+// that tags with few anims don't leave workers idle
+void range_set_rasterize(
+    std::vector<mask_set>& out,
+    const std::vector<range_set>& sets,
+    const range_set& set_all,
+    thread_pool& pool)
+{
+    out.resize(sets.size());
+    
+    // Start of the anims of each set when all are 
+    // numbered one after another
+    std::vector<int> offsets(sets.size() + 1, 0);
+    
+    for (int s = 0; s < (int)sets.size(); s++)
+    {
+        range_set_rasterize_layout(out[s], sets[s], set_all);
+        offsets[s + 1] = offsets[s] + sets[s].anims.size;
+    }
+    
+    parallel_for(pool, offsets.back(), SET_OP_PARALLEL_GRAIN, [&](int start, int stop)
+    {
+        int s = (int)(std::upper_bound(offsets.begin(), offsets.end(), start) - offsets.begin()) - 1;
+        
+        for (int i = start; i < stop; i++)
+        {
+            while (i >= offsets[s + 1]) { s++; }
+            range_set_rasterize_anim(out[s], sets[s], i - offsets[s]);
+        }
+    });
+}
+
+// Calls `func(start, stop)` for each run of set bits in 
+// `mask`. Runs are found a word at a time by xoring the 
+// word with itself shifted by one, which leaves a bit set 
+// at every start and stop, and then taking each of those 
+// in turn with count trailing zeros, so words which are
+// all set or all unset cost little more than the load.
+// With `invert` the runs of unset bits are given instead.
+template<bool invert = false, typename F>
+static inline void mask_runs(const slice1d_bit mask, const F& func)
+{
+    // Last bit of the previous word
+    uint64_t prev = 0;
+    int start = 0;
+    
+    for (int i = 0; i < mask.size; i += 64)
+    {
+        int n = std::min(64, mask.size - i);
+        uint64_t w = n == 64 ? 
+            bit_load64(mask.data, mask.offset + i) :
+            bit_load64(mask.data, mask.offset + i, n);
+        
+        if (invert)
+        {
+            w = n == 64 ? ~w : ~w & ((1ull << n) - 1);
+        }
+        
+        // Bits past the end of a partial word are clear
+        // so a run reaching the end stops on the first
+        uint64_t edges = w ^ ((w << 1) | prev);
+        prev = w >> 63;
+        
+        while (edges)
+        {
+            int j = bit_ctz64(edges);
+            
+            if ((w >> j) & 1)
+            {
+                start = i + j;
+            }
+            else
+            {
+                func(start, i + j);
+            }
+            
+            edges &= edges - 1;
+        }
+    }
+    
+    if (prev)
+    {
+        func(start, mask.size);
+    }
+}
+
+// Converts a mask into a set of ranges, assumes
+// `out` is pre-allocated to be large enough to
+// store result. Returns number of ranges added.
+int mask_vectorize(
+    slice1d<range> out,
+    const slice1d_bit mask)
+{
+    int out_i = 0;
+    
+    mask_runs(mask, [&](int start, int stop)
+    {
+        out(out_i) = { start, stop };
+        out_i++;
+    });
+    
+    return out_i;
+}
+
+// Converts a mask into a set of ranges appended to the
+// end of `out`, which is grown as needed so that the 
+// ranges don't need counting first. Returns number of 
+// ranges added.
+int mask_vectorize(
+    array1d<range>& out,
+    const slice1d_bit mask)
+{
+    int out_start = out.size;
+    int out_i = out.size;
+    
+    mask_runs(mask, [&](int start, int stop)
+    {
+        // Use any spare capacity first and otherwise 
+        // grow geometrically
+        if (out_i == out.size)
+        {
+            out.resize(out.capacity > out.size ? out.capacity : std::max(2 * out.size, 64));
+        }
+        
+        out(out_i) = { start, stop };
+        out_i++;
+    });
+    
+    out.resize(out_i);
+    
+    return out_i - out_start;
+}
+
+// Converts a mask set into a range set. Anims with no
+// frames set are not output, so the result has the same
+// anims as the range set operations would give. Mask set
+// operations themselves keep such anims, since every 
+// anim's mask is the length of the anim either way, and
+// finding the empty ones would take another pass over 
+// every word of the result.
+void mask_set_vectorize(
+    range_set& out,
+    const mask_set& set)
+{
+    out.anims.resize(set.anims.size);
+    out.anims_subranges.resize(set.anims.size);
+    out.ranges.resize(0);
+    
+    int out_i = 0;
+    
+    for (int i = 0; i < set.anims.size; i++)
+    { 
+        int ranges_start = out.ranges.size;
+        
+        int nranges = mask_vectorize(
+            out.ranges,
+            set.masks.slice(set.anims_submasks(i)));
+        
+        if (nranges > 0)
+        {
+            out.anims(out_i) = set.anims(i);
+            out.anims_subranges(out_i) = { ranges_start, out.ranges.size };
+            out_i++;
+        }
+    }
+    
+    out.anims.resize(out_i);
+    out.anims_subranges.resize(out_i);
+}
+
+//--------------------------------------
+
+// A hybrid set stores each anim as either ranges or a 
+// mask, whichever takes less memory. Sparse anims with a 
+// few long ranges are smallest and fastest as ranges, 
+// while heavily fragmented anims are smallest and fastest
+// as masks. Operations between an anim stored as ranges 
+// and one stored as a mask work on both directly without
+// converting either, and the encoding of each anim in the
+// result is chosen again from its size.
+
+struct hybrid_set
+{
+    array1d<int>   anims;           // Sorted ids of all anims with ranges in set
+    array1d<int>   anims_frames;    // Number of frames in each anim
+    array1d<range> anims_subranges; // Slices of `ranges` for each anim, empty if stored as mask
+    array1d<range> anims_submasks;  // Slices of `masks` for each anim, empty if stored as ranges
+    array1d<range> ranges;          // Ranges of all anims stored as ranges
+    array1d_bit    masks;           // Masks of all anims stored as masks
+};
+
+// Size of a range in bits. An anim is stored as a mask 
+// when its mask is smaller than its ranges would be.
+enum { HYBRID_RANGE_BITS = 8 * sizeof(range) };
+
+// Ranges covering less than this fraction of an anim are
+// combined with a mask by reading only the parts under them
+enum { HYBRID_SPARSE_RATIO = 8 };
+
+static inline bool hybrid_use_mask(int nranges, int nframes)
+{
+    return mask_set_align(nframes) < HYBRID_RANGE_BITS * nranges;
+}
+
+static inline bool hybrid_set_is_mask(const hybrid_set& set, int i)
+{
+    return set.anims_submasks(i).stop > set.anims_submasks(i).start;
+}
+
+static inline slice1d<range> hybrid_set_ranges(const hybrid_set& set, int i)
+{
+    return set.ranges.slice(set.anims_subranges(i));
+}
+
+static inline slice1d_bit hybrid_set_mask(const hybrid_set& set, int i)
+{
+    return set.masks.slice(set.anims_submasks(i));
+}
+
+// Memory used by the data of a hybrid set in bytes
+size_t memory_usage(const hybrid_set& set)
+{
+    return 
+        set.anims.size * (2 * sizeof(int) + 2 * sizeof(range)) +
+        set.ranges.size * sizeof(range) +
+        bit_alloc_size(set.masks.size);
+}
+
+// Empties a hybrid set but keeps its memory for reuse
+void hybrid_set_clear(hybrid_set& set)
+{
+    set.anims.resize(0);
+    set.anims_frames.resize(0);
+    set.anims_subranges.resize(0);
+    set.anims_submasks.resize(0);
+    set.ranges.resize(0);
+    set.masks.resize(0);
+}
+
+// Number of ranges in a mask, stopping early once there
+// are more than `limit`. Fragmented masks have too many 
+// ranges to be worth storing as ranges, so this usually 
+// only needs to look at the first few words of them.
+static inline int hybrid_mask_count(const slice1d_bit mask, int limit)
+{
+    int count = 0;
+    uint64_t prev = 0;
+    
+    for (int i = 0; i < mask.size && count <= limit; i += 64)
+    {
+        int n = std::min(64, mask.size - i);
+        uint64_t w = n == 64 ? 
+            bit_load64(mask.data, mask.offset + i) :
+            bit_load64(mask.data, mask.offset + i, n);
+        
+        count += bit_popcount64(w & ~((w << 1) | prev));
+        prev = w >> 63;
+    }
+    
+    return count;
+}
+
+// Grows an array which is being filled so it can hold 
+// at least `n` items. Growth is geometric so filling an
+// array one anim at a time stays linear.
+template<typename A>
+static inline void array_reserve(A& array, int n)
+{
+    if (n > array.size) { array.resize(std::max(n, 2 * array.size)); }
+}
+
+// Appends anims to the end of a hybrid set. The ranges 
+// or mask of each anim are first written at the end of 
+// the set's arrays, and then kept in that encoding or 
+// converted to the other when that would be smaller.
+struct hybrid_set_output
+{
+    hybrid_set& set;
+    int anims_i;
+    int ranges_i;
+    int masks_i;
+    int pending;    // Ranges written for the anim being added
+    
+    hybrid_set_output(hybrid_set& _set, int max_anims) 
+        : set(_set), anims_i(0), ranges_i(0), masks_i(0), pending(0)
+    {
+        set.anims.resize(max_anims);
+        set.anims_frames.resize(max_anims);
+        set.anims_subranges.resize(max_anims);
+        set.anims_submasks.resize(max_anims);
+        set.ranges.resize(0);
+        set.masks.resize(0);
+    }
+    
+    // Space for the next `n` ranges of the anim being added
+    slice1d<range> ranges(int n)
+    {
+        array_reserve(set.ranges, ranges_i + pending + n);
+        return set.ranges.slice(ranges_i + pending, ranges_i + pending + n);
+    }
+    
+    void push_range(range r)
+    {
+        array_reserve(set.ranges, ranges_i + pending + 1);
+        set.ranges(ranges_i + pending) = r;
+        pending++;
+    }
+    
+    // Space for the mask of the anim being added
+    slice1d_bit mask(int nframes)
+    {
+        array_reserve(set.masks, masks_i + mask_set_align(nframes));
+        return set.masks.slice(masks_i, masks_i + nframes);
+    }
+    
+    void add(int anim, int nframes, int nranges, int nmasks)
+    {
+        set.anims(anims_i) = anim;
+        set.anims_frames(anims_i) = nframes;
+        set.anims_subranges(anims_i) = { ranges_i, ranges_i + nranges };
+        set.anims_submasks(anims_i) = { masks_i, masks_i + nmasks };
+        anims_i++;
+        ranges_i += nranges;
+        masks_i = mask_set_align(masks_i + nmasks);
+        pending = 0;
+    }
+    
+    // Adds an anim from the pending ranges, dropping it if
+    // there are none
+    void push_ranges(int anim, int nframes)
+    {
+        if (pending == 0) { return; }
+        
+        if (hybrid_use_mask(pending, nframes))
+        {
+            slice1d_bit out = mask(nframes);
+            ranges_rasterize_words(out.data, nframes, set.ranges.slice(ranges_i, ranges_i + pending));
+            pending = 0;
+            add(anim, nframes, 0, nframes);
+        }
+        else
+        {
+            add(anim, nframes, pending, 0);
+        }
+    }
+    
+    // Adds an anim from the mask written by `mask`, 
+    // dropping it if the mask is empty
+    void push_mask(int anim, int nframes)
+    {
+        slice1d_bit out = set.masks.slice(masks_i, masks_i + nframes);
+        int nranges = hybrid_mask_count(out, mask_set_align(nframes) / HYBRID_RANGE_BITS);
+        
+        if (nranges == 0) { return; }
+        
+        if (hybrid_use_mask(nranges, nframes))
+        {
+            add(anim, nframes, 0, nframes);
+        }
+        else
+        {
+            pending = mask_vectorize(ranges(nranges), out);
+            add(anim, nframes, pending, 0);
+        }
+    }
+    
+    // Adds anim `i` of `src` unchanged
+    void copy(const hybrid_set& src, int i)
+    {
+        if (hybrid_set_is_mask(src, i))
+        {
+            mask(src.anims_frames(i)) = hybrid_set_mask(src, i);
+            add(src.anims(i), src.anims_frames(i), 0, src.anims_frames(i));
+        }
+        else
+        {
+            ranges(src.anims_subranges(i).stop - src.anims_subranges(i).start) = hybrid_set_ranges(src, i);
+            add(src.anims(i), src.anims_frames(i), src.anims_subranges(i).stop - src.anims_subranges(i).start, 0);
+        }
+    }
+    
+    // Shrinks the set's arrays to what was added
+    void finish()
+    {
+        set.anims.resize(anims_i);
+        set.anims_frames.resize(anims_i);
+        set.anims_subranges.resize(anims_i);
+        set.anims_submasks.resize(anims_i);
+        set.ranges.resize(ranges_i);
+        set.masks.resize(masks_i);
+    }
+};
+
+// Converts a range set into a hybrid set, taking the 
+// number of frames in each anim from `set_all`
+void range_set_hybridize(
+    hybrid_set& out,
+    const range_set& set,
+    const range_set& set_all)
+{
+    hybrid_set_output output(out, set.anims.size);
+    
+    for (int i = 0; i < set.anims.size; i++)
+    {
+        slice1d<range> ranges = set.ranges.slice(set.anims_subranges(i));
+        range all = set_all.ranges(set.anims(i));
+        
+        output.ranges(ranges.size) = ranges;
+        output.pending = ranges.size;
+        output.push_ranges(set.anims(i), all.stop - all.start);
+    }
+    
+    output.finish();
+}
+
+// Converts a hybrid set back into a range set
+void hybrid_set_vectorize(
+    range_set& out,
+    const hybrid_set& set)
+{
+    out.anims = set.anims;
+    out.anims_subranges.resize(set.anims.size);
+    out.ranges.resize(0);
+    
+    int ranges_i = 0;
+    
+    for (int i = 0; i < set.anims.size; i++)
+    {
+        int ranges_start = ranges_i;
+        
+        if (hybrid_set_is_mask(set, i))
+        {
+            mask_runs(hybrid_set_mask(set, i), [&](int start, int stop)
+            {
+                array_reserve(out.ranges, ranges_i + 1);
+                out.ranges(ranges_i) = { start, stop };
+                ranges_i++;
+            });
+        }
+        else
+        {
+            slice1d<range> ranges = hybrid_set_ranges(set, i);
+            array_reserve(out.ranges, ranges_i + ranges.size);
+            out.ranges.slice(ranges_i, ranges_i + ranges.size) = ranges;
+            ranges_i += ranges.size;
+        }
+        
+        out.anims_subranges(i) = { ranges_start, ranges_i };
+    }
+    
+    out.ranges.resize(ranges_i);
+}
+
+// Applies `op` to an anim which is in both sets. Anims 
+// with the same encoding use the range or mask kernels. 
+// For a range and a mask, when the result is no more than
+// ranges which cover only a small part of the anim, as in
+// intersections and ranges minus a mask, it is found from
+// the runs of the mask inside each range, so only the 
+// parts of the mask under the ranges are read. Otherwise
+// the ranges are rasterized and combined with the mask a 
+// word at a time.
+template<int op>
+static void hybrid_set_op_anim(
+    hybrid_set_output& out,
+    const hybrid_set& lhs,
+    int lhs_i,
+    const hybrid_set& rhs,
+    int rhs_i)
+{
+    int anim = lhs.anims(lhs_i);
+    int nframes = lhs.anims_frames(lhs_i);
+    assert(nframes == rhs.anims_frames(rhs_i));
+    
+    bool lhs_mask = hybrid_set_is_mask(lhs, lhs_i);
+    bool rhs_mask = hybrid_set_is_mask(rhs, rhs_i);
+    
+    if (!lhs_mask && !rhs_mask)
+    {
+        slice1d<range> lhs_ranges = hybrid_set_ranges(lhs, lhs_i);
+        slice1d<range> rhs_ranges = hybrid_set_ranges(rhs, rhs_i);
+        
+        out.pending = ranges_merge<op>(
+            out.ranges(lhs_ranges.size + rhs_ranges.size), lhs_ranges, rhs_ranges);
+        out.push_ranges(anim, nframes);
+        return;
+    }
+    
+    if (lhs_mask && rhs_mask)
+    {
+        mask_op_slices<op>(out.mask(nframes), hybrid_set_mask(lhs, lhs_i), hybrid_set_mask(rhs, rhs_i));
+        out.push_mask(anim, nframes);
+        return;
+    }
+    
+    slice1d<range> ranges = lhs_mask ? hybrid_set_ranges(rhs, rhs_i) : hybrid_set_ranges(lhs, lhs_i);
+    slice1d_bit mask = lhs_mask ? hybrid_set_mask(lhs, lhs_i) : hybrid_set_mask(rhs, rhs_i);
+    
+    int covered = 0;
+    for (int i = 0; i < ranges.size; i++)
+    {
+        covered += ranges(i).stop - ranges(i).start;
+    }
+    
+    if ((op == SET_OP_INTERSECTION || (op == SET_OP_DIFFERENCE && !lhs_mask)) &&
+        HYBRID_SPARSE_RATIO * covered < nframes)
+    {
+        for (int i = 0; i < ranges.size; i++)
+        {
+            int offset = ranges(i).start;
+            
+            mask_runs<op == SET_OP_DIFFERENCE>(mask.slice(ranges(i)), [&](int start, int stop)
+            {
+                out.push_range({ offset + start, offset + stop });
+            });
+        }
+        
+        out.push_ranges(anim, nframes);
+    }
+    else
+    {
+        ranges_rasterize_words(out.mask(nframes).data, nframes, ranges, [&](int i, uint64_t w)
+        {
+            // Only load the bits inside the mask
+            int n = std::min(64, nframes - i);
+            uint64_t m = n == 64 ? 
+                bit_load64(mask.data, mask.offset + i) :
+                bit_load64(mask.data, mask.offset + i, n);
+            
+            return lhs_mask ? set_op<op>(m, w) : set_op<op>(w, m);
+        });
+        
+        out.push_mask(anim, nframes);
+    }
+}
+
+template<int op>
+static void hybrid_set_op(
+    hybrid_set& out, 
+    const hybrid_set& lhs, 
+    const hybrid_set& rhs)
+{
+    hybrid_set_output output(out, lhs.anims.size + rhs.anims.size);
+    
+    int lhs_i = 0;
+    int rhs_i = 0;
+    
+    while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
+    {
+        // Anims in only one set are copied if they are 
+        // kept by the op and otherwise skipped over
+        if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
+        {
+            if (set_op<op>(true, false))
+            {
+                output.copy(lhs, lhs_i++);
+            }
+            else
+            {
+                lhs_i = anims_gallop(lhs.anims, lhs_i, rhs.anims(rhs_i));
+            }
+        }
+        else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
+        {
+            if (set_op<op>(false, true))
+            {
+                output.copy(rhs, rhs_i++);
+            }
+            else
+            {
+                rhs_i = anims_gallop(rhs.anims, rhs_i, lhs.anims(lhs_i));
+            }
+        }
+        else
+        {
+            hybrid_set_op_anim<op>(output, lhs, lhs_i, rhs, rhs_i);
+            lhs_i++; rhs_i++;
+        }
+    }
+    
+    if (set_op<op>(true, false))
+    {
+        for (; lhs_i < lhs.anims.size; lhs_i++) { output.copy(lhs, lhs_i); }
+    }
+    
+    if (set_op<op>(false, true))
+    {
+        for (; rhs_i < rhs.anims.size; rhs_i++) { output.copy(rhs, rhs_i); }
+    }
+    
+    output.finish();
+}
+
+void hybrid_set_union(
+    hybrid_set& out, 
+    const hybrid_set& lhs, 
+    const hybrid_set& rhs)
+{
+    hybrid_set_op<SET_OP_UNION>(out, lhs, rhs);
+}
+
+void hybrid_set_intersection(
+    hybrid_set& out, 
+    const hybrid_set& lhs, 
+    const hybrid_set& rhs)
+{
+    hybrid_set_op<SET_OP_INTERSECTION>(out, lhs, rhs);
+}
+
+void hybrid_set_difference(
+    hybrid_set& out, 
+    const hybrid_set& lhs, 
+    const hybrid_set& rhs)
+{
+    hybrid_set_op<SET_OP_DIFFERENCE>(out, lhs, rhs);
+}
+
+struct query_expr_hybrid_scratch
+{
+    std::vector<hybrid_set> hybrid_sets;
+};
+
+static inline void query_expr_set_clear(hybrid_set& out)
+{
+    hybrid_set_clear(out);
+}
+
+static inline void query_expr_set_op(
+    hybrid_set& out, 
+    const int op, 
+    const hybrid_set& lhs, 
+    const hybrid_set& rhs)
+{
+    switch (op)
+    {
+        case QUERY_OP_UNION: hybrid_set_union(out, lhs, rhs); break;
+        case QUERY_OP_INTERSECTION: hybrid_set_intersection(out, lhs, rhs); break;
+        case QUERY_OP_DIFFERENCE: hybrid_set_difference(out, lhs, rhs); break;
+        default: assert(false);
+    }
+}
+
+void query_expr_evaluate_hybrid_set(
+    hybrid_set& out,
+    const query_expr& query, 
+    const std::vector<hybrid_set>& hybrid_sets,
+    query_expr_hybrid_scratch& scratch)
+{ 
+    query_expr_evaluate_set(out, query, hybrid_sets, scratch.hybrid_sets);
+}
+
+//--------------------------------------
+
+// A roaring set stores each anim compressed in the style
+// of a roaring bitmap. The frames of an anim are split
+// into chunks and the set frames of each chunk are kept
+// in one of three containers: a sorted array of frames,
+// a bitmap, or a list of runs, whichever is smallest.
+// Chunks with no frames set have no container at all,
+// so tags which are almost entirely unset cost little
+// more than the frames they do have. Frames are stored
+// relative to the start of their chunk so fit in 16 bits.
+
+enum
+{
+    ROARING_CHUNK = 65536,
+    ROARING_ARRAY = 0,
+    ROARING_BITMAP = 1,
+    ROARING_RUN = 2,
+};
+
+struct roaring_container
+{
+    int chunk;  // Index of the chunk in its anim
+    int type;   // One of ROARING_ARRAY, ROARING_BITMAP or ROARING_RUN
+    int start;  // Start of the container's data in `values` or `words`
+    int size;   // Number of frames, words or runs in the container
+};
+
+struct roaring_set
+{
+    array1d<int>   anims;                   // Sorted ids of all anims with frames in set
+    array1d<int>   anims_frames;            // Number of frames in each anim
+    array1d<range> anims_subcontainers;     // Slices of `containers` for each anim
+    array1d<roaring_container> containers;  // Containers of all non-empty chunks, sorted by chunk within each anim
+    array1d<uint16_t> values;               // Frames of array containers, and the first and last frame of each run of run containers
+    array1d<uint64_t> words;                // Bits of bitmap containers
+};
+
+// Number of frames in chunk `chunk` of an anim
+static inline int roaring_chunk_frames(int nframes, int chunk)
+{
+    return std::min((int)ROARING_CHUNK, nframes - chunk * ROARING_CHUNK);
+}
+
+// Type of the smallest container for `count` frames in
+// `nruns` runs, where a bitmap would take `nwords` words.
+// Runs are preferred on a tie as they are fastest to use.
+static inline int roaring_container_type(int count, int nruns, int nwords)
+{
+    size_t array_size = count * sizeof(uint16_t);
+    size_t run_size = nruns * 2 * sizeof(uint16_t);
+    size_t bitmap_size = nwords * sizeof(uint64_t);
+    
+    if (run_size <= array_size && run_size <= bitmap_size) { return ROARING_RUN; }
+    
+    return array_size <= bitmap_size ? ROARING_ARRAY : ROARING_BITMAP;
+}
+
+// Memory used by the data of a roaring set in bytes
+size_t memory_usage(const roaring_set& set)
+{
+    return
+        set.anims.size * (2 * sizeof(int) + sizeof(range)) +
+        set.containers.size * sizeof(roaring_container) +
+        set.values.size * sizeof(uint16_t) +
+        set.words.size * sizeof(uint64_t);
+}
+
+// Empties a roaring set but keeps its memory for reuse
+void roaring_set_clear(roaring_set& set)
+{
+    set.anims.resize(0);
+    set.anims_frames.resize(0);
+    set.anims_subcontainers.resize(0);
+    set.containers.resize(0);
+    set.values.resize(0);
+    set.words.resize(0);
+}
+
+static inline slice1d_bit roaring_container_mask(
+    const roaring_set& set,
+    const roaring_container& container,
+    int nframes)
+{
+    return slice1d_bit(nframes, 0, (unsigned char*)(set.words.data + container.start));
+}
+
+// Calls `func(start, stop)` for each run of frames in a
+// container of a chunk with `nframes` frames
+template<typename F>
+static inline void roaring_container_runs(
+    const roaring_set& set,
+    const roaring_container& container,
+    int nframes,
+    const F& func)
+{
+    const uint16_t* values = set.values.data + container.start;
+    
+    switch (container.type)
+    {
+        case ROARING_ARRAY:
+        {
+            int start = 0;
+            for (int i = 1; i <= container.size; i++)
+            {
+                if (i == container.size || values[i] != values[i - 1] + 1)
+                {
+                    func((int)values[start], (int)values[i - 1] + 1);
+                    start = i;
+                }
+            }
+            break;
+        }
+        
+        case ROARING_BITMAP:
+            mask_runs(roaring_container_mask(set, container, nframes), func);
+            break;
+        
+        case ROARING_RUN:
+            for (int i = 0; i < container.size; i++)
+            {
+                func((int)values[2 * i + 0], (int)values[2 * i + 1] + 1);
+            }
+            break;
+        
+        default: assert(false);
+    }
+}
+
+// Writes a container of a chunk with `nframes` frames as
+// a bitmap of `(nframes + 63) / 64` words into `out`
+static inline void roaring_container_bitmap(
+    uint64_t* out,
+    const roaring_set& set,
+    const roaring_container& container,
+    int nframes)
+{
+    int nwords = (nframes + 63) / 64;
+    const uint16_t* values = set.values.data + container.start;
+    
+    switch (container.type)
+    {
+        case ROARING_ARRAY:
+            memset(out, 0, nwords * sizeof(uint64_t));
+            for (int i = 0; i < container.size; i++)
+            {
+                out[values[i] / 64] |= 1ull << (values[i] % 64);
+            }
+            break;
+        
+        case ROARING_BITMAP:
+            memcpy(out, set.words.data + container.start, nwords * sizeof(uint64_t));
+            break;
+        
+        case ROARING_RUN:
+            memset(out, 0, nwords * sizeof(uint64_t));
+            for (int i = 0; i < container.size; i++)
+            {
+                bit_fill((unsigned char*)out, values[2 * i + 0], values[2 * i + 1] - values[2 * i + 0] + 1, true);
+            }
+            break;
+        
+        default: assert(false);
+    }
+}
+
+// Appends anims to the end of a roaring set. The frames
+// of each chunk are given as ranges, sorted frames, or a
+// bitmap, and are counted to choose which container to
+// store them in. Also holds the scratch space used when
+// combining containers.
+struct roaring_set_output
+{
+    roaring_set& set;
+    int anims_i;
+    int containers_i;
+    int values_i;
+    int words_i;
+    int anim_start; // First container of the anim being added
+    
+    array1d<uint64_t> lhs_words;
+    array1d<uint64_t> rhs_words;
+    array1d<uint64_t> words;
+    array1d<range> lhs_ranges;
+    array1d<range> rhs_ranges;
+    array1d<range> ranges;
+    array1d<uint16_t> values;
+    
+    roaring_set_output(roaring_set& _set, int max_anims)
+        : set(_set), anims_i(0), containers_i(0), values_i(0), words_i(0), anim_start(0)
+    {
+        set.anims.resize(max_anims);
+        set.anims_frames.resize(max_anims);
+        set.anims_subcontainers.resize(max_anims);
+        set.containers.resize(0);
+        set.values.resize(0);
+        set.words.resize(0);
+    }
+    
+    void push_container(int chunk, int type, int size)
+    {
+        array_reserve(set.containers, containers_i + 1);
+        
+        if (type == ROARING_BITMAP)
+        {
+            set.containers(containers_i++) = { chunk, type, words_i, size };
+            words_i += size;
+        }
+        else
+        {
+            set.containers(containers_i++) = { chunk, type, values_i, size };
+            values_i += type == ROARING_RUN ? 2 * size : size;
+        }
+    }
+    
+    // Adds a chunk with `nframes` frames from its ranges
+    void push_ranges(int chunk, int nframes, const slice1d<range> ranges)
+    {
+        if (ranges.size == 0) { return; }
+        
+        int count = 0;
+        for (int i = 0; i < ranges.size; i++)
+        {
+            count += ranges(i).stop - ranges(i).start;
+        }
+        
+        int nwords = (nframes + 63) / 64;
+        int type = roaring_container_type(count, ranges.size, nwords);
+        
+        if (type == ROARING_RUN)
+        {
+            array_reserve(set.values, values_i + 2 * ranges.size);
+            for (int i = 0; i < ranges.size; i++)
+            {
+                set.values(values_i + 2 * i + 0) = (uint16_t)ranges(i).start;
+                set.values(values_i + 2 * i + 1) = (uint16_t)(ranges(i).stop - 1);
+            }
+            push_container(chunk, type, ranges.size);
+        }
+        else if (type == ROARING_ARRAY)
+        {
+            array_reserve(set.values, values_i + count);
+            int j = values_i;
+            for (int i = 0; i < ranges.size; i++)
+            {
+                for (int f = ranges(i).start; f < ranges(i).stop; f++)
+                {
+                    set.values(j++) = (uint16_t)f;
+                }
+            }
+            push_container(chunk, type, count);
+        }
+        else
+        {
+            array_reserve(set.words, words_i + nwords);
+            ranges_rasterize_words((unsigned char*)(set.words.data + words_i), nframes, ranges);
+            push_container(chunk, type, nwords);
+        }
+    }
+    
+    // Adds a chunk with `nframes` frames from its sorted frames
+    void push_values(int chunk, int nframes, const uint16_t* values, int count)
+    {
+        if (count == 0) { return; }
+        
+        int nruns = 1;
+        for (int i = 1; i < count; i++)
+        {
+            nruns += values[i] != values[i - 1] + 1;
+        }
+        
+        int nwords = (nframes + 63) / 64;
+        int type = roaring_container_type(count, nruns, nwords);
+        
+        if (type == ROARING_ARRAY)
+        {
+            array_reserve(set.values, values_i + count);
+            memcpy(set.values.data + values_i, values, count * sizeof(uint16_t));
+            push_container(chunk, type, count);
+        }
+        else if (type == ROARING_RUN)
+        {
+            array_reserve(set.values, values_i + 2 * nruns);
+            int j = values_i;
+            for (int i = 0; i < count; i++)
+            {
+                if (i == 0 || values[i] != values[i - 1] + 1) { set.values(j++) = values[i]; }
+                if (i == count - 1 || values[i + 1] != values[i] + 1) { set.values(j++) = values[i]; }
+            }
+            push_container(chunk, type, nruns);
+        }
+        else
+        {
+            array_reserve(set.words, words_i + nwords);
+            uint64_t* words = set.words.data + words_i;
+            memset(words, 0, nwords * sizeof(uint64_t));
+            for (int i = 0; i < count; i++)
+            {
+                words[values[i] / 64] |= 1ull << (values[i] % 64);
+            }
+            push_container(chunk, type, nwords);
+        }
+    }
+    
+    // Adds a chunk with `nframes` frames from its bitmap,
+    // with any bits past `nframes` in the last word clear
+    void push_bitmap(int chunk, int nframes, const uint64_t* words)
+    {
+        int nwords = (nframes + 63) / 64;
+        int count = 0;
+        int nruns = 0;
+        uint64_t prev = 0;
+        
+        for (int k = 0; k < nwords; k++)
+        {
+            count += bit_popcount64(words[k]);
+            nruns += bit_popcount64(words[k] & ~((words[k] << 1) | prev));
+            prev = words[k] >> 63;
+        }
+        
+        if (count == 0) { return; }
+        
+        int type = roaring_container_type(count, nruns, nwords);
+        
+        if (type == ROARING_BITMAP)
+        {
+            array_reserve(set.words, words_i + nwords);
+            memcpy(set.words.data + words_i, words, nwords * sizeof(uint64_t));
+            push_container(chunk, type, nwords);
+        }
+        else if (type == ROARING_ARRAY)
+        {
+            array_reserve(set.values, values_i + count);
+            int j = values_i;
+            for (int k = 0; k < nwords; k++)
+            {
+                for (uint64_t w = words[k]; w; w &= w - 1)
+                {
+                    set.values(j++) = (uint16_t)(64 * k + bit_ctz64(w));
+                }
+            }
+            push_container(chunk, type, count);
+        }
+        else
+        {
+            array_reserve(set.values, values_i + 2 * nruns);
+            int j = values_i;
+            mask_runs(slice1d_bit(nframes, 0, (unsigned char*)words), [&](int start, int stop)
+            {
+                set.values(j++) = (uint16_t)start;
+                set.values(j++) = (uint16_t)(stop - 1);
+            });
+            push_container(chunk, type, nruns);
+        }
+    }
+    
+    // Adds a container of `src` unchanged
+    void copy(const roaring_set& src, const roaring_container& container)
+    {
+        if (container.type == ROARING_BITMAP)
+        {
+            array_reserve(set.words, words_i + container.size);
+            memcpy(set.words.data + words_i, src.words.data + container.start, container.size * sizeof(uint64_t));
+        }
+        else
+        {
+            int size = container.type == ROARING_RUN ? 2 * container.size : container.size;
+            array_reserve(set.values, values_i + size);
+            memcpy(set.values.data + values_i, src.values.data + container.start, size * sizeof(uint16_t));
+        }
+        
+        push_container(container.chunk, container.type, container.size);
+    }
+    
+    // Adds an anim from the containers pushed since the
+    // last anim, dropping it if there are none
+    void push_anim(int anim, int nframes)
+    {
+        if (containers_i == anim_start) { return; }
+        
+        set.anims(anims_i) = anim;
+        set.anims_frames(anims_i) = nframes;
+        set.anims_subcontainers(anims_i) = { anim_start, containers_i };
+        anims_i++;
+        anim_start = containers_i;
+    }
+    
+    // Shrinks the set's arrays to what was added
+    void finish()
+    {
+        set.anims.resize(anims_i);
+        set.anims_frames.resize(anims_i);
+        set.anims_subcontainers.resize(anims_i);
+        set.containers.resize(containers_i);
+        set.values.resize(values_i);
+        set.words.resize(words_i);
+    }
+};
+
+// Converts a range set into a roaring set, taking the
+// number of frames in each anim from `set_all`
+void range_set_compress(
+    roaring_set& out,
+    const range_set& set,
+    const range_set& set_all)
+{
+    roaring_set_output output(out, set.anims.size);
+    
+    for (int i = 0; i < set.anims.size; i++)
+    {
+        slice1d<range> ranges = set.ranges.slice(set.anims_subranges(i));
+        range all = set_all.ranges(set.anims(i));
+        int nframes = all.stop - all.start;
+        
+        int chunk = 0;
+        int n = 0;
+        
+        for (int j = 0; j < ranges.size; j++)
+        {
+            // Ranges crossing the end of a chunk are split 
+            // into a part for each chunk they cover
+            for (int start = ranges(j).start; start < ranges(j).stop;)
+            {
+                if (start / ROARING_CHUNK != chunk)
+                {
+                    output.push_ranges(chunk, roaring_chunk_frames(nframes, chunk), output.ranges.slice(0, n));
+                    chunk = start / ROARING_CHUNK;
+                    n = 0;
+                }
+                
+                int offset = chunk * ROARING_CHUNK;
+                int stop = std::min(ranges(j).stop, offset + ROARING_CHUNK);
+                
+                array_reserve(output.ranges, n + 1);
+                output.ranges(n++) = { start - offset, stop - offset };
+                start = stop;
+            }
+        }
+        
+        output.push_ranges(chunk, roaring_chunk_frames(nframes, chunk), output.ranges.slice(0, n));
+        output.push_anim(set.anims(i), nframes);
+    }
+    
+    output.finish();
+}
+
+// Converts a roaring set back into a range set
+void roaring_set_vectorize(
+    range_set& out,
+    const roaring_set& set)
+{
+    out.anims = set.anims;
+    out.anims_subranges.resize(set.anims.size);
+    out.ranges.resize(0);
+    
+    int ranges_i = 0;
+    
+    for (int i = 0; i < set.anims.size; i++)
+    {
+        int ranges_start = ranges_i;
+        
+        for (int j = set.anims_subcontainers(i).start; j < set.anims_subcontainers(i).stop; j++)
+        {
+            const roaring_container& container = set.containers(j);
+            int offset = container.chunk * ROARING_CHUNK;
+            
+            roaring_container_runs(set, container, roaring_chunk_frames(set.anims_frames(i), container.chunk), [&](int start, int stop)
+            {
+                // Runs which meet at the end of a chunk are 
+                // joined back together
+                if (ranges_i > ranges_start && out.ranges(ranges_i - 1).stop == offset + start)
+                {
+                    out.ranges(ranges_i - 1).stop = offset + stop;
+                }
+                else
+                {
+                    array_reserve(out.ranges, ranges_i + 1);
+                    out.ranges(ranges_i++) = { offset + start, offset + stop };
+                }
+            });
+        }
+        
+        out.anims_subranges(i) = { ranges_start, ranges_i };
+    }
+    
+    out.ranges.resize(ranges_i);
+}
+
+// Converts a mask set into a roaring set, taking the 
+// number of frames in each anim from its submask
+void mask_set_compress(
+    roaring_set& out,
+    const mask_set& set)
+{
+    roaring_set_output output(out, set.anims.size);
+    
+    for (int i = 0; i < set.anims.size; i++)
+    {
+        slice1d_bit mask = set.masks.slice(set.anims_submasks(i));
+        
+        for (int chunk = 0; chunk * ROARING_CHUNK < mask.size; chunk++)
+        {
+            int nframes = roaring_chunk_frames(mask.size, chunk);
+            int nwords = (nframes + 63) / 64;
+            
+            array_reserve(output.lhs_words, nwords);
+            
+            for (int k = 0; k < nwords; k++)
+            {
+                int n = std::min(64, nframes - 64 * k);
+                int bit = mask.offset + chunk * ROARING_CHUNK + 64 * k;
+                output.lhs_words(k) = n == 64 ? 
+                    bit_load64(mask.data, bit) :
+                    bit_load64(mask.data, bit, n);
+            }
+            
+            output.push_bitmap(chunk, nframes, output.lhs_words.data);
+        }
+        
+        output.push_anim(set.anims(i), mask.size);
+    }
+    
+    output.finish();
+}
+
+// Converts a roaring set into a mask set
+void roaring_set_rasterize(
+    mask_set& out,
+    const roaring_set& set)
+{
+    out.anims = set.anims;
+    out.anims_submasks.resize(set.anims.size);
+    
+    int total = 0;
+    for (int i = 0; i < set.anims.size; i++)
+    {
+        out.anims_submasks(i) = { total, total + set.anims_frames(i) };
+        total = mask_set_align(total + set.anims_frames(i));
+    }
+    
+    out.masks.resize(total);
+    
+    for (int i = 0; i < set.anims.size; i++)
+    {
+        // Submasks and chunks both start on a word boundary
+        // and are padded to whole words
+        uint64_t* words = (uint64_t*)out.masks.data + out.anims_submasks(i).start / 64;
+        memset(words, 0, (mask_set_align(set.anims_frames(i)) / 64) * sizeof(uint64_t));
+        
+        for (int j = set.anims_subcontainers(i).start; j < set.anims_subcontainers(i).stop; j++)
+        {
+            const roaring_container& container = set.containers(j);
+            
+            roaring_container_bitmap(
+                words + container.chunk * (ROARING_CHUNK / 64),
+                set,
+                container,
+                roaring_chunk_frames(set.anims_frames(i), container.chunk));
+        }
+    }
+}
+
+// Merges two sorted lists of frames, returning the number
+// of frames written to `out`
+template<int op>
+static int roaring_values_merge(
+    uint16_t* out,
+    const uint16_t* lhs,
+    int lhs_size,
+    const uint16_t* rhs,
+    int rhs_size)
+{
+    int lhs_i = 0;
+    int rhs_i = 0;
+    int out_i = 0;
+    
+    while (lhs_i < lhs_size && rhs_i < rhs_size)
+    {
+        if (lhs[lhs_i] < rhs[rhs_i])
+        {
+            if (set_op<op>(true, false)) { out[out_i++] = lhs[lhs_i]; }
+            lhs_i++;
+        }
+        else if (rhs[rhs_i] < lhs[lhs_i])
+        {
+            if (set_op<op>(false, true)) { out[out_i++] = rhs[rhs_i]; }
+            rhs_i++;
+        }
+        else
+        {
+            if (set_op<op>(true, true)) { out[out_i++] = lhs[lhs_i]; }
+            lhs_i++; rhs_i++;
+        }
+    }
+    
+    if (set_op<op>(true, false))
+    {
+        for (; lhs_i < lhs_size; lhs_i++) { out[out_i++] = lhs[lhs_i]; }
+    }
+    
+    if (set_op<op>(false, true))
+    {
+        for (; rhs_i < rhs_size; rhs_i++) { out[out_i++] = rhs[rhs_i]; }
+    }
+    
+    return out_i;
+}
+
+// Bits of a container, which are read in place from a
+// bitmap container and otherwise written to `scratch`
+static inline const uint64_t* roaring_container_words(
+    array1d<uint64_t>& scratch,
+    const roaring_set& set,
+    const roaring_container& container,
+    int nframes)
+{
+    if (container.type == ROARING_BITMAP)
+    {
+        return set.words.data + container.start;
+    }
+    
+    array_reserve(scratch, (nframes + 63) / 64);
+    roaring_container_bitmap(scratch.data, set, container, nframes);
+    return scratch.data;
+}
+
+// Collects the runs of a container as ranges in `out`
+static inline slice1d<range> roaring_container_ranges(
+    array1d<range>& out,
+    const roaring_set& set,
+    const roaring_container& container,
+    int nframes)
+{
+    int n = 0;
+    
+    roaring_container_runs(set, container, nframes, [&](int start, int stop)
+    {
+        array_reserve(out, n + 1);
+        out(n++) = { start, stop };
+    });
+    
+    return out.slice(0, n);
+}
+
+// Applies `op` to two containers of the same chunk with
+// `nframes` frames. Two arrays are merged as sorted lists
+// and two lists of runs with the range kernels. When the
+// result can only hold frames of an array on the left, as
+// in intersections and differences, each frame of the 
+// array is looked up in a bitmap of the other container. 
+// Otherwise both are combined as bitmaps a word at a time.
+template<int op>
+static void roaring_container_op(
+    roaring_set_output& out,
+    int nframes,
+    const roaring_set& lhs,
+    const roaring_container& lhs_container,
+    const roaring_set& rhs,
+    const roaring_container& rhs_container)
+{
+    assert(lhs_container.chunk == rhs_container.chunk);
+    
+    int chunk = lhs_container.chunk;
+    int nwords = (nframes + 63) / 64;
+    
+    if (lhs_container.type == ROARING_ARRAY && rhs_container.type == ROARING_ARRAY)
+    {
+        array_reserve(out.values, lhs_container.size + rhs_container.size);
+        
+        int count = roaring_values_merge<op>(
+            out.values.data,
+            lhs.values.data + lhs_container.start, lhs_container.size,
+            rhs.values.data + rhs_container.start, rhs_container.size);
+        
+        out.push_values(chunk, nframes, out.values.data, count);
+        return;
+    }
+    
+    if (lhs_container.type == ROARING_RUN && rhs_container.type == ROARING_RUN)
+    {
+        slice1d<range> lhs_ranges = roaring_container_ranges(out.lhs_ranges, lhs, lhs_container, nframes);
+        slice1d<range> rhs_ranges = roaring_container_ranges(out.rhs_ranges, rhs, rhs_container, nframes);
+        
+        array_reserve(out.ranges, lhs_ranges.size + rhs_ranges.size);
+        
+        int count = ranges_merge<op>(
+            out.ranges.slice(0, lhs_ranges.size + rhs_ranges.size), lhs_ranges, rhs_ranges);
+        
+        out.push_ranges(chunk, nframes, out.ranges.slice(0, count));
+        return;
+    }
+    
+    const uint64_t* rhs_words = roaring_container_words(out.rhs_words, rhs, rhs_container, nframes);
+    
+    if (op != SET_OP_UNION && lhs_container.type == ROARING_ARRAY)
+    {
+        const uint16_t* values = lhs.values.data + lhs_container.start;
+        int count = 0;
+        
+        array_reserve(out.values, lhs_container.size);
+        
+        for (int i = 0; i < lhs_container.size; i++)
+        {
+            bool active = (rhs_words[values[i] / 64] >> (values[i] % 64)) & 1;
+            
+            if (set_op<op>(true, active)) { out.values(count++) = values[i]; }
+        }
+        
+        out.push_values(chunk, nframes, out.values.data, count);
+        return;
+    }
+    
+    const uint64_t* lhs_words = roaring_container_words(out.lhs_words, lhs, lhs_container, nframes);
+    
+    array_reserve(out.words, nwords);
+    
+    for (int k = 0; k < nwords; k++)
+    {
+        out.words(k) = set_op<op>(lhs_words[k], rhs_words[k]);
+    }
+    
+    out.push_bitmap(chunk, nframes, out.words.data);
+}
+
+// Applies `op` to an anim which is in both sets, chunk by
+// chunk. Chunks with a container in only one set are 
+// copied if they are kept by the op.
+template<int op>
+static void roaring_set_op_anim(
+    roaring_set_output& out,
+    const roaring_set& lhs,
+    int lhs_i,
+    const roaring_set& rhs,
+    int rhs_i)
+{
+    int anim = lhs.anims(lhs_i);
+    int nframes = lhs.anims_frames(lhs_i);
+    assert(nframes == rhs.anims_frames(rhs_i));
+    
+    int lhs_j = lhs.anims_subcontainers(lhs_i).start;
+    int rhs_j = rhs.anims_subcontainers(rhs_i).start;
+    int lhs_end = lhs.anims_subcontainers(lhs_i).stop;
+    int rhs_end = rhs.anims_subcontainers(rhs_i).stop;
+    
+    while (lhs_j < lhs_end && rhs_j < rhs_end)
+    {
+        const roaring_container& lhs_container = lhs.containers(lhs_j);
+        const roaring_container& rhs_container = rhs.containers(rhs_j);
+        
+        if (lhs_container.chunk < rhs_container.chunk)
+        {
+            if (set_op<op>(true, false)) { out.copy(lhs, lhs_container); }
+            lhs_j++;
+        }
+        else if (rhs_container.chunk < lhs_container.chunk)
+        {
+            if (set_op<op>(false, true)) { out.copy(rhs, rhs_container); }
+            rhs_j++;
+        }
+        else
+        {
+            roaring_container_op<op>(
+                out, roaring_chunk_frames(nframes, lhs_container.chunk),
+                lhs, lhs_container, rhs, rhs_container);
+            lhs_j++; rhs_j++;
+        }
+    }
+    
+    if (set_op<op>(true, false))
+    {
+        for (; lhs_j < lhs_end; lhs_j++) { out.copy(lhs, lhs.containers(lhs_j)); }
+    }
+    
+    if (set_op<op>(false, true))
+    {
+        for (; rhs_j < rhs_end; rhs_j++) { out.copy(rhs, rhs.containers(rhs_j)); }
+    }
+    
+    out.push_anim(anim, nframes);
+}
+
+// Adds anim `i` of `src` unchanged
+static inline void roaring_set_copy_anim(
+    roaring_set_output& out,
+    const roaring_set& src,
+    int i)
+{
+    for (int j = src.anims_subcontainers(i).start; j < src.anims_subcontainers(i).stop; j++)
+    {
+        out.copy(src, src.containers(j));
+    }
+    
+    out.push_anim(src.anims(i), src.anims_frames(i));
+}
+
+template<int op>
+static void roaring_set_op(
+    roaring_set& out, 
+    const roaring_set& lhs, 
+    const roaring_set& rhs)
+{
+    roaring_set_output output(out, lhs.anims.size + rhs.anims.size);
+    
+    int lhs_i = 0;
+    int rhs_i = 0;
+    
+    while (lhs_i < lhs.anims.size && rhs_i < rhs.anims.size)
+    {
+        if (lhs.anims(lhs_i) < rhs.anims(rhs_i))
+        {
+            if (set_op<op>(true, false))
+            {
+                roaring_set_copy_anim(output, lhs, lhs_i++);
+            }
+            else
+            {
+                lhs_i = anims_gallop(lhs.anims, lhs_i, rhs.anims(rhs_i));
+            }
+        }
+        else if (rhs.anims(rhs_i) < lhs.anims(lhs_i))
+        {
+            if (set_op<op>(false, true))
+            {
+                roaring_set_copy_anim(output, rhs, rhs_i++);
+            }
+            else
+            {
+                rhs_i = anims_gallop(rhs.anims, rhs_i, lhs.anims(lhs_i));
+            }
+        }
+        else
+        {
+            roaring_set_op_anim<op>(output, lhs, lhs_i, rhs, rhs_i);
+            lhs_i++; rhs_i++;
+        }
+    }
+    
+    if (set_op<op>(true, false))
+    {
+        for (; lhs_i < lhs.anims.size; lhs_i++) { roaring_set_copy_anim(output, lhs, lhs_i); }
+    }
+    
+    if (set_op<op>(false, true))
+    {
+        for (; rhs_i < rhs.anims.size; rhs_i++) { roaring_set_copy_anim(output, rhs, rhs_i); }
+    }
+    
+    output.finish();
+}
+
+void roaring_set_union(
+    roaring_set& out, 
+    const roaring_set& lhs, 
+    const roaring_set& rhs)
+{
+    roaring_set_op<SET_OP_UNION>(out, lhs, rhs);
+}
+
+void roaring_set_intersection(
+    roaring_set& out, 
+    const roaring_set& lhs, 
+    const roaring_set& rhs)
+{
+    roaring_set_op<SET_OP_INTERSECTION>(out, lhs, rhs);
+}
+
+void roaring_set_difference(
+    roaring_set& out, 
+    const roaring_set& lhs, 
+    const roaring_set& rhs)
+{
+    roaring_set_op<SET_OP_DIFFERENCE>(out, lhs, rhs);
+}
+
+struct query_expr_roaring_scratch
+{
+    std::vector<roaring_set> roaring_sets;
+};
+
+static inline void query_expr_set_clear(roaring_set& out)
+{
+    roaring_set_clear(out);
+}
+
+static inline void query_expr_set_op(
+    roaring_set& out, 
+    const int op, 
+    const roaring_set& lhs, 
+    const roaring_set& rhs)
+{
+    switch (op)
+    {
+        case QUERY_OP_UNION: roaring_set_union(out, lhs, rhs); break;
+        case QUERY_OP_INTERSECTION: roaring_set_intersection(out, lhs, rhs); break;
+        case QUERY_OP_DIFFERENCE: roaring_set_difference(out, lhs, rhs); break;
+        default: assert(false);
+    }
+}
+
+void query_expr_evaluate_roaring_set(
+    roaring_set& out,
+    const query_expr& query, 
+    const std::vector<roaring_set>& roaring_sets,
+    query_expr_roaring_scratch& scratch)
+{ 
+    query_expr_evaluate_set(out, query, roaring_sets, scratch.roaring_sets);
+}
+
+//--------------------------------------
+
+// A tag frame index answers which tags are active on a 
+// given frame of an anim without going through every tag.
+// The frames of each anim are split at the start and stop
+// of every range of every tag into intervals over which 
+// the active tags do not change, and the bitset of the 
+// tags active over each interval is stored. Looking up a
+// frame is then a binary search over the anims followed 
+// by one over the starts of the intervals of that anim. 
+// The index is read only and must be rebuilt when any 
+// tag changes.
+//
+// There are up to two intervals for every range of every
+// tag, each with a start and a bitset, so the index is 
+// usually larger than the range sets it is built from. 
+// This is the cost of answering for all tags in a single 
+// lookup. To keep it down each distinct bitset is stored
+// once, with intervals holding its position. Tags usually
+// occur in a limited number of combinations so this saves
+// most of the bitsets, but where every interval has its 
+// own combination it adds an int per interval.
+//
+// Building the index is also not cheap, as the starts of 
+// every anim are sorted and each interval's bitset is 
+// hashed. For 20000 anims with 9 tags made of short 
+// ranges it takes close to a second and around 1.5 times
+// the memory of the range sets, which is why nothing 
+// builds it up front. It is meant to be built once, when
+// a database is loaded and lookups by frame are needed, 
+// rather than whenever tags are edited.
+
+struct tag_frame_index
+{
+    int ntags;
+    int nwords;                         // Words in each bitset
+    array1d<int>   anims;               // Sorted ids of all anims with any tag active
+    array1d<range> anims_subintervals;  // Slices of `starts` for each anim
+    array1d<int>   starts;              // First frame of each interval
+    array1d<int>   intervals_tags;      // Bitset in `tags` of each interval
+    array1d<uint64_t> tags;             // Distinct bitsets of tags, the first of which is empty
+};
+
+// Memory used by the data of a tag frame index in bytes
+size_t memory_usage(const tag_frame_index& index)
+{
+    return
+        index.anims.size * (sizeof(int) + sizeof(range)) +
+        index.starts.size * sizeof(int) +
+        index.intervals_tags.size * sizeof(int) +
+        index.tags.size * sizeof(uint64_t);
+}
+
+static inline uint64_t tag_frame_index_hash(const uint64_t* bits, int nwords)
+{
+    uint64_t hash = 0x7A99ED;
+    for (int w = 0; w < nwords; w++)
+    {
+        hash = query_stack_hash_mix(hash, bits[w]);
+    }
+    return hash ^ (hash >> 33);
+}
+
+// Position in `index.tags` of the bitset `bits`, adding
+// it if it is not there yet. `slots` is an open 
+// addressing hash table of the positions of the `count`
+// bitsets added so far, -1 if empty.
+static int tag_frame_index_bitset(
+    tag_frame_index& index,
+    std::vector<int>& slots,
+    int& count,
+    const uint64_t* bits)
+{
+    int nwords = index.nwords;
+    uint32_t mask = (uint32_t)slots.size() - 1;
+    uint32_t s = (uint32_t)tag_frame_index_hash(bits, nwords) & mask;
+    
+    for (; slots[s] != -1; s = (s + 1) & mask)
+    {
+        if (memcmp(index.tags.data + slots[s] * nwords, bits, nwords * sizeof(uint64_t)) == 0)
+        {
+            return slots[s];
+        }
+    }
+    
+    int bitset = count++;
+    array_reserve(index.tags, count * nwords);
+    memcpy(index.tags.data + bitset * nwords, bits, nwords * sizeof(uint64_t));
+    slots[s] = bitset;
+    
+    // Keep the table at most half full so probe 
+    // sequences stay short
+    if (2 * count > (int)slots.size())
+    {
+        slots.assign(2 * slots.size(), -1);
+        mask = (uint32_t)slots.size() - 1;
+        
+        for (int i = 0; i < count; i++)
+        {
+            s = (uint32_t)tag_frame_index_hash(index.tags.data + i * nwords, nwords) & mask;
+            while (slots[s] != -1) { s = (s + 1) & mask; }
+            slots[s] = i;
+        }
+    }
+    
+    return bitset;
+}
+
+// Builds an index over the range sets of all tags, where
+// the set of tag `i` is `sets[i]`
+void tag_frame_index_build(
+    tag_frame_index& index,
+    const std::vector<range_set>& sets)
+{
+    int ntags = (int)sets.size();
+    int nwords = (ntags + 63) / 64;
+    
+    index.ntags = ntags;
+    index.nwords = nwords;
+    
+    // Position of each tag in its set's anims. Anims are 
+    // sorted in every set so each only moves forward.
+    array1d<int> tags_i(ntags);
+    tags_i.zero();
+    
+    // Next anim of each tag which has any left, ordered 
+    // so the smallest anim is on top
+    std::vector<std::pair<int, int>> heap;
+    auto heap_cmp = std::greater<std::pair<int, int>>();
+    
+    for (int t = 0; t < ntags; t++)
+    {
+        if (sets[t].anims.size > 0) { heap.push_back({ sets[t].anims(0), t }); }
+    }
+    
+    std::make_heap(heap.begin(), heap.end(), heap_cmp);
+    
+    // Tags active in the current anim, and the bitsets of
+    // its intervals before they are deduplicated
+    std::vector<int> anim_tags;
+    array1d<uint64_t> bits;
+    
+    std::vector<int> slots(16, -1);
+    int nbitsets = 0;
+    
+    int anims_i = 0;
+    int starts_i = 0;
+    
+    index.anims.resize(0);
+    index.anims_subintervals.resize(0);
+    index.starts.resize(0);
+    index.intervals_tags.resize(0);
+    index.tags.resize(0);
+    
+    bits.resize(nwords);
+    bits.zero();
+    tag_frame_index_bitset(index, slots, nbitsets, bits.data);
+    
+    while (!heap.empty())
+    {
+        // Next anim with any tag active, and every tag 
+        // which has it
+        int anim = heap.front().first;
+        anim_tags.clear();
+        
+        while (!heap.empty() && heap.front().first == anim)
+        {
+            anim_tags.push_back(heap.front().second);
+            std::pop_heap(heap.begin(), heap.end(), heap_cmp);
+            heap.pop_back();
+        }
+        
+        // Every start and stop is the start of an interval
+        int starts_start = starts_i;
+        
+        for (int t : anim_tags)
+        {
+            slice1d<range> ranges = sets[t].ranges.slice(sets[t].anims_subranges(tags_i(t)));
+            array_reserve(index.starts, starts_i + 2 * ranges.size);
+            
+            for (int i = 0; i < ranges.size; i++)
+            {
+                index.starts(starts_i++) = ranges(i).start;
+                index.starts(starts_i++) = ranges(i).stop;
+            }
+        }
+        
+        int* begin = index.starts.data + starts_start;
+        std::sort(begin, index.starts.data + starts_i);
+        starts_i = (int)(std::unique(begin, index.starts.data + starts_i) - index.starts.data);
+        begin = index.starts.data + starts_start;
+        
+        int nintervals = starts_i - starts_start;
+        
+        array_reserve(bits, nintervals * nwords);
+        memset(bits.data, 0, nintervals * nwords * sizeof(uint64_t));
+        
+        // Set the bit of each tag in the intervals its 
+        // ranges cover. As the ranges are sorted each 
+        // search only needs to look past the last one.
+        for (int t : anim_tags)
+        {
+            slice1d<range> ranges = sets[t].ranges.slice(sets[t].anims_subranges(tags_i(t)));
+            int* it = begin;
+            
+            for (int i = 0; i < ranges.size; i++)
+            {
+                it = std::lower_bound(it, begin + nintervals, ranges(i).start);
+                
+                for (; *it < ranges(i).stop; it++)
+                {
+                    bits((int)(it - begin) * nwords + t / 64) |= 1ull << (t % 64);
+                }
+            }
+            
+            tags_i(t)++;
+            
+            if (tags_i(t) < sets[t].anims.size)
+            {
+                heap.push_back({ sets[t].anims(tags_i(t)), t });
+                std::push_heap(heap.begin(), heap.end(), heap_cmp);
+            }
+        }
+        
+        array_reserve(index.intervals_tags, starts_i);
+        for (int i = 0; i < nintervals; i++)
+        {
+            index.intervals_tags(starts_start + i) = tag_frame_index_bitset(index, slots, nbitsets, bits.data + i * nwords);
+        }
+        
+        array_reserve(index.anims, anims_i + 1);
+        array_reserve(index.anims_subintervals, anims_i + 1);
+        index.anims(anims_i) = anim;
+        index.anims_subintervals(anims_i) = { starts_start, starts_i };
+        anims_i++;
+    }
+    
+    index.anims.resize(anims_i);
+    index.anims_subintervals.resize(anims_i);
+    index.starts.resize(starts_i);
+    index.intervals_tags.resize(starts_i);
+    index.tags.resize(nbitsets * nwords);
+}
+
+// Index in `index.starts` of the interval containing 
+// `frame` of `anim`, or -1 if no tag is active on it
+int tag_frame_index_find(const tag_frame_index& index, int anim, int frame)
+{
+    const int* a = std::lower_bound(index.anims.data, index.anims.data + index.anims.size, anim);
+    if (a == index.anims.data + index.anims.size || *a != anim) { return -1; }
+    
+    range intervals = index.anims_subintervals((int)(a - index.anims.data));
+    const int* begin = index.starts.data + intervals.start;
+    const int* end = index.starts.data + intervals.stop;
+    
+    // The last interval of each anim is after every range
+    // and so always empty
+    int i = (int)(std::upper_bound(begin, end, frame) - begin) - 1;
+    return i >= 0 && i < intervals.stop - intervals.start - 1 ? intervals.start + i : -1;
+}
+
+// Bitset of `index.nwords` words of the tags active over
+// the interval `i`, or an empty bitset if `i` is -1
+static inline const uint64_t* tag_frame_index_interval_tags(const tag_frame_index& index, int i)
+{
+    return index.tags.data + (i >= 0 ? index.intervals_tags(i) : 0) * index.nwords;
+}
+
+// Bitset of `index.nwords` words of the tags active on 
+// `frame` of `anim`
+const uint64_t* tag_frame_index_tags(const tag_frame_index& index, int anim, int frame)
+{
+    return tag_frame_index_interval_tags(index, tag_frame_index_find(index, anim, frame));
+}
+
+// If tag `tag` is active on `frame` of `anim`
+bool tag_frame_index_active(const tag_frame_index& index, int anim, int frame, int tag)
+{
+    return (tag_frame_index_tags(index, anim, frame)[tag / 64] >> (tag % 64)) & 1;
+}
+
+// Calls `func(frames, tags)` for each interval of `anim` 
+// which overlaps `frames`, with the interval clipped to 
+// `frames` and `tags` the bitset of tags active over it.
+// Gaps between the ranges of tags inside `frames` are 
+// included with an empty bitset.
+template<typename F>
+void tag_frame_index_overlapping(const tag_frame_index& index, int anim, range frames, const F& func)
+{
+    const int* a = std::lower_bound(index.anims.data, index.anims.data + index.anims.size, anim);
+    if (a == index.anims.data + index.anims.size || *a != anim) { return; }
+    
+    range intervals = index.anims_subintervals((int)(a - index.anims.data));
+    const int* begin = index.starts.data + intervals.start;
+    const int* end = index.starts.data + intervals.stop;
+    
+    int i = std::max((int)(std::upper_bound(begin, end, frames.start) - begin) - 1, 0);
+    
+    for (; i < intervals.stop - intervals.start - 1 && begin[i] < frames.stop; i++)
+    {
+        range r = { std::max(begin[i], frames.start), std::min(begin[i + 1], frames.stop) };
+        
+        if (r.start < r.stop)
+        {
+            func(r, tag_frame_index_interval_tags(index, intervals.start + i));
+        }
+    }
+}
+
+//--------------------------------------
+
+// Tag names are interned into a dictionary which gives 
+// each name an index, matching the index of the tag's 
+// set, and looks names up in constant time using an open
+// addressing hash table. Names are all stored null 
+// terminated in one buffer so lookups can be done 
+// directly on a pointer and size without allocating. A 
+// repeated name still takes up an index, so the indices
+// of the names after it match their sets, but lookups 
+// find the first entry with that name.
+
+struct tag_dictionary
+{
+    std::vector<char> chars;    // Every name, null terminated
+    std::vector<int> offsets;   // Start of each name in `chars`
+    std::vector<int> slots;     // Hash table of indices, -1 if empty
+};
+
+static inline uint32_t tag_dictionary_hash(const char* name, int size)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < size; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+int tag_dictionary_size(const tag_dictionary& tags)
+{
+    return (int)tags.offsets.size();
+}
+
+const char* tag_dictionary_name(const tag_dictionary& tags, int index)
+{
+    return tags.chars.data() + tags.offsets[index];
+}
+
+// Index of the name of `size` chars starting at `name`, 
+// or -1 if it is not in the dictionary
+int tag_dictionary_find(const tag_dictionary& tags, const char* name, int size)
+{
+    if (tags.slots.empty()) { return -1; }
+    
+    uint32_t mask = (uint32_t)tags.slots.size() - 1;
+    
+    for (uint32_t s = tag_dictionary_hash(name, size) & mask;; s = (s + 1) & mask)
+    {
+        int index = tags.slots[s];
+        
+        if (index == -1) { return -1; }
+        
+        const char* other = tag_dictionary_name(tags, index);
+        
+        if (strncmp(other, name, size) == 0 && other[size] == '\0')
+        {
+            return index;
+        }
+    }
+}
+
+int tag_dictionary_find(const tag_dictionary& tags, const char* name)
+{
+    return tag_dictionary_find(tags, name, (int)strlen(name));
+}
+
+static void tag_dictionary_insert(tag_dictionary& tags, int index)
+{
+    const char* name = tag_dictionary_name(tags, index);
+    uint32_t mask = (uint32_t)tags.slots.size() - 1;
+    uint32_t s = tag_dictionary_hash(name, (int)strlen(name)) & mask;
+    
+    while (tags.slots[s] != -1) { s = (s + 1) & mask; }
+    
+    tags.slots[s] = index;
+}
+
+// Adds a name to the end of the dictionary, returning
+// its index. It is only added to the hash table if the
+// name is not already in the dictionary.
+static int tag_dictionary_push(tag_dictionary& tags, const char* name, int size)
+{
+    int index = tag_dictionary_size(tags);
+    tags.offsets.push_back((int)tags.chars.size());
+    tags.chars.insert(tags.chars.end(), name, name + size);
+    tags.chars.push_back('\0');
+    
+    // Keep the table at most half full so probe 
+    // sequences stay short
+    if (2 * (index + 1) > (int)tags.slots.size())
+    {
+        tags.slots.assign(std::max(16, 2 * (int)tags.slots.size()), -1);
+        
+        for (int i = 0; i <= index; i++)
+        {
+            if (tag_dictionary_find(tags, tag_dictionary_name(tags, i)) == -1)
+            {
+                tag_dictionary_insert(tags, i);
+            }
+        }
+    }
+    else if (tag_dictionary_find(tags, name, size) == -1)
+    {
+        tag_dictionary_insert(tags, index);
+    }
+    
+    return index;
+}
+
+// Interns a name, returning the index of the existing
+// entry if there is one or otherwise adding it to the 
+// end of the dictionary
+int tag_dictionary_add(tag_dictionary& tags, const char* name, int size)
+{
+    int index = tag_dictionary_find(tags, name, size);
+    if (index != -1) { return index; }
+    
+    return tag_dictionary_push(tags, name, size);
+}
+
+int tag_dictionary_add(tag_dictionary& tags, const std::string& name)
+{
+    return tag_dictionary_add(tags, name.data(), (int)name.size());
+}
+
+// Builds a dictionary from a list of names so that each 
+// gets the same index it has in the list. A repeated 
+// name is looked up as its first position in the list.
+void tag_dictionary_build(tag_dictionary& tags, const std::vector<std::string>& tag_names)
+{
+    tags = tag_dictionary();
+    
+    for (const std::string& name : tag_names)
+    {
+        tag_dictionary_push(tags, name.data(), (int)name.size());
+    }
+}
+
+//--------------------------------------
+
+// The below are some quick and messy
+// functions for parsing the user input 
+// string. Essentially they either move 
+// the input pointer `i` forward and 
+// return a expression in `query` or 
+// they return an error in `err`
+
+void query_expr_parse_union(
+  int& i, 
+  query_expr& query,
+  char* err,
+  const tag_dictionary& tags, 
+  const char* query_string);
+
+void query_expr_parse_identifier(
+  int& i, 
+  query_expr& query,
+  char* err,
+  const tag_dictionary& tags, 
+  const char* query_string)
+{
+    int start = i;
+    
+    while (isalnum(query_string[i])) { i++; }
+    
+    int index = tag_dictionary_find(tags, query_string + start, i - start);
+    
+    if (index != -1)
+    {
+        query = query_expr(index);
+        return;
+    }
+    else
+    {
+        sprintf(err, "Unknown tag name: \"%.*s\"\n", std::min(i - start, 256), query_string + start);
+        return;
+    }
+}
+
+void query_expr_parse_expression(
+    int& i, 
+    query_expr& query,
+    char* err,
+    const tag_dictionary& tags, 
+    const char* query_string)
+{
+    while (isspace(query_string[i])) { i++; }
+    
+    if (query_string[i] == '(')
+    {
+        i++;
+        
+        query_expr_parse_union(
+            i,
+            query,
+            err,
+            tags,
+            query_string);
+            
+        if (strlen(err)) { return; }
+        
+        while (isspace(query_string[i])) { i++; }
+        
+        if (query_string[i] != ')')
+        {
+            sprintf(err, "Unmatched parenthesis\n");
+            return;
+        }
+        
+        i++;
+        
+        return;
+    }
+    else if (isalnum(query_string[i]))
+    {
+        query_expr_parse_identifier(
+            i, query, err, tags, query_string);
+        return;
+    }
+    else if (query_string[i] == '\0')
+    {
+        sprintf(err, "Unexpected end of input\n");
+        return;
+    }
+    else
+    {
+        sprintf(err, "Syntax Error at '%c'\n", query_string[i]);
+        return;
+    }
+}
+
+void query_expr_parse_difference(
+  int& i, 
+  query_expr& query,
+  char* err,
+  const tag_dictionary& tags, 
+  const char* query_string)
+{
+    query_expr_parse_expression(
+      i,
+      query,
+      err,
+      tags,
+      query_string);
+    
+    if (strlen(err)) { return; }
+    
+    while (isspace(query_string[i])) { i++; }
+    
+    while (query_string[i] == '-')
+    {   
+        i++;
+        
+        query_expr expr;
+        
+        query_expr_parse_expression(
+          i,
+          expr,
+          err,
+          tags,
+          query_string);
+        
+        if (strlen(err)) { return; }
+        
+        query = query - expr;
+      
+        while (isspace(query_string[i])) { i++; }
+    }
+}
+
+void query_expr_parse_intersection(
+  int& i, 
+  query_expr& query,
+  char* err,
+  const tag_dictionary& tags, 
+  const char* query_string)
+{
+    query_expr_parse_difference(
+      i,
+      query,
+      err,
+      tags,
+      query_string);
+  
+    if (strlen(err)) { return; }
+    
+    while (isspace(query_string[i])) { i++; }
+    
+    while (query_string[i] == '&')
+    {
+        i++;
+        
+        query_expr diff;
+        
+        query_expr_parse_difference(
+          i,
+          diff,
+          err,
+          tags,
+          query_string);
+        
+        if (strlen(err)) { return; }
+        
+        query = query & diff;
+        
+        while (isspace(query_string[i])) { i++; }
+    }
+}
+
+void query_expr_parse_union(
+  int& i, 
+  query_expr& query,
+  char* err,
+  const tag_dictionary& tags, 
+  const char* query_string)
+{
+    query_expr_parse_intersection(
+      i,
+      query,
+      err,
+      tags,
+      query_string);
+  
+    if (strlen(err)) { return; }
+    
+    while (isspace(query_string[i])) { i++; }
+    
+    while (query_string[i] == '|')
+    {   
+        i++;
+  
+        query_expr inter;
+        
+        query_expr_parse_intersection(
+          i,
+          inter,
+          err,
+          tags,
+          query_string);
+        
+        if (strlen(err)) { return; }
+        
+        query = query | inter;
+        
+        while (isspace(query_string[i])) { i++; }
+    }
+}
+
+//--------------------------------------
+
+// These functions are for parsing the tag data from the
+// ascii representation embedded in this file, where each
+// line gives a tag name followed by a `|...|` block for
+// each anim, with `#` marking the frames which are tagged.
+// Each line is parsed in two passes, the first counting
+// the anims and ranges so the arrays of the set can be 
+// allocated once, and the second filling them. Both find
+// the `#` characters 64 at a time as a bit mask so runs 
+// of them can be found with bit tricks, the same as the
+// masks.
+
+// Bit mask of the bytes equal to `c` in the 64 bytes 
+// starting at `p`, with the first byte in the lowest bit
+static inline uint64_t parse_match64(const char* p, char c)
+{
+#if defined(__AVX2__)
+    __m256i v = _mm256_set1_epi8(c);
+    uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), v));
+    uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), v));
+    return lo | (hi << 32);
+#elif defined(__SSE2__)
+    __m128i v = _mm_set1_epi8(c);
+    uint64_t m = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(b, v)) << (16 * i);
+    }
+    return m;
+#else
+    // Other targets have no cheap way to turn a vector 
+    // comparison into a bit mask, so instead flag the top 
+    // bit of each matching byte of a 64-bit word and then
+    // gather those bits together with a multiply
+    uint64_t m = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t w;
+        memcpy(&w, p + 8 * i, sizeof(uint64_t));
+        w ^= 0x0101010101010101ull * (unsigned char)c;
+        uint64_t z = ~(((w & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | w) & 0x8080808080808080ull;
+        m |= (((z >> 7) * 0x0102040810204080ull) >> 56) << (8 * i);
+    }
+    return m;
+#endif
+}
+
+// Same as above but only for the bytes before `end`, 
+// which are copied to a buffer when there are less 
+// than 64 so nothing past `end` is read
+static inline uint64_t parse_match64(const char* p, const char* end, char c)
+{
+    if (end - p >= 64) { return parse_match64(p, c); }
+    
+    char buffer[64] = {};
+    memcpy(buffer, p, end - p);
+    return parse_match64(buffer, c);
+}
+
+// Number of runs of `#` between `begin` and `end`
+static inline int parse_tag_data_count_runs(const char* begin, const char* end)
+{
+    int count = 0;
+    uint64_t carry = 0;
+    
+    for (const char* p = begin; p < end; p += 64)
+    {
+        uint64_t m = parse_match64(p, end, '#');
+        count += bit_popcount64(m & ~((m << 1) | carry));
+        carry = m >> 63;
+    }
+    
+    return count;
+}
+
+// Calls `func(start, stop)` for each run of `#` between 
+// `begin` and `end`, with frames counted from `begin`
+template<typename F>
+static inline void parse_tag_data_runs(const char* begin, const char* end, const F& func)
+{
+    int start = 0;
+    uint64_t carry = 0;
+    
+    for (const char* p = begin; p < end; p += 64)
+    {
+        uint64_t m = parse_match64(p, end, '#');
+        uint64_t prev = (m << 1) | carry;
+        uint64_t starts = m & ~prev;
+        uint64_t edges = starts | (prev & ~m);
+        int base = (int)(p - begin);
+        carry = m >> 63;
+        
+        // Edges alternate between the start and stop of
+        // each run. A run reaching the end of a partial 
+        // block stops on the first bit past it.
+        while (edges)
+        {
+            int j = bit_ctz64(edges);
+            
+            if ((starts >> j) & 1)
+            {
+                start = base + j;
+            }
+            else
+            {
+                func(start, base + j);
+            }
+            
+            edges &= edges - 1;
+        }
+    }
+    
+    if (carry && (end - begin) % 64 == 0)
+    {
+        func(start, (int)(end - begin));
+    }
+}
+
+// Calls `func(anim, begin, end)` with the inside of each 
+// `|...|` block between `begin` and `end`
+template<typename F>
+static inline void parse_tag_data_anims(const char* begin, const char* end, const F& func)
+{
+    int anim = 0;
+    
+    while (true)
+    {
+        const char* open = (const char*)memchr(begin, '|', end - begin);
+        if (!open) { return; }
+        
+        const char* close = (const char*)memchr(open + 1, '|', end - open - 1);
+        if (!close) { return; }
+        
+        func(anim, open + 1, close);
+        
+        anim++;
+        begin = close + 1;
+    }
+}
+
+// Parses the tag name and range set of a single line
+static void parse_tag_data_line(
+    std::string& tag_name,
+    range_set& set,
+    const char* begin,
+    const char* end)
+{
+    const char* name_end = (const char*)memchr(begin, '|', end - begin);
+    
+    // Spaces and non-ascii characters are dropped from the
+    // name so that names with spaces can still be queried
+    tag_name.assign(begin, name_end);
+    tag_name.erase(std::remove_if(tag_name.begin(), tag_name.end(), 
+        [](char c) { return !isascii(c) || isspace(c); }), tag_name.end());
+    
+    int nanims = 0;
+    int nranges = 0;
+    
+    parse_tag_data_anims(name_end, end, [&](int, const char* anim_begin, const char* anim_end)
+    {
+        int count = parse_tag_data_count_runs(anim_begin, anim_end);
+        nanims += count > 0;
+        nranges += count;
+    });
+    
+    set.anims.resize(nanims);
+    set.anims_subranges.resize(nanims);
+    set.ranges.resize(nranges);
+    
+    int anim_i = 0;
+    int range_i = 0;
+    
+    parse_tag_data_anims(name_end, end, [&](int anim, const char* anim_begin, const char* anim_end)
+    {
+        int range_start = range_i;
+        
+        parse_tag_data_runs(anim_begin, anim_end, [&](int start, int stop)
+        {
+            set.ranges(range_i) = { start, stop };
+            range_i++;
+        });
+        
+        if (range_i > range_start)
+        {
+            set.anims(anim_i) = anim;
+            set.anims_subranges(anim_i) = { range_start, range_i };
+            anim_i++;
+        }
+    });
+    
+    assert(anim_i == nanims && range_i == nranges);
+}
+
+// Finds the start and end of each line with a tag on it,
+// skipping any which have no `|` such as blank lines
+static void parse_tag_data_lines(
+    std::vector<std::pair<const char*, const char*>>& lines,
+    const char* tag_data_string)
+{
+    const char* end = tag_data_string + strlen(tag_data_string);
+    
+    for (const char* begin = tag_data_string; begin < end;)
+    {
+        const char* line_end = (const char*)memchr(begin, '\n', end - begin);
+        if (!line_end) { line_end = end; }
+        
+        if (memchr(begin, '|', line_end - begin))
+        {
+            lines.push_back({ begin, line_end });
+        }
+        
+        begin = line_end + 1;
+    }
+}
+
+// Parses each line of `tag_data_string`, appending its
+// tag name and range set to `tag_names` and `tag_range_sets`
+void parse_tag_data(
+    std::vector<std::string>& tag_names,
+    std::vector<range_set>& tag_range_sets,
+    const char* tag_data_string)
+{
+    std::vector<std::pair<const char*, const char*>> lines;
+    parse_tag_data_lines(lines, tag_data_string);
+    
+    int offset = (int)tag_names.size();
+    tag_names.resize(offset + lines.size());
+    tag_range_sets.resize(offset + lines.size());
+    
+    for (int i = 0; i < (int)lines.size(); i++)
+    {
+        parse_tag_data_line(tag_names[offset + i], tag_range_sets[offset + i], lines[i].first, lines[i].second);
+    }
+}
+
+// Same as above but parses the lines in parallel on `pool`
+void parse_tag_data(
+    std::vector<std::string>& tag_names,
+    std::vector<range_set>& tag_range_sets,
+    const char* tag_data_string,
+    thread_pool& pool)
+{
+    std::vector<std::pair<const char*, const char*>> lines;
+    parse_tag_data_lines(lines, tag_data_string);
+    
+    int offset = (int)tag_names.size();
+    tag_names.resize(offset + lines.size());
+    tag_range_sets.resize(offset + lines.size());
+    
+    parallel_for(pool, (int)lines.size(), 1, [&](int lines_start, int lines_stop)
+    {
+        for (int i = lines_start; i < lines_stop; i++)
+        {
+            parse_tag_data_line(tag_names[offset + i], tag_range_sets[offset + i], lines[i].first, lines[i].second);
+        }
+    });
+}
+
+//--------------------------------------
+
+// Tag data can also be imported from CSV with a row for 
+// each range giving the tag name, anim, start frame and
+// stop frame, such as `Running,12,30,95`. Rows can come 
+// in any order, and overlapping or adjacent ranges are 
+// merged. Any row which does not parse, such as a header,
+// is skipped.
+
+struct tag_data_row
+{
+    int anim;
+    int start;
+    int stop;
+};
+
+static inline bool parse_tag_data_csv_int(int& out, const char*& p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t')) { p++; }
+    
+    const char* digits = p;
+    int64_t value = 0;
+    
+    while (p < end && *p >= '0' && *p <= '9' && value <= INT_MAX)
+    {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+    
+    if (p == digits || value > INT_MAX) { return false; }
+    
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) { p++; }
+    
+    out = (int)value;
+    return true;
+}
+
+// Parses a single row between `begin` and `end`, giving 
+// the tag name as a pointer and size into the row
+static bool parse_tag_data_csv_row(
+    const char*& name,
+    int& name_size,
+    tag_data_row& row,
+    const char* begin,
+    const char* end)
+{
+    const char* comma = (const char*)memchr(begin, ',', end - begin);
+    if (!comma) { return false; }
+    
+    name = begin;
+    const char* name_end = comma;
+    while (name < name_end && isspace(*name)) { name++; }
+    while (name_end > name && isspace(name_end[-1])) { name_end--; }
+    
+    if (name_end - name >= 2 && *name == '"' && name_end[-1] == '"')
+    {
+        name++;
+        name_end--;
+    }
+    
+    name_size = (int)(name_end - name);
+    
+    const char* p = comma + 1;
+    
+    return name_size > 0 &&
+        parse_tag_data_csv_int(row.anim, p, end) && p < end && *p++ == ',' &&
+        parse_tag_data_csv_int(row.start, p, end) && p < end && *p++ == ',' &&
+        parse_tag_data_csv_int(row.stop, p, end) && p == end &&
+        row.start < row.stop;
+}
+
+// Builds a set from rows sorted by anim and start frame
+static void parse_tag_data_csv_set(range_set& set, const slice1d<tag_data_row> rows)
+{
+    int nanims = 0;
+    int nranges = 0;
+    
+    // Rows can be inside an earlier, wider row, so a new 
+    // range starts only after the furthest stop so far, 
+    // the same as when the ranges are filled below
+    int stop = 0;
+    
+    for (int i = 0; i < rows.size; i++)
+    {
+        if (i == 0 || rows(i).anim != rows(i - 1).anim)
+        {
+            nanims++;
+            nranges++;
+            stop = rows(i).stop;
+        }
+        else if (rows(i).start > stop)
+        {
+            nranges++;
+            stop = rows(i).stop;
+        }
+        else
+        {
+            stop = std::max(stop, rows(i).stop);
+        }
+    }
+    
+    set.anims.resize(nanims);
+    set.anims_subranges.resize(nanims);
+    set.ranges.resize(nranges);
+    
+    int anim_i = -1;
+    int range_i = -1;
+    
+    for (int i = 0; i < rows.size; i++)
+    {
+        if (i == 0 || rows(i).anim != rows(i - 1).anim)
+        {
+            anim_i++;
+            range_i++;
+            set.anims(anim_i) = rows(i).anim;
+            set.anims_subranges(anim_i) = { range_i, range_i + 1 };
+            set.ranges(range_i) = { rows(i).start, rows(i).stop };
+        }
+        else if (rows(i).start > set.ranges(range_i).stop)
+        {
+            range_i++;
+            set.anims_subranges(anim_i).stop = range_i + 1;
+            set.ranges(range_i) = { rows(i).start, rows(i).stop };
+        }
+        else
+        {
+            set.ranges(range_i).stop = std::max(set.ranges(range_i).stop, rows(i).stop);
+        }
+    }
+}
+
+// Parses the CSV in `csv_string`, appending each tag in 
+// the order it first appears to `tag_names` and 
+// `tag_range_sets`. Rows are parsed once and counted for
+// each tag so they can then be grouped into one array.
+void parse_tag_data_csv(
+    std::vector<std::string>& tag_names,
+    std::vector<range_set>& tag_range_sets,
+    const char* csv_string)
+{
+    const char* end = csv_string + strlen(csv_string);
+    
+    tag_dictionary csv_tags;
+    std::vector<tag_data_row> csv_rows;
+    std::vector<int> row_tags;
+    std::vector<int> tag_counts;
+    
+    // Rows of the same tag are usually together, so the 
+    // previous row's tag is checked before the dictionary
+    const char* prev_name = NULL;
+    int prev_name_size = 0;
+    int prev_tag = -1;
+    
+    for (const char* begin = csv_string; begin < end;)
+    {
+        const char* line_end = (const char*)memchr(begin, '\n', end - begin);
+        if (!line_end) { line_end = end; }
+        
+        const char* name;
+        int name_size;
+        tag_data_row row;
+        
+        if (parse_tag_data_csv_row(name, name_size, row, begin, line_end))
+        {
+            int tag = prev_tag;
+            
+            if (name_size != prev_name_size || memcmp(name, prev_name, name_size) != 0)
+            {
+                tag = tag_dictionary_add(csv_tags, name, name_size);
+                if (tag == (int)tag_counts.size()) { tag_counts.push_back(0); }
+                
+                prev_name = name;
+                prev_name_size = name_size;
+                prev_tag = tag;
+            }
+            
+            csv_rows.push_back(row);
+            row_tags.push_back(tag);
+            tag_counts[tag]++;
+        }
+        
+        begin = line_end + 1;
+    }
+    
+    int ntags = (int)tag_counts.size();
+    
+    std::vector<int> tag_offsets(ntags + 1, 0);
+    for (int t = 0; t < ntags; t++)
+    {
+        tag_offsets[t + 1] = tag_offsets[t] + tag_counts[t];
+    }
+    
+    // Group the rows by tag, keeping their order
+    
+    array1d<tag_data_row> rows(tag_offsets[ntags]);
+    std::vector<int> tag_fill(tag_offsets.begin(), tag_offsets.end() - 1);
+    
+    for (int i = 0; i < (int)csv_rows.size(); i++)
+    {
+        rows(tag_fill[row_tags[i]]++) = csv_rows[i];
+    }
+    
+    int offset = (int)tag_names.size();
+    tag_names.resize(offset + ntags);
+    tag_range_sets.resize(offset + ntags);
+    
+    for (int t = 0; t < ntags; t++)
+    {
+        tag_names[offset + t] = tag_dictionary_name(csv_tags, t);
+    }
+    
+    auto row_less = [](const tag_data_row& lhs, const tag_data_row& rhs)
+    {
+        return lhs.anim != rhs.anim ? lhs.anim < rhs.anim : lhs.start < rhs.start;
+    };
+    
+    for (int t = 0; t < ntags; t++)
+    {
+        slice1d<tag_data_row> tag_rows = rows.slice(tag_offsets[t], tag_offsets[t + 1]);
+        
+        if (!std::is_sorted(tag_rows.data, tag_rows.data + tag_rows.size, row_less))
+        {
+            std::sort(tag_rows.data, tag_rows.data + tag_rows.size, row_less);
+        }
+        
+        parse_tag_data_csv_set(tag_range_sets[offset + t], tag_rows);
+    }
+}
+
+//--------------------------------------
+
+// Tag data can be saved to a binary file and loaded back 
+// by memory mapping it, with the arrays of each set used
+// directly from the mapped memory rather than parsed or 
+// copied. The file starts with a header followed by an 
+// entry for each tag giving the location of its name 
+// and arrays, which are stored exactly as in memory and 
+// each start on a 64 byte boundary.
+
+enum
+{
+    TAG_DATA_VERSION = 1,
+    TAG_DATA_ALIGN = 64,
+    TAG_DATA_MASKS = 1 << 0,   // Flag set if mask sets are stored
+};
+
+static const char TAG_DATA_MAGIC[8] = { 'R', 'A', 'N', 'G', 'E', 'S', 'D', 'B' };
+
+// Written to the header to detect files written with
+// a different byte order
+static const uint32_t TAG_DATA_ENDIAN = 0x01020304;
+
+struct tag_data_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t flags;
+    uint32_t ntags;
+    uint64_t size;              // Size of whole file in bytes
+};
+
+// Offsets and sizes of the data of a tag. Mask sets 
+// have their own list of anims, which may differ from 
+// the anims of the range set.
+struct tag_data_entry
+{
+    uint64_t name;
+    uint64_t anims;
+    uint64_t anims_subranges;
+    uint64_t ranges;
+    uint64_t mask_anims;
+    uint64_t anims_submasks;
+    uint64_t masks;
+    int32_t name_size;
+    int32_t nanims;
+    int32_t nranges;
+    int32_t nmask_anims;
+    int32_t nmasks;             // Number of bits in masks
+    int32_t padding;
+};
+
+// Reserves space for an array at `offset` and moves
+// `offset` on to where the next array can start
+static inline uint64_t tag_data_place(uint64_t& offset, uint64_t bytes)
+{
+    uint64_t start = offset;
+    offset = ((offset + bytes + TAG_DATA_ALIGN - 1) / TAG_DATA_ALIGN) * TAG_DATA_ALIGN;
+    return start;
+}
+
+// Writes an array at `offset`, padding with zeros from
+// the end of what has been written so far
+static inline bool tag_data_write(
+    FILE* f, 
+    uint64_t& written, 
+    uint64_t offset, 
+    const void* data, 
+    uint64_t bytes)
+{
+    static const unsigned char zeros[TAG_DATA_ALIGN] = { 0 };
+    
+    assert(offset >= written && offset - written <= TAG_DATA_ALIGN);
+    
+    if (fwrite(zeros, 1, offset - written, f) != offset - written) { return false; }
+    if (bytes > 0 && fwrite(data, 1, bytes, f) != bytes) { return false; }
+    
+    written = offset + bytes;
+    return true;
+}
+
+// Saves tag data to a binary file. `tag_mask_sets` can 
+// be empty, in which case no mask sets are stored.
+bool tag_data_save(
+    const char* filename,
+    const std::vector<std::string>& tag_names,
+    const std::vector<range_set>& tag_range_sets,
+    const std::vector<mask_set>& tag_mask_sets)
+{
+    assert(tag_names.size() == tag_range_sets.size());
+    assert(tag_mask_sets.empty() || tag_mask_sets.size() == tag_range_sets.size());
+    
+    int ntags = tag_names.size();
+    bool masks = !tag_mask_sets.empty();
+    
+    tag_data_header header;
+    memcpy(header.magic, TAG_DATA_MAGIC, sizeof(header.magic));
+    header.version = TAG_DATA_VERSION;
+    header.endian = TAG_DATA_ENDIAN;
+    header.flags = masks ? TAG_DATA_MASKS : 0;
+    header.ntags = ntags;
+    
+    // Lay out the file before writing any of it
+    std::vector<tag_data_entry> entries(ntags);
+    uint64_t offset = 0;
+    tag_data_place(offset, sizeof(tag_data_header) + ntags * sizeof(tag_data_entry));
+    
+    for (int i = 0; i < ntags; i++)
+    {
+        const range_set& set = tag_range_sets[i];
+        tag_data_entry& e = entries[i];
+        memset(&e, 0, sizeof(tag_data_entry));
+        
+        e.name_size = tag_names[i].size();
+        e.nanims = set.anims.size;
+        e.nranges = set.ranges.size;
+        e.name = tag_data_place(offset, e.name_size);
+        e.anims = tag_data_place(offset, e.nanims * sizeof(int));
+        e.anims_subranges = tag_data_place(offset, e.nanims * sizeof(range));
+        e.ranges = tag_data_place(offset, e.nranges * sizeof(range));
+        
+        if (masks)
+        {
+            const mask_set& mask = tag_mask_sets[i];
+            e.nmask_anims = mask.anims.size;
+            e.nmasks = mask.masks.size;
+            e.mask_anims = tag_data_place(offset, e.nmask_anims * sizeof(int));
+            e.anims_submasks = tag_data_place(offset, e.nmask_anims * sizeof(range));
+            e.masks = tag_data_place(offset, bit_alloc_size(e.nmasks));
+        }
+    }
+    
+    header.size = offset;
+    
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) { return false; }
+    
+    uint64_t written = 0;
+    bool ok = 
+        tag_data_write(f, written, 0, &header, sizeof(tag_data_header)) &&
+        tag_data_write(f, written, written, entries.data(), ntags * sizeof(tag_data_entry));
+    
+    for (int i = 0; ok && i < ntags; i++)
+    {
+        const range_set& set = tag_range_sets[i];
+        const tag_data_entry& e = entries[i];
+        
+        ok = ok &&
+            tag_data_write(f, written, e.name, tag_names[i].data(), e.name_size) &&
+            tag_data_write(f, written, e.anims, set.anims.data, e.nanims * sizeof(int)) &&
+            tag_data_write(f, written, e.anims_subranges, set.anims_subranges.data, e.nanims * sizeof(range)) &&
+            tag_data_write(f, written, e.ranges, set.ranges.data, e.nranges * sizeof(range));
+        
+        if (masks)
+        {
+            const mask_set& mask = tag_mask_sets[i];
+            
+            ok = ok &&
+                tag_data_write(f, written, e.mask_anims, mask.anims.data, e.nmask_anims * sizeof(int)) &&
+                tag_data_write(f, written, e.anims_submasks, mask.anims_submasks.data, e.nmask_anims * sizeof(range)) &&
+                tag_data_write(f, written, e.masks, mask.masks.data, bit_alloc_size(e.nmasks));
+        }
+    }
+    
+    ok = ok && tag_data_write(f, written, header.size, NULL, 0);
+    ok = (fclose(f) == 0) && ok;
+    
+    return ok;
+}
+
+// A memory mapped tag data file. Sets loaded from the 
+// file refer to its memory so it must be kept open for 
+// as long as they are used.
+struct tag_data_file
+{
+    unsigned char* data = NULL;
+    uint64_t size = 0;
+#if defined(_WIN32)
+    void* file = NULL;
+    void* mapping = NULL;
+#endif
+};
+
+void tag_data_close(tag_data_file& file)
+{
+#if defined(_WIN32)
+    if (file.data) { UnmapViewOfFile(file.data); }
+    if (file.mapping) { CloseHandle(file.mapping); }
+    if (file.file) { CloseHandle(file.file); }
+    file.file = NULL;
+    file.mapping = NULL;
+#else
+    if (file.data) { munmap(file.data, file.size); }
+#endif
+    file.data = NULL;
+    file.size = 0;
+}
+
+static bool tag_data_map(tag_data_file& file, const char* filename)
+{
+#if defined(_WIN32)
+    const unsigned long GENERIC_READ = 0x80000000;
+    const unsigned long FILE_SHARE_READ = 0x1;
+    const unsigned long OPEN_EXISTING = 3;
+    const unsigned long FILE_ATTRIBUTE_NORMAL = 0x80;
+    const unsigned long PAGE_READONLY = 0x2;
+    const unsigned long FILE_MAP_READ = 0x4;
+    void* const INVALID_HANDLE_VALUE = (void*)(intptr_t)-1;
+    
+    file.file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file.file == INVALID_HANDLE_VALUE) { file.file = NULL; return false; }
+    
+    long long size = 0;
+    if (!GetFileSizeEx(file.file, &size) || size == 0) { tag_data_close(file); return false; }
+    
+    file.mapping = CreateFileMappingA(file.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (file.mapping == NULL) { tag_data_close(file); return false; }
+    
+    file.data = (unsigned char*)MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0);
+    if (file.data == NULL) { tag_data_close(file); return false; }
+    
+    file.size = size;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) { return false; }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return false; }
+    
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    
+    if (data == MAP_FAILED) { return false; }
+    
+    file.data = (unsigned char*)data;
+    file.size = st.st_size;
+#endif
+    return true;
+}
+
+// Checks an array of `count` elements of `elem` bytes 
+// at `offset` is aligned and lies within the file
+static inline bool tag_data_valid(
+    const tag_data_file& file, 
+    uint64_t offset, 
+    int32_t count, 
+    uint64_t elem)
+{
+    return count >= 0 && 
+        offset % TAG_DATA_ALIGN == 0 && 
+        offset <= file.size && 
+        count * elem <= file.size - offset;
+}
+
+// Checks each slice of an array of anims lies within 
+// an array of `size` elements
+static inline bool tag_data_valid_slices(const slice1d<range> slices, int size)
+{
+    for (int i = 0; i < slices.size; i++)
+    {
+        if (slices(i).start < 0 || slices(i).start > slices(i).stop || slices(i).stop > size)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// Loads tag data by memory mapping a file written by
+// `tag_data_save`. The arrays of the sets refer directly 
+// to the mapped memory, so loading costs almost nothing 
+// however large the file. The arrays should not be 
+// written to, but can be resized, which copies them.
+// `tag_mask_sets` is left empty if the file has no mask 
+// sets. Returns false if the file could not be opened
+// or is not valid.
+bool tag_data_load(
+    tag_data_file& file,
+    std::vector<std::string>& tag_names,
+    std::vector<range_set>& tag_range_sets,
+    std::vector<mask_set>& tag_mask_sets,
+    const char* filename)
+{
+    tag_data_close(file);
+    
+    if (!tag_data_map(file, filename)) { return false; }
+    
+    tag_data_header header;
+    bool ok = file.size >= sizeof(tag_data_header);
+    
+    if (ok)
+    {
+        memcpy(&header, file.data, sizeof(tag_data_header));
+        
+        ok = memcmp(header.magic, TAG_DATA_MAGIC, sizeof(header.magic)) == 0 &&
+            header.version == TAG_DATA_VERSION &&
+            header.endian == TAG_DATA_ENDIAN &&
+            header.size == file.size &&
+            header.ntags <= (file.size - sizeof(tag_data_header)) / sizeof(tag_data_entry);
+    }
+    
+    if (!ok)
+    {
+        tag_data_close(file);
+        return false;
+    }
+    
+    int ntags = header.ntags;
+    bool masks = header.flags & TAG_DATA_MASKS;
+    const tag_data_entry* entries = (const tag_data_entry*)(file.data + sizeof(tag_data_header));
+    
+    tag_names.resize(ntags);
+    tag_range_sets.resize(ntags);
+    tag_mask_sets.resize(masks ? ntags : 0);
+    
+    for (int i = 0; ok && i < ntags; i++)
+    {
+        const tag_data_entry& e = entries[i];
+        
+        ok = tag_data_valid(file, e.name, e.name_size, 1) &&
+            tag_data_valid(file, e.anims, e.nanims, sizeof(int)) &&
+            tag_data_valid(file, e.anims_subranges, e.nanims, sizeof(range)) &&
+            tag_data_valid(file, e.ranges, e.nranges, sizeof(range));
+        
+        if (!ok) { break; }
+        
+        tag_names[i].assign((const char*)file.data + e.name, e.name_size);
+        
+        range_set& set = tag_range_sets[i];
+        set.anims.borrow(slice1d<int>(e.nanims, (int*)(file.data + e.anims)));
+        set.anims_subranges.borrow(slice1d<range>(e.nanims, (range*)(file.data + e.anims_subranges)));
+        set.ranges.borrow(slice1d<range>(e.nranges, (range*)(file.data + e.ranges)));
+        
+        ok = tag_data_valid_slices(set.anims_subranges, set.ranges.size);
+        
+        if (ok && masks)
         {
-            return false;
+            ok = tag_data_valid(file, e.mask_anims, e.nmask_anims, sizeof(int)) &&
+                tag_data_valid(file, e.anims_submasks, e.nmask_anims, sizeof(range)) &&
+                e.nmasks >= 0 && tag_data_valid(file, e.masks, bit_alloc_size(e.nmasks), 1);
+            
+            if (!ok) { break; }
+            
+            mask_set& mask = tag_mask_sets[i];
+            mask.anims.borrow(slice1d<int>(e.nmask_anims, (int*)(file.data + e.mask_anims)));
+            mask.anims_submasks.borrow(slice1d<range>(e.nmask_anims, (range*)(file.data + e.anims_submasks)));
+            mask.masks.borrow(e.nmasks, file.data + e.masks);
+            
+            ok = tag_data_valid_slices(mask.anims_submasks, mask.masks.size);
         }
     }
-};
+    
+    if (!ok)
+    {
+        tag_names.clear();
+        tag_range_sets.clear();
+        tag_mask_sets.clear();
+        tag_data_close(file);
+        return false;
+    }
+    
+    return true;
+}
 
-// Hashtable to cache range set evaluations
-using query_expr_range_set_cache = std::unordered_map<
-    query_expr,
-    range_set,
-    query_expr_hash,
-    query_expr_cmp>;
+int tag_index(const tag_dictionary& tags, const char* name)
+{
+    int index = tag_dictionary_find(tags, name);
+    assert(index != -1);
+    return index;
+}
 
-// Hashtable to cache mask set evaluations
-using query_expr_mask_set_cache = std::unordered_map<
-    query_expr,
-    mask_set,
-    query_expr_hash,
-    query_expr_cmp>;
+//--------------------------------------
+
+void draw_anim_names(
+    const range_set& all_tag_range_set,
+    int height,
+    int scale = 8)
+{
+    int padding = 10;
+    
+    int offset = 150;
+    
+    for (int i = 0; i < all_tag_range_set.anims.size; i++)
+    {   
+        DrawText(TextFormat("Anim %i", i), 
+          offset + scale * (all_tag_range_set.ranges(i).stop / 2) - 20, height, 20, DARKGRAY);
+        
+        offset += scale * all_tag_range_set.ranges(i).stop + padding;
+    }
+    
+}
+
+void draw_tag_range_set(
+    const char* tag_name,
+    const range_set& tag_range_set,
+    const range_set& all_tag_range_set,
+    int height,
+    Color color,
+    int scale = 8)
+{
+    DrawText(tag_name, 20, height, 20, DARKGRAY);
+    
+    int padding = 10;
+    
+    int offset = 150;
+
+    for (int i = 0; i < all_tag_range_set.anims.size; i++)
+    {   
+        int j = range_set_find_anim(tag_range_set, i);
+        if (j != -1)
+        {
+            int start = tag_range_set.anims_subranges(j).start;
+            int stop = tag_range_set.anims_subranges(j).stop;
+            for (int k = start; k < stop; k++)
+            {
+                Rectangle rec = {
+                  (float)offset + scale * tag_range_set.ranges(k).start + 2, 
+                  (float)height, 
+                  (float)scale * (tag_range_set.ranges(k).stop - tag_range_set.ranges(k).start) - 4, 
+                  (float)20,
+                };
+                  
+                DrawRectangleRounded(rec, 0.1f, 0, Fade(color, 0.4f));
+                DrawRectangleRoundedLines(rec, 0.1f, 0, 2.0f, Fade(color, 0.8f));
+            }
+        }
+        
+        offset += scale * all_tag_range_set.ranges(i).stop + padding;
+    }
+    
+    offset = 150;
+    
+    for (int i = 0; i < all_tag_range_set.anims.size; i++)
+    {   
+        DrawLine(offset - 1, height - 3, offset - 1, height + 23, GRAY);
+        offset += scale * all_tag_range_set.ranges(i).stop;
+        DrawLine(offset + 1, height - 3, offset + 1, height + 23, GRAY);        
+        offset += padding;
+    }
+    
+}
 
 //--------------------------------------
 
-// Recursively evaluate range set query by
-// walking down the stack from top to bottom 
-// and performing the operations encoded by them
-void query_expr_evaluate_range_set_from(
-    range_set& out,
-    int& index,
-    const query_expr& query, 
-    const std::vector<range_set>& range_sets)
-{   
-    range_set lhs, rhs;
+#if defined(RANGES_BENCHMARK)
 
-    switch (query.stack(index))
-    {
-        case QUERY_OP_UNION:
-            index--;
-            query_expr_evaluate_range_set_from(lhs, index, query, range_sets);
-            query_expr_evaluate_range_set_from(rhs, index, query, range_sets);
-            range_set_union(out, lhs, rhs);  
-        break;
-        
-        case QUERY_OP_INTERSECTION:
-            index--;
-            query_expr_evaluate_range_set_from(lhs, index, query, range_sets);
-            query_expr_evaluate_range_set_from(rhs, index, query, range_sets);
-            range_set_intersection(out, lhs, rhs);
-        break;
-        
-        case QUERY_OP_DIFFERENCE:
-            index--;
-            query_expr_evaluate_range_set_from(lhs, index, query, range_sets);
-            query_expr_evaluate_range_set_from(rhs, index, query, range_sets);
-            range_set_difference(out, lhs, rhs);
-        break;
-      
-        default:
-            out = range_sets[query.stack(index)];
-            index--;
-        break;
+// Some simple benchmarks of the core operations. Build
+// with `make bench` and run the resulting executable.
+
+// Returns the best time in milliseconds over several runs
+template<typename F>
+double benchmark_time(F func, int runs = 10)
+{
+    double best = 1e10;
+    
+    for (int r = 0; r < runs; r++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto stop = std::chrono::steady_clock::now();
+        
+        best = std::min(best, std::chrono::duration<double, std::milli>(stop - start).count());
     }
+    
+    return best;
 }
 
-void query_expr_evaluate_range_set(
-    range_set& out,
-    const query_expr& query, 
-    const std::vector<range_set>& range_sets)
-{ 
-    // If empty query, return empty range set
-    if (query.stack.size == 0)
+// Compares two range sets, ignoring anims with no ranges
+// which some operations leave in their output, and prints
+// `name` if they differ. The benchmarks check their 
+// results with this rather than `assert` so the checks 
+// still run in release builds.
+bool benchmark_check(const char* name, const range_set& lhs, const range_set& rhs)
+{
+    int lhs_i = 0;
+    int rhs_i = 0;
+    bool same = true;
+    
+    while (same)
     {
-        out = range_set();
+        while (lhs_i < lhs.anims.size && lhs.anims_subranges(lhs_i).start == lhs.anims_subranges(lhs_i).stop) { lhs_i++; }
+        while (rhs_i < rhs.anims.size && rhs.anims_subranges(rhs_i).start == rhs.anims_subranges(rhs_i).stop) { rhs_i++; }
+        
+        if (lhs_i == lhs.anims.size || rhs_i == rhs.anims.size)
+        {
+            same = lhs_i == lhs.anims.size && rhs_i == rhs.anims.size;
+            break;
+        }
+        
+        slice1d<range> lhs_ranges = lhs.ranges.slice(lhs.anims_subranges(lhs_i));
+        slice1d<range> rhs_ranges = rhs.ranges.slice(rhs.anims_subranges(rhs_i));
+        
+        same = lhs.anims(lhs_i) == rhs.anims(rhs_i) && lhs_ranges.size == rhs_ranges.size;
+        
+        for (int i = 0; same && i < lhs_ranges.size; i++)
+        {
+            same = lhs_ranges(i).start == rhs_ranges(i).start && lhs_ranges(i).stop == rhs_ranges(i).stop;
+        }
+        
+        lhs_i++; rhs_i++;
     }
-    else
+    
+    if (!same) { printf("  MISMATCH: %s\n", name); }
+    
+    return same;
+}
+
+// Same as above for results which should be identical,
+// such as from the serial and parallel versions of an 
+// operation, so anims with no ranges are compared too
+bool benchmark_check_exact(const char* name, const range_set& lhs, const range_set& rhs)
+{
+    bool same = 
+        lhs.anims.size == rhs.anims.size && 
+        lhs.ranges.size == rhs.ranges.size;
+    
+    for (int i = 0; same && i < lhs.anims.size; i++)
     {
-        // Start at top of stack and evaluate
-        int index = query.stack.size - 1;
-        query_expr_evaluate_range_set_from(out, index, query, range_sets);
+        same = 
+            lhs.anims(i) == rhs.anims(i) &&
+            lhs.anims_subranges(i).start == rhs.anims_subranges(i).start &&
+            lhs.anims_subranges(i).stop == rhs.anims_subranges(i).stop;
+    }
+    
+    for (int i = 0; same && i < lhs.ranges.size; i++)
+    {
+        same = lhs.ranges(i).start == rhs.ranges(i).start && lhs.ranges(i).stop == rhs.ranges(i).stop;
+    }
+    
+    if (!same) { printf("  MISMATCH: %s\n", name); }
+    
+    return same;
+}
+
+// Compares the anims, submasks and the bits of each 
+// submask of two mask sets, ignoring the padding between
+// submasks
+bool benchmark_check_exact(const char* name, const mask_set& lhs, const mask_set& rhs)
+{
+    bool same = lhs.anims.size == rhs.anims.size;
+    
+    for (int i = 0; same && i < lhs.anims.size; i++)
+    {
+        same = 
+            lhs.anims(i) == rhs.anims(i) &&
+            lhs.anims_submasks(i).start == rhs.anims_submasks(i).start &&
+            lhs.anims_submasks(i).stop == rhs.anims_submasks(i).stop;
         
-        // Assert we've consumed all of the stack
-        assert(index == -1);
+        slice1d_bit lhs_mask = lhs.masks.slice(lhs.anims_submasks(i));
+        slice1d_bit rhs_mask = rhs.masks.slice(rhs.anims_submasks(i));
+        
+        for (int j = 0; same && j < lhs_mask.size; j += 64)
+        {
+            int n = std::min(64, lhs_mask.size - j);
+            
+            same = n == 64 ?
+                bit_load64(lhs_mask.data, lhs_mask.offset + j) == bit_load64(rhs_mask.data, rhs_mask.offset + j) :
+                bit_load64(lhs_mask.data, lhs_mask.offset + j, n) == bit_load64(rhs_mask.data, rhs_mask.offset + j, n);
+        }
     }
+    
+    if (!same) { printf("  MISMATCH: %s\n", name); }
+    
+    return same;
 }
 
-//--------------------------------------
+// Generates `num` sorted ranges with random lengths and 
+// gaps of up to `fragmentation` frames
+void benchmark_random_ranges(
+    array1d<range>& out, 
+    std::mt19937& gen, 
+    int num, 
+    int fragmentation)
+{
+    std::uniform_int_distribution<int> dist(1, fragmentation);
+    
+    out.resize(num);
+    
+    int t = 0;
+    for (int i = 0; i < num; i++)
+    {
+        t += dist(gen);
+        out(i).start = t;
+        t += dist(gen);
+        out(i).stop = t;
+    }
+}
 
-void query_expr_evaluate_mask_set_from(
-    mask_set& out,
-    int& index,
-    const query_expr& query, 
-    const std::vector<mask_set>& mask_sets)
-{   
-    mask_set lhs, rhs;
+void benchmark_ranges(std::mt19937& gen)
+{
+    const int num = 1000000;
+    
+    array1d<range> lhs, rhs, out(2 * num);
+    
+    printf("Ranges (%i ranges per input)\n", num);
+    
+    for (int fragmentation : { 2, 8, 64 })
+    {
+        benchmark_random_ranges(lhs, gen, num, fragmentation);
+        benchmark_random_ranges(rhs, gen, num, fragmentation);
+        
+        double union_ms = benchmark_time([&]() { ranges_union(out, lhs, rhs); });
+        double intersection_ms = benchmark_time([&]() { ranges_intersection(out, lhs, rhs); });
+        double difference_ms = benchmark_time([&]() { ranges_difference(out, lhs, rhs); });
+        
+        printf("  fragmentation %2i: union %7.3f ms, intersection %7.3f ms, difference %7.3f ms\n", 
+            fragmentation, union_ms, intersection_ms, difference_ms);
+    }
+    
+    // Very uneven inputs covering a similar span of frames
+    benchmark_random_ranges(lhs, gen, num, 8);
+    benchmark_random_ranges(rhs, gen, 100, 80000);
+    
+    for (int i = 0; i < rhs.size; i++)
+    {
+        rhs(i).stop = rhs(i).start + 100;
+    }
+    
+    double union_ms = benchmark_time([&]() { ranges_union(out, lhs, rhs); });
+    double intersection_ms = benchmark_time([&]() { ranges_intersection(out, lhs, rhs); });
+    double difference_ms = benchmark_time([&]() { ranges_difference(out, rhs, lhs); });
+    
+    printf("  uneven (%i vs 100): union %7.3f ms, intersection %7.3f ms, difference %7.3f ms\n", 
+        num, union_ms, intersection_ms, difference_ms);
+}
 
-    switch (query.stack(index))
-    {
-        case QUERY_OP_UNION:
-            index--;
-            query_expr_evaluate_mask_set_from(lhs, index, query, mask_sets);
-            query_expr_evaluate_mask_set_from(rhs, index, query, mask_sets);
-            mask_set_union(out, lhs, rhs);  
-        break;
-        
-        case QUERY_OP_INTERSECTION:
-            index--;
-            query_expr_evaluate_mask_set_from(lhs, index, query, mask_sets);
-            query_expr_evaluate_mask_set_from(rhs, index, query, mask_sets);
-            mask_set_intersection(out, lhs, rhs);
-        break;
-        
-        case QUERY_OP_DIFFERENCE:
-            index--;
-            query_expr_evaluate_mask_set_from(lhs, index, query, mask_sets);
-            query_expr_evaluate_mask_set_from(rhs, index, query, mask_sets);
-            mask_set_difference(out, lhs, rhs);
-        break;
-      
-        default:
-            out = mask_sets[query.stack(index)];
-            index--;
-        break;
+// Generates a set with random ranges in a random subset 
+// of `nanims` animations of length `nframes`
+void benchmark_random_range_set(
+    range_set& out,
+    std::mt19937& gen,
+    int nanims,
+    int nframes,
+    int fragmentation)
+{
+    std::uniform_int_distribution<int> dist(1, fragmentation);
+    std::uniform_int_distribution<int> coin(0, 1);
+    
+    out.anims.resize(0);
+    out.anims_subranges.resize(0);
+    out.ranges.resize(0);
+    
+    for (int i = 0; i < nanims; i++)
+    {
+        if (coin(gen)) { continue; }
+        
+        int start = out.ranges.size;
+        
+        for (int t = dist(gen); t < nframes;)
+        {
+            int stop = std::min(t + dist(gen), nframes);
+            out.ranges.resize(out.ranges.size + 1);
+            out.ranges(out.ranges.size - 1) = { t, stop };
+            t = stop + dist(gen);
+        }
+        
+        out.anims.resize(out.anims.size + 1);
+        out.anims_subranges.resize(out.anims_subranges.size + 1);
+        out.anims(out.anims.size - 1) = i;
+        out.anims_subranges(out.anims_subranges.size - 1) = { start, out.ranges.size };
     }
 }
 
-void query_expr_evaluate_mask_set(
-    mask_set& out,
-    const query_expr& query, 
-    const std::vector<mask_set>& mask_sets)
-{ 
-    if (query.stack.size == 0)
+// Generates a database of `ntags` random tags plus the
+// set of all frames as the first tag
+void benchmark_random_database(
+    std::vector<range_set>& range_sets,
+    std::mt19937& gen,
+    int ntags,
+    int nanims,
+    int nframes)
+{
+    range_sets.resize(ntags + 1);
+    
+    range_set& all = range_sets[0];
+    all.anims.resize(nanims);
+    all.anims_subranges.resize(nanims);
+    all.ranges.resize(nanims);
+    
+    for (int i = 0; i < nanims; i++)
     {
-        out = mask_set();
+        all.anims(i) = i;
+        all.anims_subranges(i) = { i, i + 1 };
+        all.ranges(i) = { 0, nframes };
     }
-    else
+    
+    for (int i = 1; i < ntags + 1; i++)
+    {
+        benchmark_random_range_set(range_sets[i], gen, nanims, nframes, 4 << (i % 6));
+    }
+}
+
+void benchmark_queries(std::mt19937& gen)
+{
+    std::vector<range_set> range_sets;
+    std::vector<mask_set> mask_sets;
+    
+    benchmark_random_database(range_sets, gen, 8, 1000, 1000);
+    
+    mask_sets.resize(range_sets.size());
+    for (int i = 0; i < (int)range_sets.size(); i++)
+    {
+        range_set_rasterize(mask_sets[i], range_sets[i], range_sets[0]);
+    }
+    
+    // A mix of operations over several levels
+    query_expr q1(1), q2(2), q3(3), q4(4), q5(5), q6(6), q7(7), q8(8);
+    query_expr query = ((q1 | q2) & (q3 - q4)) | ((q5 & q6) - (q7 | q8)) | (q2 & q5 & q8);
+    
+    range_set range_result;
+    mask_set mask_result;
+    query_expr_scratch scratch;
+    
+    printf("Queries (%i anims)\n", range_sets[0].anims.size);
+    
+    double range_ms = benchmark_time([&]() { range_set result; query_expr_evaluate_range_set(result, query, range_sets); });
+    double range_scratch_ms = benchmark_time([&]() { query_expr_evaluate_range_set(range_result, query, range_sets, scratch); });
+    double mask_ms = benchmark_time([&]() { mask_set result; query_expr_evaluate_mask_set(result, query, mask_sets); });
+    double mask_scratch_ms = benchmark_time([&]() { query_expr_evaluate_mask_set(mask_result, query, mask_sets, scratch); });
+    
+    query_program program;
+    query_program_compile(program, query);
+    
+    double range_program_ms = benchmark_time([&]() { query_program_evaluate_range_set(range_result, program, range_sets, scratch); });
+    double mask_program_ms = benchmark_time([&]() { query_program_evaluate_mask_set(mask_result, program, mask_sets, scratch); });
+    
+    printf("  range sets: %7.3f ms, with scratch %7.3f ms, compiled %7.3f ms\n", range_ms, range_scratch_ms, range_program_ms);
+    printf("  mask sets:  %7.3f ms, with scratch %7.3f ms, compiled %7.3f ms\n", mask_ms, mask_scratch_ms, mask_program_ms);
+    printf("  registers: %i for %i instructions\n", program.registers, program.instrs.size);
+    
+    // A query written with a repeated sub-expression, a 
+    // shared operand, and its smallest set intersected last,
+    // which the optimizer removes, factors out and moves 
+    // first respectively
+    query_expr redundant = ((q6 | q7) & q1 & (q6 | q7) & q5) | (q3 & q4) | (q4 & q8);
+    
+    query_expr optimized;
+    query_expr_optimize(optimized, redundant, range_sets);
+    
+    double range_redundant_ms = benchmark_time([&]() { query_expr_evaluate_range_set(range_result, redundant, range_sets, scratch); });
+    double mask_redundant_ms = benchmark_time([&]() { query_expr_evaluate_mask_set(mask_result, redundant, mask_sets, scratch); });
+    
+    range_set range_redundant = range_result;
+    
+    double range_optimized_ms = benchmark_time([&]() { query_expr_evaluate_range_set(range_result, optimized, range_sets, scratch); });
+    double mask_optimized_ms = benchmark_time([&]() { query_expr_evaluate_mask_set(mask_result, optimized, mask_sets, scratch); });
+    
+    printf("  optimized: %i ops to %i ops, range sets %7.3f ms to %7.3f ms, mask sets %7.3f ms to %7.3f ms\n", 
+        redundant.stack.size / 2, optimized.stack.size / 2, 
+        range_redundant_ms, range_optimized_ms, mask_redundant_ms, mask_optimized_ms);
+    
+    benchmark_check("optimized", range_result, range_redundant);
+    
+    // Wide chains evaluated with the n-ary operations,
+    // compared to a program of pairwise operations
+    query_expr wide = q1 | q2 | q3 | q4 | q5 | q6 | q7 | q8;
+    query_program wide_program;
+    query_program_compile(wide_program, wide);
+    
+    double wide_ms = benchmark_time([&]() { query_expr_evaluate_range_set(range_result, wide, range_sets, scratch); });
+    double wide_pairwise_ms = benchmark_time([&]() { query_program_evaluate_range_set(range_result, wide_program, range_sets, scratch); });
+    
+    printf("  wide union: %7.3f ms, pairwise %7.3f ms\n", wide_ms, wide_pairwise_ms);
+    
+    // Counting the result rather than building it
+    set_count counted, mask_counted, union_counted, intersection_counted;
+    bool exists = false;
+    
+    double count_ms = benchmark_time([&]() { counted = query_expr_count_range_set(query, range_sets, scratch); });
+    double exists_ms = benchmark_time([&]() { exists = query_expr_exists_range_set(query, range_sets, scratch); });
+    double mask_count_ms = benchmark_time([&]() { mask_counted = query_expr_count_mask_set(query, mask_sets, scratch); });
+    double union_ms = benchmark_time([&]() { range_set_union(range_result, range_sets[1], range_sets[2]); });
+    double union_count_ms = benchmark_time([&]() { union_counted = range_set_union_count(range_sets[1], range_sets[2]); });
+    int union_ranges = range_result.ranges.size;
+    double intersection_ms = benchmark_time([&]() { range_set_intersection(range_result, range_sets[1], range_sets[2]); });
+    double intersection_count_ms = benchmark_time([&]() { intersection_counted = range_set_intersection_count(range_sets[1], range_sets[2]); });
+    int intersection_ranges = range_result.ranges.size;
+    
+    printf("  count: range sets %7.3f ms, mask sets %7.3f ms, exists %7.3f ms (%i frames, %s)\n", 
+        count_ms, mask_count_ms, exists_ms, (int)counted.frames, exists ? "true" : "false");
+    printf("  union: %7.3f ms, count %7.3f ms (%i ranges), intersection %7.3f ms, count %7.3f ms (%i ranges)\n", 
+        union_ms, union_count_ms, union_counted.ranges, intersection_ms, intersection_count_ms, intersection_counted.ranges);
+    
+    if (mask_counted.frames != counted.frames || exists != (counted.frames > 0))
+    {
+        printf("  MISMATCH: count %i frames, mask count %i frames\n", (int)counted.frames, (int)mask_counted.frames);
+    }
+    
+    if (union_counted.ranges != union_ranges || intersection_counted.ranges != intersection_ranges)
+    {
+        printf("  MISMATCH: union count %i of %i ranges, intersection count %i of %i ranges\n", 
+            union_counted.ranges, union_ranges, intersection_counted.ranges, intersection_ranges);
+    }
+    
+    // A wide chain counts anims found in more than two 
+    // operands, and its exists check stops after the 
+    // first operand with any frames
+    set_count wide_counted;
+    bool wide_exists = false;
+    
+    double wide_count_ms = benchmark_time([&]() { wide_counted = query_expr_count_range_set(wide, range_sets, scratch); });
+    double wide_exists_ms = benchmark_time([&]() { wide_exists = query_expr_exists_range_set(wide, range_sets, scratch); });
+    
+    printf("  wide union count: %7.3f ms, exists %7.3f ms (%i frames, %s)\n", 
+        wide_count_ms, wide_exists_ms, (int)wide_counted.frames, wide_exists ? "true" : "false");
+    
+    query_expr_evaluate_range_set(range_result, query, range_sets, scratch);
+    set_count built = range_set_count(range_result);
+    query_expr_evaluate_range_set(range_result, wide, range_sets, scratch);
+    set_count wide_built = range_set_count(range_result);
+    
+    if (built.ranges != counted.ranges || built.frames != counted.frames || 
+        wide_built.ranges != wide_counted.ranges || wide_built.frames != wide_counted.frames || 
+        wide_exists != (wide_built.frames > 0))
+    {
+        printf("  MISMATCH: count %i of %i ranges, wide count %i of %i ranges\n", 
+            counted.ranges, built.ranges, wide_counted.ranges, wide_built.ranges);
+    }
+    
+    // Lazy evaluation of the whole result and of just 
+    // enough of it to find the first 100 frames
+    query_iter iter;
+    
+    double iter_ms = benchmark_time([&]() 
+    { 
+        int anim; range r;
+        query_iter_init(iter, query, range_sets);
+        while (query_iter_next(iter, anim, r)) {}
+    });
+    
+    double iter_first_ms = benchmark_time([&]() 
+    { 
+        int anim; range r; int frames = 0;
+        query_iter_init(iter, query, range_sets);
+        while (frames < 100 && query_iter_next(iter, anim, r)) { frames += r.stop - r.start; }
+    });
+    
+    printf("  lazy: %7.3f ms, first 100 frames %7.3f ms\n", iter_ms, iter_first_ms);
+    
+    // Check that once scratch space has been allocated
+    // evaluation makes no allocations
+    int allocations = array_allocations;
+    query_expr_evaluate_range_set(range_result, query, range_sets, scratch);
+    query_expr_evaluate_mask_set(mask_result, query, mask_sets, scratch);
+    query_program_evaluate_range_set(range_result, program, range_sets, scratch);
+    query_program_evaluate_mask_set(mask_result, program, mask_sets, scratch);
+    query_expr_count_range_set(query, range_sets, scratch);
+    query_expr_exists_range_set(query, range_sets, scratch);
+    allocations = array_allocations - allocations;
+    
+    printf("  allocations with scratch: %i\n", allocations);
+    
+    if (allocations != 0)
     {
-        int index = query.stack.size - 1;
-        query_expr_evaluate_mask_set_from(out, index, query, mask_sets);
-        
-        assert(index == -1);
+        printf("  MISMATCH: %i allocations with scratch\n", allocations);
     }
 }
 
-//--------------------------------------
-
-void ranges_rasterize(
-    slice1d_bit out,
-    const slice1d<range> ranges)
+void benchmark_parallel(std::mt19937& gen)
 {
-    // Zero out all bits
-    out.zero();
+    std::vector<range_set> range_sets;
+    std::vector<mask_set> mask_sets(3);
     
-    for (int i = 0; i < ranges.size; i++)
+    benchmark_random_database(range_sets, gen, 2, 50000, 1000);
+    
+    for (int i = 0; i < 3; i++)
     {
-        // Write ones for range
-        out.slice(ranges(i)).one();
+        range_set_rasterize(mask_sets[i], range_sets[i], range_sets[0]);
     }
+    
+    thread_pool pool;
+    range_set range_result;
+    mask_set mask_result;
+    
+    printf("Parallel (%i anims, %i threads)\n", range_sets[0].anims.size, (int)pool.threads.size() + 1);
+    
+    double union_ms = benchmark_time([&]() { range_set_union(range_result, range_sets[1], range_sets[2]); });
+    double union_parallel_ms = benchmark_time([&]() { range_set_union(range_result, range_sets[1], range_sets[2], pool); });
+    double intersection_ms = benchmark_time([&]() { range_set_intersection(range_result, range_sets[1], range_sets[2]); });
+    double intersection_parallel_ms = benchmark_time([&]() { range_set_intersection(range_result, range_sets[1], range_sets[2], pool); });
+    double mask_union_ms = benchmark_time([&]() { mask_set_union(mask_result, mask_sets[1], mask_sets[2]); });
+    double mask_union_parallel_ms = benchmark_time([&]() { mask_set_union(mask_result, mask_sets[1], mask_sets[2], pool); });
+    
+    printf("  range union:        %7.3f ms, parallel %7.3f ms\n", union_ms, union_parallel_ms);
+    printf("  range intersection: %7.3f ms, parallel %7.3f ms\n", intersection_ms, intersection_parallel_ms);
+    printf("  mask union:         %7.3f ms, parallel %7.3f ms\n", mask_union_ms, mask_union_parallel_ms);
+    
+    // Check the parallel results against the serial ones.
+    // The pool for this always has several workers, so the
+    // work is really split up even on a single core.
+    thread_pool check_pool(4);
+    range_set range_serial;
+    mask_set mask_serial;
+    
+    range_set_union(range_serial, range_sets[1], range_sets[2]);
+    range_set_union(range_result, range_sets[1], range_sets[2], check_pool);
+    benchmark_check_exact("parallel range union", range_result, range_serial);
+    
+    range_set_intersection(range_serial, range_sets[1], range_sets[2]);
+    range_set_intersection(range_result, range_sets[1], range_sets[2], check_pool);
+    benchmark_check_exact("parallel range intersection", range_result, range_serial);
+    
+    range_set_difference(range_serial, range_sets[1], range_sets[2]);
+    range_set_difference(range_result, range_sets[1], range_sets[2], check_pool);
+    benchmark_check_exact("parallel range difference", range_result, range_serial);
+    
+    mask_set_union(mask_serial, mask_sets[1], mask_sets[2]);
+    mask_set_union(mask_result, mask_sets[1], mask_sets[2], check_pool);
+    benchmark_check_exact("parallel mask union", mask_result, mask_serial);
+    
+    mask_set_intersection(mask_serial, mask_sets[1], mask_sets[2]);
+    mask_set_intersection(mask_result, mask_sets[1], mask_sets[2], check_pool);
+    benchmark_check_exact("parallel mask intersection", mask_result, mask_serial);
+    
+    mask_set_difference(mask_serial, mask_sets[1], mask_sets[2]);
+    mask_set_difference(mask_result, mask_sets[1], mask_sets[2], check_pool);
+    benchmark_check_exact("parallel mask difference", mask_result, mask_serial);
+    
+    // Query with independent sub-expressions
+    std::vector<range_set> query_sets;
+    benchmark_random_database(query_sets, gen, 8, 20000, 1000);
+    
+    query_expr q1(1), q2(2), q3(3), q4(4), q5(5), q6(6), q7(7), q8(8);
+    query_expr query = ((q1 | q2) & (q3 - q4)) | ((q5 & q6) - (q7 | q8));
+    query_expr_scratch scratch;
+    
+    double query_ms = benchmark_time([&]() { query_expr_evaluate_range_set(range_result, query, query_sets, scratch); });
+    double query_parallel_ms = benchmark_time([&]() { query_expr_evaluate_range_set(range_result, query, query_sets, scratch, pool); });
+    
+    printf("  query:              %7.3f ms, parallel %7.3f ms\n", query_ms, query_parallel_ms);
+    
+    // Check the parallel query against the serial one, 
+    // both with the default threshold and with every 
+    // sub-expression evaluated as a separate task
+    query_expr_evaluate_range_set(range_serial, query, query_sets, scratch);
+    
+    query_expr_evaluate_range_set(range_result, query, query_sets, scratch, check_pool);
+    benchmark_check_exact("parallel query", range_result, range_serial);
+    
+    query_expr_evaluate_range_set(range_result, query, query_sets, scratch, check_pool, 0);
+    benchmark_check_exact("parallel query without threshold", range_result, range_serial);
 }
 
-void range_set_rasterize(
-    mask_set& out,
-    const range_set& set,
-    const range_set& set_all)
+// Generates a random query from `nops` operations on
+// the sets in `operands`
+query_expr benchmark_random_query(
+    std::mt19937& gen,
+    const std::vector<query_expr>& operands,
+    int nops)
 {
-    out.anims = set.anims;
-    out.anims_submasks.resize(set.anims.size);
+    std::uniform_int_distribution<int> operand(0, operands.size() - 1);
+    std::uniform_int_distribution<int> op(0, 2);
     
-    // First find out the size of each mask
-    int masks_i = 0;
-    for (int i = 0; i < out.anims.size; i++)
+    query_expr query = operands[operand(gen)];
+    
+    for (int i = 0; i < nops; i++)
     {
-        int nmasks = set_all.ranges(out.anims(i)).stop - set_all.ranges(out.anims(i)).start;
-        
-        out.anims_submasks(i) = { masks_i, masks_i + nmasks };
+        const query_expr& rhs = operands[operand(gen)];
         
-        masks_i += nmasks;
+        switch (op(gen))
+        {
+            case 0: query = query | rhs; break;
+            case 1: query = query & rhs; break;
+            case 2: query = query - rhs; break;
+        }
     }
     
-    // Then go ahead and rasterize those masks
-    out.masks.resize(masks_i);
-    for (int i = 0; i < set.anims.size; i++)
-    {
-        ranges_rasterize(
-            out.masks.slice(out.anims_submasks(i)), 
-            set.ranges.slice(set.anims_subranges(i)));
-    }
+    return query;
 }
 
-// Converts a mask into a set of ranges, assumes
-// `out` is pre-allocated to be large enough to
-// store result. Returns number of ranges added.
-int mask_vectorize(
-    slice1d<range> out,
-    const slice1d_bit mask)
+void benchmark_batch(std::mt19937& gen)
 {
-    bool out_active = false;
-    int out_i = 0;
-
-    for (int i = 0; i < mask.size; i++)
+    std::vector<range_set> range_sets;
+    benchmark_random_database(range_sets, gen, 16, 200, 1000);
+    
+    // Queries are built from a small number of common
+    // sub-expressions, as queries typically are
+    std::vector<query_expr> tags;
+    for (int i = 1; i < (int)range_sets.size(); i++)
     {
-        // Activate output
-        if (!out_active && mask.get(i))
-        {
-            out(out_i).start = i;
-            out_active = true;
-        }
-        // Deactivate output
-        else if (out_active && !mask.get(i))
-        {
-            out(out_i).stop = i;
-            out_active = false;
-            out_i++;
-        }
+        tags.push_back(query_expr(i));
     }
     
-    // Deactivate output
-    if (out_active)
+    std::vector<query_expr> common;
+    for (int i = 0; i < 32; i++)
     {
-        out(out_i).stop = mask.size;
-        out_i++;
+        common.push_back(benchmark_random_query(gen, tags, 1));
     }
     
-    return out_i;
-}
-
-// Counts number of ranges added
-int mask_vectorize_count(const slice1d_bit mask)
-{
-    bool out_active = false;
-
-    int out_i = 0;
-
-    for (int i = 0; i < mask.size; i++)
+    std::vector<query_expr> queries;
+    for (int i = 0; i < 2000; i++)
     {
-        if (!out_active && mask.get(i))
-        {
-            out_active = true;
-        }
-        else if (out_active && !mask.get(i))
+        queries.push_back(benchmark_random_query(gen, common, 2));
+    }
+    
+    query_expr_scratch scratch;
+    range_set result;
+    query_batch batch;
+    thread_pool pool;
+    
+    printf("Batch (%i queries)\n", (int)queries.size());
+    
+    double single_ms = benchmark_time([&]() 
+    { 
+        for (const query_expr& query : queries)
         {
-            out_active = false;
-            out_i++;
+            query_expr_evaluate_range_set(result, query, range_sets, scratch);
         }
-    }
+    });
     
-    if (out_active)
-    {
-        out_i++;        
-    }
+    double batch_ms = benchmark_time([&]() { query_expr_evaluate_range_set_batch(batch, queries, range_sets); });
+    double batch_parallel_ms = benchmark_time([&]() { query_expr_evaluate_range_set_batch(batch, queries, range_sets, pool); });
     
-    return out_i;
+    printf("  one at a time: %7.3f ms, batch %7.3f ms, parallel %7.3f ms\n", single_ms, batch_ms, batch_parallel_ms);
+    printf("  %i ops to %i nodes over %i levels, build %7.3f ms, evaluate %7.3f ms\n", 
+        batch.stats.operations, batch.stats.nodes, batch.stats.levels, 
+        batch.stats.build_ms, batch.stats.evaluate_ms);
 }
 
-void mask_set_vectorize(
-    range_set& out,
-    const mask_set& set)
+void benchmark_update(std::mt19937& gen)
 {
-    out.anims = set.anims;
-    out.anims_subranges.resize(set.anims.size);
+    std::vector<range_set> range_sets;
+    benchmark_random_database(range_sets, gen, 8, 20000, 1000);
     
-    // Find out number of ranges to be added
-    int ranges_i = 0;
-    for (int i = 0; i < set.anims.size; i++)
+    query_expr q1(1), q2(2), q3(3), q4(4), q5(5), q6(6), q7(7), q8(8);
+    query_expr query = ((q1 | q2) & (q3 - q4)) | ((q5 & q6) - (q7 | q8)) | (q2 & q5 & q8);
+    
+    query_expr_range_set_cache cache;
+    query_expr_scratch scratch;
+    range_set result;
+    query_expr_evaluate_range_set(result, query, range_sets, cache);
+    
+    // Edit a few anims of one set by regenerating them
+    std::vector<int> anims = { 10, 500, 7000, 15000 };
+    range_set edit;
+    benchmark_random_range_set(edit, gen, range_sets[0].anims.size, 1000, 16);
+    range_set_select(edit, range_set(edit), slice1d<int>(anims.size(), anims.data()));
+    
+    range_set edited;
+    range_set_splice(edited, range_sets[5], slice1d<int>(anims.size(), anims.data()), edit);
+    range_sets[5] = edited;
+    
+    printf("Update (%i anims, %i cached)\n", range_sets[0].anims.size, (int)cache.entries.size());
+    
+    double update_ms = benchmark_time([&]() 
+    { 
+        query_expr_cache_update(cache, 5, slice1d<int>(anims.size(), anims.data()), range_sets, scratch); 
+    });
+    
+    // Updated entries should match evaluating from scratch
+    for (const auto& it : cache.entries)
     {
-        int nranges = mask_vectorize_count(set.masks.slice(set.anims_submasks(i)));
-        
-        out.anims_subranges(i) = { ranges_i, ranges_i + nranges };
-        
-        ranges_i += nranges;
+        query_expr_evaluate_range_set(result, it.second.query, range_sets, scratch);
+        benchmark_check_exact("update", it.second.result, result);
     }
     
-    // Add those ranges
-    out.ranges.resize(ranges_i);
-    for (int i = 0; i < out.anims.size; i++)
+    double invalidate_ms = benchmark_time([&]() 
     { 
-        mask_vectorize(
-            out.ranges.slice(out.anims_subranges(i)),
-            set.masks.slice(set.anims_submasks(i)));
+        cache.invalidate(5);
+        query_expr_evaluate_range_set(result, query, range_sets, cache);
+    });
+    
+    printf("  update %7.3f ms, invalidate and evaluate %7.3f ms\n", update_ms, invalidate_ms);
+    
+    // Force some evictions, then check clearing resets 
+    // the inflation they caused as well as the entries
+    cache.budget = cache.bytes / 2;
+    query_expr_evaluate_range_set(result, (q1 & q3) | (q2 & q4), range_sets, cache);
+    double inflation = cache.inflation;
+    cache.clear();
+    
+    if (inflation == 0.0 || cache.inflation != 0.0 || cache.entries.size() != 0 || cache.bytes != 0)
+    {
+        printf("  MISMATCH: clear\n");
     }
 }
 
-//--------------------------------------
-
-// The below are some quick and messy
-// functions for parsing the user input 
-// string. Essentially they either move 
-// the input pointer `i` forward and 
-// return a expression in `query` or 
-// they return an error in `err`
-
-void query_expr_parse_union(
-  int& i, 
-  query_expr& query,
-  char* err,
-  const std::vector<std::string> tag_names, 
-  const char* query_string);
-
-void query_expr_parse_identifier(
-  int& i, 
-  query_expr& query,
-  char* err,
-  const std::vector<std::string> tag_names, 
-  const char* query_string)
+void benchmark_file(std::mt19937& gen)
 {
-    std::string identifier;
+    std::vector<std::string> tag_names;
+    std::vector<range_set> range_sets;
+    std::vector<mask_set> mask_sets;
     
-    while (isalnum(query_string[i]))
+    benchmark_random_database(range_sets, gen, 8, 50000, 1000);
+    
+    for (int i = 0; i < (int)range_sets.size(); i++)
     {
-        identifier += query_string[i];
-        i++;
+        tag_names.push_back("Tag" + std::to_string(i));
     }
     
-    auto it = std::find(tag_names.begin(), tag_names.end(), identifier);
+    const char* filename = "ranges_bench.bin";
     
-    if (it != tag_names.end())
-    {
-        query = query_expr(it - tag_names.begin());
-        return;
-    }
-    else
-    {
-        sprintf(err, "Unknown tag name: \"%s\"\n", identifier.c_str());
-        return;
-    }
+    printf("File (%i anims)\n", range_sets[0].anims.size);
+    
+    bool saved = false;
+    double save_ms = benchmark_time([&]() { saved = tag_data_save(filename, tag_names, range_sets, mask_sets); }, 1);
+    assert(saved);
+    
+    tag_data_file file;
+    std::vector<std::string> loaded_names;
+    std::vector<range_set> loaded_range_sets;
+    std::vector<mask_set> loaded_mask_sets;
+    
+    double load_ms = benchmark_time([&]() { tag_data_load(file, loaded_names, loaded_range_sets, loaded_mask_sets, filename); });
+    
+    query_expr q1(1), q2(2), q3(3), q4(4);
+    query_expr query = (q1 | q2) & (q3 - q4);
+    range_set result;
+    query_expr_scratch scratch;
+    
+    double query_ms = benchmark_time([&]() { query_expr_evaluate_range_set(result, query, loaded_range_sets, scratch); });
+    
+    printf("  save %7.3f ms, load %7.3f ms (%i MB), query on loaded %7.3f ms\n", 
+        save_ms, load_ms, (int)(file.size >> 20), query_ms);
+    
+    loaded_range_sets.clear();
+    tag_data_close(file);
+    remove(filename);
 }
 
-void query_expr_parse_expression(
-    int& i, 
-    query_expr& query,
-    char* err,
-    const std::vector<std::string> tag_names, 
-    const char* query_string)
+void benchmark_import(std::mt19937& gen)
 {
-    while (isspace(query_string[i])) { i++; }
+    std::vector<range_set> range_sets;
     
-    if (query_string[i] == '(')
+    int nanims = 2000;
+    int nframes = 500;
+    
+    benchmark_random_database(range_sets, gen, 8, nanims, nframes);
+    
+    // Write the same data as ascii and CSV
+    
+    std::string ascii;
+    std::string csv = "tag,anim,start,stop\n";
+    
+    for (int i = 0; i < (int)range_sets.size(); i++)
     {
-        i++;
-        
-        query_expr_parse_union(
-            i,
-            query,
-            err,
-            tag_names,
-            query_string);
-            
-        if (strlen(err)) { return; }
+        const range_set& set = range_sets[i];
+        std::string name = "Tag" + std::to_string(i);
         
-        while (isspace(query_string[i])) { i++; }
+        ascii += name + "  ";
         
-        if (query_string[i] != ')')
+        for (int a = 0, j = 0; a < nanims; a++)
         {
-            sprintf(err, "Unmatched parenthesis\n");
-            return;
+            std::string frames(nframes, ' ');
+            
+            if (j < set.anims.size && set.anims(j) == a)
+            {
+                for (int r = set.anims_subranges(j).start; r < set.anims_subranges(j).stop; r++)
+                {
+                    std::fill(frames.begin() + set.ranges(r).start, frames.begin() + set.ranges(r).stop, '#');
+                    
+                    csv += name + "," + std::to_string(a) + "," + 
+                        std::to_string(set.ranges(r).start) + "," + 
+                        std::to_string(set.ranges(r).stop) + "\n";
+                }
+                j++;
+            }
+            
+            ascii += "|" + frames + "| ";
         }
         
-        i++;
-        
-        return;
+        ascii += "\n";
     }
-    else if (isalnum(query_string[i]))
+    
+    printf("Import (%i MB ascii, %i MB csv)\n", (int)(ascii.size() >> 20), (int)(csv.size() >> 20));
+    
+    std::vector<std::string> tag_names;
+    std::vector<range_set> tag_range_sets;
+    thread_pool pool;
+    
+    double ascii_ms = benchmark_time([&]() 
+    { 
+        tag_names.clear();
+        tag_range_sets.clear();
+        parse_tag_data(tag_names, tag_range_sets, ascii.c_str()); 
+    });
+    
+    double parallel_ms = benchmark_time([&]() 
+    { 
+        tag_names.clear();
+        tag_range_sets.clear();
+        parse_tag_data(tag_names, tag_range_sets, ascii.c_str(), pool); 
+    });
+    
+    double csv_ms = benchmark_time([&]() 
+    { 
+        tag_names.clear();
+        tag_range_sets.clear();
+        parse_tag_data_csv(tag_names, tag_range_sets, csv.c_str()); 
+    });
+    
+    printf("  ascii %7.3f ms (%5.0f MB/s), parallel %7.3f ms, csv %7.3f ms (%5.0f MB/s)\n", 
+        ascii_ms, ascii.size() / (1000.0 * ascii_ms), parallel_ms, 
+        csv_ms, csv.size() / (1000.0 * csv_ms));
+    
+    for (int i = 0; i < (int)range_sets.size(); i++)
     {
-        query_expr_parse_identifier(
-            i, query, err, tag_names, query_string);
-        return;
+        benchmark_check("csv import", tag_range_sets[i], range_sets[i]);
     }
-    else if (query_string[i] == '\0')
+    
+    // Rows inside earlier, wider rows are merged into them
+    
+    tag_names.clear();
+    tag_range_sets.clear();
+    parse_tag_data_csv(tag_names, tag_range_sets, "A,0,0,10\nA,0,2,5\nA,0,7,9\nA,1,3,4\n");
+    
+    range_set nested;
+    nested.anims = array1d<int>(2);
+    nested.anims_subranges = array1d<range>(2);
+    nested.ranges = array1d<range>(2);
+    nested.anims(0) = 0; nested.anims_subranges(0) = { 0, 1 }; nested.ranges(0) = { 0, 10 };
+    nested.anims(1) = 1; nested.anims_subranges(1) = { 1, 2 }; nested.ranges(1) = { 3, 4 };
+    
+    if (benchmark_check("csv nested rows", tag_range_sets[0], nested) && tag_range_sets[0].ranges.size != 2)
     {
-        sprintf(err, "Unexpected end of input\n");
-        return;
+        printf("  MISMATCH: csv nested rows left %i ranges\n", tag_range_sets[0].ranges.size);
     }
-    else
+    
+    // Spaces inside ascii tag names are dropped
+    
+    tag_names.clear();
+    tag_range_sets.clear();
+    parse_tag_data(tag_names, tag_range_sets, " Walk To Run |  ## |\n");
+    
+    if (tag_names[0] != "WalkToRun")
     {
-        sprintf(err, "Syntax Error at '%c'\n", query_string[i]);
-        return;
+        printf("  MISMATCH: ascii tag name \"%s\"\n", tag_names[0].c_str());
     }
 }
 
-void query_expr_parse_difference(
-  int& i, 
-  query_expr& query,
-  char* err,
-  const std::vector<std::string> tag_names, 
-  const char* query_string)
+void benchmark_parse(std::mt19937& gen)
 {
-    query_expr_parse_expression(
-      i,
-      query,
-      err,
-      tag_names,
-      query_string);
+    std::vector<std::string> tag_names;
     
-    if (strlen(err)) { return; }
+    for (int i = 0; i < 50000; i++)
+    {
+        tag_names.push_back("Tag" + std::to_string(i));
+    }
     
-    while (isspace(query_string[i])) { i++; }
+    tag_dictionary tags;
+    double build_ms = benchmark_time([&]() { tag_dictionary_build(tags, tag_names); });
     
-    while (query_string[i] == '-')
-    {   
-        i++;
-        
-        query_expr expr;
-        
-        query_expr_parse_expression(
-          i,
-          expr,
-          err,
-          tag_names,
-          query_string);
-        
-        if (strlen(err)) { return; }
-        
-        query = query - expr;
-      
-        while (isspace(query_string[i])) { i++; }
-    }
-}
-
-void query_expr_parse_intersection(
-  int& i, 
-  query_expr& query,
-  char* err,
-  const std::vector<std::string> tag_names, 
-  const char* query_string)
-{
-    query_expr_parse_difference(
-      i,
-      query,
-      err,
-      tag_names,
-      query_string);
-  
-    if (strlen(err)) { return; }
+    // Long query mixing every operator
+    
+    auto name = [&]() { return tag_names[gen() % tag_names.size()]; };
+    
+    std::string query_string = name();
     
-    while (isspace(query_string[i])) { i++; }
+    for (int i = 0; i < 250; i++)
+    {
+        query_string += " | (" + name() + " | " + name() + " & " + name() + ") - " + name();
+    }
     
-    while (query_string[i] == '&')
+    query_expr query;
+    char err[1024];
+    
+    double parse_ms = benchmark_time([&]() 
     {
-        i++;
-        
-        query_expr diff;
-        
-        query_expr_parse_difference(
-          i,
-          diff,
-          err,
-          tag_names,
-          query_string);
-        
-        if (strlen(err)) { return; }
-        
-        query = query & diff;
-        
-        while (isspace(query_string[i])) { i++; }
+        int i = 0;
+        err[0] = '\0';
+        query_expr_parse_union(i, query, err, tags, query_string.c_str());
+    });
+    
+    assert(strlen(err) == 0);
+    
+    printf("Parse (%i tags, %i identifiers)\n", (int)tag_names.size(), 1001);
+    printf("  build dictionary %7.3f ms, parse %7.3f ms\n", build_ms, parse_ms);
+    
+    // Names after a repeated name keep the index of their
+    // set, as when ascii and then CSV data are imported
+    
+    tag_dictionary_build(tags, { "Walk", "Run", "Walk", "Jump" });
+    
+    int i = 0;
+    err[0] = '\0';
+    query_expr_parse_union(i, query, err, tags, "Jump");
+    
+    if (strlen(err) || 
+        query.stack.size != 1 ||
+        query.stack(0) != 3 || 
+        tag_dictionary_find(tags, "Walk") != 0 ||
+        tag_dictionary_find(tags, "Run") != 1)
+    {
+        printf("  MISMATCH: repeated tag name\n");
     }
 }
 
-void query_expr_parse_union(
-  int& i, 
-  query_expr& query,
-  char* err,
-  const std::vector<std::string> tag_names, 
-  const char* query_string)
+void benchmark_vectorize(std::mt19937& gen)
 {
-    query_expr_parse_intersection(
-      i,
-      query,
-      err,
-      tag_names,
-      query_string);
-  
-    if (strlen(err)) { return; }
+    std::vector<range_set> range_sets;
     
-    while (isspace(query_string[i])) { i++; }
+    benchmark_random_database(range_sets, gen, 6, 50000, 1000);
     
-    while (query_string[i] == '|')
-    {   
-        i++;
-  
-        query_expr inter;
-        
-        query_expr_parse_intersection(
-          i,
-          inter,
-          err,
-          tag_names,
-          query_string);
-        
-        if (strlen(err)) { return; }
+    printf("Vectorize (%i anims)\n", range_sets[0].anims.size);
+    
+    range_set result;
+    mask_set masks;
+    
+    for (int i = 1; i < (int)range_sets.size(); i++)
+    {
+        range_set_rasterize(masks, range_sets[i], range_sets[0]);
         
-        query = query | inter;
+        double vectorize_ms = benchmark_time([&]() { mask_set_vectorize(result, masks); });
         
-        while (isspace(query_string[i])) { i++; }
+        printf("  tag %i %8i ranges %7.3f ms (%5.1f GB/s)\n", i, range_sets[i].ranges.size, 
+            vectorize_ms, (masks.masks.size / 8) / (1e6 * vectorize_ms));
     }
 }
 
-//--------------------------------------
-
-// These functions are for parsing the tag data from 
-// the ascii representation embedded in this file
-
-int parse_tag_data_tag_name(
-    int i,
-    std::vector<std::string>& tag_names,
-    std::vector<range_set>& tag_range_sets,
-    const char* tag_data_string)
+void benchmark_rasterize(std::mt19937& gen)
 {
-    tag_names.push_back("");
-    tag_range_sets.push_back(range_set());
+    std::vector<range_set> range_sets;
     
-    while (tag_data_string[i] != '|')
-    {
-        if (isascii(tag_data_string[i]) && !isspace(tag_data_string[i]))
+    benchmark_random_database(range_sets, gen, 6, 50000, 1000);
+    
+    printf("Rasterize (%i anims, %i tags)\n", range_sets[0].anims.size, (int)range_sets.size());
+    
+    std::vector<mask_set> mask_sets(range_sets.size());
+    thread_pool pool;
+    
+    double serial_ms = benchmark_time([&]() 
+    { 
+        for (int i = 0; i < (int)range_sets.size(); i++)
         {
-            tag_names.back() += tag_data_string[i];
+            range_set_rasterize(mask_sets[i], range_sets[i], range_sets[0]);
         }
-        i++;
-    }
+    });
     
-    return i;
+    double parallel_ms = benchmark_time([&]() { range_set_rasterize(mask_sets, range_sets, range_sets[0], pool); });
+    
+    int64_t bytes = 0;
+    for (const mask_set& set : mask_sets) { bytes += set.masks.size / 8; }
+    
+    printf("  serial %7.3f ms (%5.1f GB/s), all tags parallel %7.3f ms\n", 
+        serial_ms, bytes / (1e6 * serial_ms), parallel_ms);
 }
 
-int parse_tag_data_anim(
-    int i,
-    int anim_id,
-    range_set& set,
-    const char* tag_data_string)
+void benchmark_hybrid(std::mt19937& gen)
 {
-    while (tag_data_string[i] != '|') { i++; }
-    i++;
+    std::vector<range_set> range_sets;
+    std::vector<mask_set> mask_sets;
+    std::vector<hybrid_set> hybrid_sets;
+    
+    benchmark_random_database(range_sets, gen, 8, 20000, 1000);
     
-    int offset = i;
-    bool active = false;
+    mask_sets.resize(range_sets.size());
+    hybrid_sets.resize(range_sets.size());
     
-    array1d<range> tag_ranges;
+    size_t range_bytes = 0, mask_bytes = 0, hybrid_bytes = 0;
     
-    while (tag_data_string[i] != '|')
+    for (int i = 0; i < (int)range_sets.size(); i++)
     {
-        if (!active && (tag_data_string[i] == '#'))
-        {
-            tag_ranges.resize(tag_ranges.size + 1);
-            tag_ranges(tag_ranges.size - 1).start = i - offset;
-            active = true;
-        }
-        else if (active && !(tag_data_string[i] == '#'))
-        {
-            tag_ranges(tag_ranges.size -  1).stop = i - offset;
-            active = false;
-        }
+        range_set_rasterize(mask_sets[i], range_sets[i], range_sets[0]);
+        range_set_hybridize(hybrid_sets[i], range_sets[i], range_sets[0]);
         
-        i++;
+        range_bytes += memory_usage(range_sets[i]);
+        mask_bytes += memory_usage(mask_sets[i]);
+        hybrid_bytes += memory_usage(hybrid_sets[i]);
     }
     
-    if (active)
-    {
-        tag_ranges(tag_ranges.size -  1).stop = i - offset;
-        active = false;
-    }
+    printf("Hybrid (%i anims)\n", range_sets[0].anims.size);
+    printf("  memory ranges %5.1f MB, masks %5.1f MB, hybrid %5.1f MB\n", 
+        range_bytes / 1e6, mask_bytes / 1e6, hybrid_bytes / 1e6);
     
-    if (tag_ranges.size != 0)
-    { 
-        int new_anim_size = set.anims.size + 1;
-        int old_range_size = set.ranges.size;
-        int new_range_size = old_range_size + tag_ranges.size;
-
-        set.anims.resize(new_anim_size);
-        set.anims_subranges.resize(new_anim_size);
-        set.ranges.resize(new_range_size);
-        
-        set.anims(new_anim_size - 1) = anim_id;
-        set.anims_subranges(new_anim_size - 1) = { old_range_size, new_range_size };        
-        set.ranges.slice(old_range_size, new_range_size) = tag_ranges;
-    }
+    // Pairs mixing sparse and fragmented tags
     
-    i++;
+    query_expr q1(1), q2(2), q4(4), q5(5), q6(6);
+    query_expr queries[] = { q1 & q6, q5 | q6, q6 - q4, (q1 | q2) & (q5 - q6) };
     
-    return i;
-}
-
-void parse_tag_data(
-    std::vector<std::string>& tag_names,
-    std::vector<range_set>& tag_range_sets,
-    const char* tag_data_string)
-{
-    int i = 0;
-    while (tag_data_string[i] != '\0')
-    {   
-        i = parse_tag_data_tag_name(i, tag_names, tag_range_sets, tag_data_string);
+    range_set range_result;
+    mask_set mask_result;
+    hybrid_set hybrid_result;
+    range_set hybrid_ranges;
+    query_expr_scratch scratch;
+    query_expr_hybrid_scratch hybrid_scratch;
+    
+    for (int i = 0; i < (int)(sizeof(queries) / sizeof(queries[0])); i++)
+    {
+        double range_ms = benchmark_time([&]() { query_expr_evaluate_range_set(range_result, queries[i], range_sets, scratch); });
+        double mask_ms = benchmark_time([&]() { query_expr_evaluate_mask_set(mask_result, queries[i], mask_sets, scratch); });
+        double hybrid_ms = benchmark_time([&]() { query_expr_evaluate_hybrid_set(hybrid_result, queries[i], hybrid_sets, hybrid_scratch); });
         
-        int anim_id = 0;
-        while (tag_data_string[i] != '\n')
-        {
-            i = parse_tag_data_anim(i, anim_id, tag_range_sets.back(), tag_data_string);
-            anim_id++;
-        }
+        printf("  query %i ranges %7.3f ms, masks %7.3f ms, hybrid %7.3f ms\n", i, range_ms, mask_ms, hybrid_ms);
         
-        i++;
+        hybrid_set_vectorize(hybrid_ranges, hybrid_result);
+        benchmark_check("hybrid query", hybrid_ranges, range_result);
     }
 }
 
-int tag_index(const std::vector<std::string>& tag_names, std::string name)
+void benchmark_roaring(std::mt19937& gen)
 {
-    auto it = std::find(tag_names.begin(), tag_names.end(), name);
+    std::vector<range_set> range_sets;
+    std::vector<mask_set> mask_sets;
+    std::vector<roaring_set> roaring_sets;
+    
+    benchmark_random_database(range_sets, gen, 8, 20000, 1000);
+    
+    mask_sets.resize(range_sets.size());
+    roaring_sets.resize(range_sets.size());
+    
+    size_t mask_bytes = 0, roaring_bytes = 0;
     
-    if (it != tag_names.end())
+    for (int i = 0; i < (int)range_sets.size(); i++)
     {
-        return it - tag_names.begin();
+        range_set_rasterize(mask_sets[i], range_sets[i], range_sets[0]);
+        mask_set_compress(roaring_sets[i], mask_sets[i]);
+        
+        mask_bytes += memory_usage(mask_sets[i]);
+        roaring_bytes += memory_usage(roaring_sets[i]);
     }
     
-    assert(false);
-    return -1;
-}
-
-//--------------------------------------
-
-int index_of(slice1d<int> x, int y)
-{
-    for (int i = 0; i < x.size; i++)
+    printf("Roaring (%i anims)\n", range_sets[0].anims.size);
+    printf("  memory masks %5.1f MB, roaring %5.1f MB\n", mask_bytes / 1e6, roaring_bytes / 1e6);
+    
+    range_set roaring_ranges;
+    
+    double compress_ms = benchmark_time([&]() { range_set_compress(roaring_sets[6], range_sets[6], range_sets[0]); });
+    double vectorize_ms = benchmark_time([&]() { roaring_set_vectorize(roaring_ranges, roaring_sets[6]); });
+    
+    printf("  compress %7.3f ms, vectorize %7.3f ms\n", compress_ms, vectorize_ms);
+    
+    benchmark_check("roaring compress", roaring_ranges, range_sets[6]);
+    
+    query_expr q1(1), q2(2), q4(4), q5(5), q6(6);
+    query_expr queries[] = { q1 & q6, q5 | q6, q6 - q4, (q1 | q2) & (q5 - q6) };
+    
+    range_set range_result;
+    mask_set mask_result;
+    roaring_set roaring_result;
+    query_expr_scratch scratch;
+    query_expr_roaring_scratch roaring_scratch;
+    
+    for (int i = 0; i < (int)(sizeof(queries) / sizeof(queries[0])); i++)
     {
-        if (x(i) == y) return i;
+        double mask_ms = benchmark_time([&]() { query_expr_evaluate_mask_set(mask_result, queries[i], mask_sets, scratch); });
+        double roaring_ms = benchmark_time([&]() { query_expr_evaluate_roaring_set(roaring_result, queries[i], roaring_sets, roaring_scratch); });
+        
+        printf("  query %i masks %7.3f ms, roaring %7.3f ms\n", i, mask_ms, roaring_ms);
+        
+        query_expr_evaluate_range_set(range_result, queries[i], range_sets, scratch);
+        roaring_set_vectorize(roaring_ranges, roaring_result);
+        benchmark_check("roaring query", roaring_ranges, range_result);
     }
-    return -1;
-}
-
-void draw_anim_names(
-    const range_set& all_tag_range_set,
-    int height,
-    int scale = 8)
-{
-    int padding = 10;
     
-    int offset = 150;
+    // Anims much longer than a chunk, so ranges are split 
+    // at chunk boundaries and joined back together, checked
+    // through ranges and through masks
+    std::vector<range_set> long_sets;
+    benchmark_random_database(long_sets, gen, 8, 20, 200000);
     
-    for (int i = 0; i < all_tag_range_set.anims.size; i++)
-    {   
-        DrawText(TextFormat("Anim %i", i), 
-          offset + scale * (all_tag_range_set.ranges(i).stop / 2) - 20, height, 20, DARKGRAY);
+    std::vector<roaring_set> long_roaring_sets(long_sets.size());
+    
+    for (int i = 0; i < (int)long_sets.size(); i++)
+    {
+        range_set_compress(long_roaring_sets[i], long_sets[i], long_sets[0]);
         
-        offset += scale * all_tag_range_set.ranges(i).stop + padding;
+        roaring_set_vectorize(roaring_ranges, long_roaring_sets[i]);
+        benchmark_check("roaring long compress", roaring_ranges, long_sets[i]);
+        
+        roaring_set_rasterize(mask_result, long_roaring_sets[i]);
+        mask_set_compress(roaring_result, mask_result);
+        roaring_set_vectorize(roaring_ranges, roaring_result);
+        benchmark_check("roaring long masks", roaring_ranges, long_sets[i]);
     }
     
+    for (int i = 0; i < (int)(sizeof(queries) / sizeof(queries[0])); i++)
+    {
+        query_expr_evaluate_range_set(range_result, queries[i], long_sets, scratch);
+        query_expr_evaluate_roaring_set(roaring_result, queries[i], long_roaring_sets, roaring_scratch);
+        roaring_set_vectorize(roaring_ranges, roaring_result);
+        benchmark_check("roaring long query", roaring_ranges, range_result);
+    }
 }
 
-void draw_tag_range_set(
-    const char* tag_name,
-    const range_set& tag_range_set,
-    const range_set& all_tag_range_set,
-    int height,
-    Color color,
-    int scale = 8)
+void benchmark_index(std::mt19937& gen)
 {
-    DrawText(tag_name, 20, height, 20, DARKGRAY);
+    std::vector<range_set> range_sets;
     
-    int padding = 10;
+    benchmark_random_database(range_sets, gen, 8, 20000, 1000);
     
-    int offset = 150;
-
-    for (int i = 0; i < all_tag_range_set.anims.size; i++)
-    {   
-        int j = index_of(tag_range_set.anims, i);
-        if (j != -1)
+    int ntags = (int)range_sets.size();
+    const range_set& all = range_sets[0];
+    
+    tag_frame_index index;
+    double build_ms = benchmark_time([&]() { tag_frame_index_build(index, range_sets); }, 3);
+    
+    size_t range_sets_bytes = 0;
+    for (const range_set& set : range_sets)
+    {
+        range_sets_bytes += memory_usage(set);
+    }
+    
+    printf("Index (%i anims, %i tags)\n", all.anims.size, ntags);
+    printf("  build %7.3f ms, memory %5.1f MB, range sets %5.1f MB\n", 
+        build_ms, memory_usage(index) / 1e6, range_sets_bytes / 1e6);
+    
+    // Random frames of random anims
+    
+    int nqueries = 100000;
+    array1d<int> anims(nqueries);
+    array1d<int> frames(nqueries);
+    
+    std::uniform_int_distribution<int> anim_dist(0, all.anims.size - 1);
+    
+    for (int i = 0; i < nqueries; i++)
+    {
+        anims(i) = anim_dist(gen);
+        frames(i) = std::uniform_int_distribution<int>(0, all.ranges(anims(i)).stop - 1)(gen);
+    }
+    
+    int linear_count = 0, search_count = 0, index_count = 0;
+    
+    // Finding each anim and scanning its ranges tag by tag
+    double linear_ms = benchmark_time([&]() 
+    {
+        linear_count = 0;
+        for (int i = 0; i < nqueries; i++)
         {
-            int start = tag_range_set.anims_subranges(j).start;
-            int stop = tag_range_set.anims_subranges(j).stop;
-            for (int k = start; k < stop; k++)
+            for (int t = 0; t < ntags; t++)
             {
-                Rectangle rec = {
-                  (float)offset + scale * tag_range_set.ranges(k).start + 2, 
-                  (float)height, 
-                  (float)scale * (tag_range_set.ranges(k).stop - tag_range_set.ranges(k).start) - 4, 
-                  (float)20,
-                };
-                  
-                DrawRectangleRounded(rec, 0.1f, 0, Fade(color, 0.4f));
-                DrawRectangleRoundedLines(rec, 0.1f, 0, 2.0f, Fade(color, 0.8f));
+                const range_set& set = range_sets[t];
+                
+                int j = 0;
+                while (j < set.anims.size && set.anims(j) != anims(i)) { j++; }
+                if (j == set.anims.size) { continue; }
+                
+                for (int k = set.anims_subranges(j).start; k < set.anims_subranges(j).stop; k++)
+                {
+                    if (set.ranges(k).start <= frames(i) && frames(i) < set.ranges(k).stop) { linear_count++; break; }
+                }
             }
         }
-        
-        offset += scale * all_tag_range_set.ranges(i).stop + padding;
-    }
+    }, 1);
     
-    offset = 150;
+    double search_ms = benchmark_time([&]() 
+    {
+        search_count = 0;
+        for (int i = 0; i < nqueries; i++)
+        {
+            for (int t = 0; t < ntags; t++)
+            {
+                search_count += range_set_contains(range_sets[t], anims(i), frames(i));
+            }
+        }
+    });
     
-    for (int i = 0; i < all_tag_range_set.anims.size; i++)
-    {   
-        DrawLine(offset - 1, height - 3, offset - 1, height + 23, GRAY);
-        offset += scale * all_tag_range_set.ranges(i).stop;
-        DrawLine(offset + 1, height - 3, offset + 1, height + 23, GRAY);        
-        offset += padding;
+    double index_ms = benchmark_time([&]() 
+    {
+        index_count = 0;
+        for (int i = 0; i < nqueries; i++)
+        {
+            const uint64_t* tags = tag_frame_index_tags(index, anims(i), frames(i));
+            
+            for (int w = 0; w < index.nwords; w++)
+            {
+                index_count += bit_popcount64(tags[w]);
+            }
+        }
+    });
+    
+    printf("  %i lookups linear %8.3f ms, binary search %7.3f ms, index %7.3f ms (%i active)\n", 
+        nqueries, linear_ms, search_ms, index_ms, index_count);
+    
+    if (linear_count != index_count || search_count != index_count)
+    {
+        printf("  MISMATCH: active tags linear %i, binary search %i, index %i\n", 
+            linear_count, search_count, index_count);
     }
+}
+
+int benchmark()
+{
+    std::mt19937 gen(1234);
     
+    benchmark_ranges(gen);
+    benchmark_queries(gen);
+    benchmark_parallel(gen);
+    benchmark_batch(gen);
+    benchmark_update(gen);
+    benchmark_file(gen);
+    benchmark_import(gen);
+    benchmark_parse(gen);
+    benchmark_vectorize(gen);
+    benchmark_rasterize(gen);
+    benchmark_hybrid(gen);
+    benchmark_roaring(gen);
+    benchmark_index(gen);
+    
+    return 0;
 }
 
+#endif
+
 //--------------------------------------
 
 void update_callback(void* args)
@@ -1728,6 +9527,10 @@ void update_callback(void* args)
 
 int main(void)
 {
+#if defined(RANGES_BENCHMARK)
+    return benchmark();
+#endif
+
     // Should we use text input or a hard-coded query
     bool use_hardcoded = false;
 
@@ -1780,23 +9583,52 @@ int main(void)
         tag_range_sets,
         use_hardcoded ? tag_data_string_alt : tag_data_string);
     
+    tag_dictionary tags;
+    tag_dictionary_build(tags, tag_names);
+    
     // Convert to masks
     
-    tag_mask_sets.resize(tag_range_sets.size());
+    thread_pool pool;
     
-    for (int i = 0; i < tag_range_sets.size(); i++)
-    {
-        range_set_rasterize(
-            tag_mask_sets[i],
-            tag_range_sets[i],
-            tag_range_sets[0]);
-    }
+    range_set_rasterize(
+        tag_mask_sets,
+        tag_range_sets,
+        tag_range_sets[0],
+        pool);
+    
+    // Hybrid sets are only built the first time they are used
+    
+    std::vector<hybrid_set> tag_hybrid_sets;
     
     // Caches
     
     query_expr_range_set_cache range_cache;
     query_expr_mask_set_cache mask_cache;
     
+    // Scratch space for evaluating uncached queries
+    
+    query_expr_scratch scratch;
+    query_expr_hybrid_scratch hybrid_scratch;
+    
+    // Hard-coded query only needs compiling once
+    
+    query_expr hardcoded_query;
+    query_program hardcoded_program;
+    
+    if (use_hardcoded)
+    {
+        query_expr Male(tag_index(tags, "Male"));
+        query_expr Female(tag_index(tags, "Female"));
+        query_expr Running(tag_index(tags, "Running"));
+        query_expr Walking(tag_index(tags, "Walking"));
+        query_expr Tired(tag_index(tags, "Tired"));
+        query_expr Limping(tag_index(tags, "Limping"));
+        
+        hardcoded_query = Running & Male & (Tired | Limping);
+        
+        query_program_compile(hardcoded_program, hardcoded_query);
+    }
+    
     // Init Window
     
     const int screen_width = 1280;
@@ -1832,13 +9664,22 @@ int main(void)
     
     char query_buffer[1024];
     char error_buffer[1024];
+    char parsed_buffer[1024];
     
     query_buffer[0] = '\0';
     error_buffer[0] = '\0';
+    parsed_buffer[0] = '\0';
+    
+    // Query parsed from the text box, kept until the 
+    // text changes
+    query_expr query;
     
     // Should we use masks to do the query?
     bool use_masks = false;
     
+    // Or the hybrid of ranges and masks?
+    bool use_hybrid = false;
+    
     // Go
 
     auto update_func = [&]()
@@ -1872,80 +9713,78 @@ int main(void)
         
         /* Parse and evaluate query */
         
-        error_buffer[0] = '\0';
-
-        query_expr query;
         range_set query_range_set;
         mask_set query_mask_set;
+        hybrid_set query_hybrid_set;
         
         if (use_hardcoded)
         {
-            query_expr Male(tag_index(tag_names, "Male"));
-            query_expr Female(tag_index(tag_names, "Female"));
-            query_expr Running(tag_index(tag_names, "Running"));
-            query_expr Walking(tag_index(tag_names, "Walking"));
-            query_expr Tired(tag_index(tag_names, "Tired"));
-            query_expr Limping(tag_index(tag_names, "Limping"));
-            
-            query = Running & Male & (Tired | Limping);
-            
-            query_expr_evaluate_range_set(query_range_set, query, tag_range_sets);
+            query_program_evaluate_range_set(query_range_set, hardcoded_program, tag_range_sets, scratch);
         }
         else
         {
-            if (strlen(query_buffer))
+            // Only parse and optimize the query when its text changes
+            if (strcmp(query_buffer, parsed_buffer) != 0)
             {
-                int i = 0;
-                query_expr_parse_union(
-                    i,
-                    query,
-                    error_buffer,
-                    tag_names,
-                    query_buffer);
+                strcpy(parsed_buffer, query_buffer);
+                error_buffer[0] = '\0';
+                query = query_expr();
                 
-                if (strlen(error_buffer))
-                {   
-                    query_range_set = tag_range_sets[1];
-                }
-                else
-                {   
-                    if (use_masks)
+                if (strlen(query_buffer))
+                {
+                    int i = 0;
+                    query_expr_parse_union(
+                        i,
+                        query,
+                        error_buffer,
+                        tags,
+                        query_buffer);
+                    
+                    if (!strlen(error_buffer))
                     {
-                        auto lookup = mask_cache.find(query);
-                  
-                        if (lookup != mask_cache.end())
-                        {
-                            query_mask_set = lookup->second;
-                        }
-                        else
-                        {
-                            query_expr_evaluate_mask_set(query_mask_set, query, tag_mask_sets);
-                            mask_cache[query] = query_mask_set;
-                        }
-                        
-                        mask_set_vectorize(
-                            query_range_set,
-                            query_mask_set);
+                        // Optimized queries are also canonical so 
+                        // equivalent queries share cache entries
+                        query_expr_optimize(query, query, tag_range_sets);
                     }
-                    else
+                }
+            }
+            
+            if (!strlen(query_buffer) || strlen(error_buffer))
+            {
+                query_range_set = tag_range_sets[1];
+            }
+            else if (use_hybrid)
+            {
+                if (tag_hybrid_sets.empty())
+                {
+                    tag_hybrid_sets.resize(tag_range_sets.size());
+                    
+                    for (int i = 0; i < (int)tag_range_sets.size(); i++)
                     {
-                        auto lookup = range_cache.find(query);
-                  
-                        if (lookup != range_cache.end())
-                        {
-                            query_range_set = lookup->second;
-                        }
-                        else
-                        {
-                            query_expr_evaluate_range_set(query_range_set, query, tag_range_sets);
-                            range_cache[query] = query_range_set;
-                        }
+                        range_set_hybridize(
+                            tag_hybrid_sets[i],
+                            tag_range_sets[i],
+                            tag_range_sets[0]);
                     }
                 }
+                
+                query_expr_evaluate_hybrid_set(query_hybrid_set, query, tag_hybrid_sets, hybrid_scratch);
+                
+                hybrid_set_vectorize(
+                    query_range_set,
+                    query_hybrid_set);
+            }
+            else if (use_masks)
+            {
+                query_expr_evaluate_mask_set(query_mask_set, query, tag_mask_sets, mask_cache);
+                
+                mask_set_vectorize(
+                    query_range_set,
+                    query_mask_set);
             }
             else
             {
-                query_range_set = tag_range_sets[1];
+                query_expr_evaluate_range_set(query_range_set, query, tag_range_sets, range_cache);
             }
         }
         
@@ -1999,4 +9838,4 @@ int main(void)
     CloseWindow();
 
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file